@@ -18,6 +18,9 @@
 #include <stdarg.h>
 #include <stdio.h>
 
+#include <algorithm>
+#include <atomic>
+
 
 //---------------------------------------------------------------------
 // BYTE ORDER & ALIGNMENT
@@ -67,6 +70,17 @@ constexpr uint32_t IKCP_CMD_PUSH = 81;		// cmd: push data
 constexpr uint32_t IKCP_CMD_ACK = 82;		// cmd: ack
 constexpr uint32_t IKCP_CMD_WASK = 83;		// cmd: window probe (ask)
 constexpr uint32_t IKCP_CMD_WINS = 84;		// cmd: window size (tell)
+constexpr uint32_t IKCP_CMD_SACK = 85;		// cmd: selective ack ranges
+constexpr uint32_t IKCP_CMD_COMPACT = 0x80;	// cmd flag: segment of a compact datagram
+constexpr uint32_t IKCP_CMD_FRGEXT = 0x20;	// cmd flag: frg bits 8-23 precede the payload
+constexpr uint32_t IKCP_FRGEXT_SIZE = 2;
+constexpr uint32_t IKCP_FRG_LIMIT = 1 << 24;	// fragments per message with IKCP_FEATURE_LARGE_MSG
+constexpr uint32_t IKCP_MSG_MAX = 1 << 26;		// default largest message reassembled by input()
+constexpr uint32_t IKCP_LARGE_INITIAL = 1 << 16;	// first buffer of a large message being reassembled
+constexpr uint32_t IKCP_CMD_STREAM = 0x08;	// cmd flag: stream id and gap precede the payload
+constexpr uint32_t IKCP_STREAMEXT_SIZE = 6;	// 16 bits stream id, 32 bits gap
+constexpr uint32_t IKCP_STREAM_MAX = 0xffff;
+constexpr uint64_t IKCP_STREAM_STRIDE = 1 << 16;	// scheduling pass of a byte at weight 1
 constexpr uint32_t IKCP_ASK_SEND = 1;		// need to send IKCP_CMD_WASK
 constexpr uint32_t IKCP_ASK_TELL = 2;		// need to send IKCP_CMD_WINS
 constexpr uint32_t IKCP_WND_SND = 32;
@@ -75,12 +89,24 @@ constexpr uint32_t IKCP_MTU_DEF = 1400;
 constexpr uint32_t IKCP_ACK_FAST = 3;
 constexpr uint32_t IKCP_INTERVAL = 100;
 constexpr uint32_t IKCP_OVERHEAD = 24;
+constexpr uint32_t IKCP_COMPACT_MIN = 12;		// conv, cmd, frg, wnd and four single byte varints
 constexpr uint32_t IKCP_DEADLINK = 20;
-constexpr uint32_t IKCP_THRESH_INIT = 2;
-constexpr uint32_t IKCP_THRESH_MIN = 2;
 constexpr uint32_t IKCP_PROBE_INIT = 7000;		// 7 secs to probe window size
 constexpr uint32_t IKCP_PROBE_LIMIT = 120000;	// up to 120 secs to probe window
 constexpr uint32_t IKCP_FASTACK_LIMIT = 5;		// max times to trigger fastack
+constexpr uint32_t IKCP_SACK_RANGE = 6;			// sack range: 32 bits first sn, 16 bits count
+constexpr uint32_t IKCP_FEATURE_ACK = 0x80;		// frg bit of WASK/WINS: remote features received
+constexpr uint32_t IKCP_FEATURE_MASK = 0x7f;
+constexpr uint32_t IKCP_ANNOUNCE_LIMIT = 10;	// max times to announce features or the ack delay
+constexpr uint32_t IKCP_PACING_GAIN = 125;		// percent of cwnd / srtt
+constexpr uint32_t IKCP_PACING_SPLIT = 4;		// sub-bursts per interval
+constexpr uint32_t IKCP_TUNE_GAIN = 200;		// percent of delivery rate * rtt
+constexpr uint32_t IKCP_TUNE_GAIN_NC = 125;	// snd_wnd without congestion window, it sets the rate
+constexpr uint32_t IKCP_TUNE_RTT_WINDOW = 10000;	// millisec a min rtt sample is kept
+constexpr uint32_t IKCP_WND_FIELD_MAX = 0xffff;	// wnd is sent in 16 bits
+constexpr uint32_t IKCP_WSCALE_MAX = 14;		// windows up to 2^30 segments
+constexpr uint32_t IKCP_NODE_OVERHEAD = 96;		// list / map / index nodes and shared_ptr control block of a segment
+constexpr uint32_t IKCP_ACKLIST_TRIM = 2;		// acklist is trimmed beyond this many times rcv_wnd
 
 
 //---------------------------------------------------------------------
@@ -157,6 +183,84 @@ static inline const char *ikcp_decode32u(const char *p, uint32_t *l)
 	return p;
 }
 
+/* encode 32 bits unsigned int as varint, 7 bits per byte */
+static inline char *ikcp_encode_varint(char *p, uint32_t v)
+{
+	while (v >= 0x80)
+	{
+		*(unsigned char*)p++ = (unsigned char)(v | 0x80);
+		v >>= 7;
+	}
+	*(unsigned char*)p++ = (unsigned char)v;
+	return p;
+}
+
+/* decode varint, returns nullptr when truncated or longer than 5 bytes */
+static inline const char *ikcp_decode_varint(const char *p, const char *end, uint32_t *v)
+{
+	uint32_t value = 0;
+	for (int shift = 0; shift < 35 && p < end; shift += 7)
+	{
+		unsigned char c = *(const unsigned char*)p++;
+		value |= (uint32_t)(c & 0x7f) << shift;
+		if ((c & 0x80) == 0)
+		{
+			*v = value;
+			return p;
+		}
+	}
+	return nullptr;
+}
+
+static inline int ikcp_varint_size(uint32_t v)
+{
+	int size = 1;
+	for (; v >= 0x80; v >>= 7) size++;
+	return size;
+}
+
+/* signed delta to unsigned, small magnitudes stay small */
+static inline uint32_t ikcp_zigzag(uint32_t delta)
+{
+	return (delta << 1) ^ (uint32_t)((int32_t)delta >> 31);
+}
+
+static inline uint32_t ikcp_unzigzag(uint32_t v)
+{
+	return (v >> 1) ^ (0 - (v & 1));
+}
+
+/* decode a compact segment header, see ikcp_encode_compact.
+   ts, sn and una hold the previous segment on entry */
+static const char *ikcp_decode_compact(const char *p, const char *end, uint8_t *cmd, uint8_t *frg,
+	uint16_t *wnd, uint32_t *ts, uint32_t *sn, uint32_t *una, uint32_t *len)
+{
+	uint32_t delta;
+	if (end - p < 8) return nullptr;
+	p = ikcp_decode8u(p, cmd);
+	p = ikcp_decode8u(p, frg);
+	p = ikcp_decode16u(p, wnd);
+	if ((p = ikcp_decode_varint(p, end, &delta)) == nullptr) return nullptr;
+	*ts += ikcp_unzigzag(delta);
+	if ((p = ikcp_decode_varint(p, end, &delta)) == nullptr) return nullptr;
+	*sn += ikcp_unzigzag(delta);
+	if ((p = ikcp_decode_varint(p, end, &delta)) == nullptr) return nullptr;
+	*una += ikcp_unzigzag(delta);
+	return ikcp_decode_varint(p, end, len);
+}
+
+//---------------------------------------------------------------------
+// window autotuning budget, shared by all sessions
+//---------------------------------------------------------------------
+static std::atomic<uint64_t> ikcp_tune_reserved{ 0 };
+static std::atomic<uint64_t> ikcp_tune_limit{ 0 };
+
+//---------------------------------------------------------------------
+// memory held by all sessions and its hard limit
+//---------------------------------------------------------------------
+static std::atomic<uint64_t> ikcp_memory_used{ 0 };
+static std::atomic<uint64_t> ikcp_memory_budget{ 0 };
+
 static inline uint32_t _imin_(uint32_t a, uint32_t b)
 {
 	return a <= b ? a : b;
@@ -177,6 +281,18 @@ static inline long _itimediff(uint32_t later, uint32_t earlier)
 	return ((int32_t)(later - earlier));
 }
 
+// bytes a queued segment is accounted for
+static inline uint64_t ikcp_segment_cost(const KCP::segment &seg)
+{
+	return sizeof(KCP::segment) + seg.len + IKCP_NODE_OVERHEAD;
+}
+
+// millisec from 'earlier' to 'later', 0 if 'later' is not after it
+static inline uint32_t _ielapsed(uint32_t later, uint32_t earlier)
+{
+	return _itimediff(later, earlier) > 0 ? later - earlier : 0;
+}
+
 // output queue
 void ikcp_qprint(const char *name, const struct IQUEUEHEAD *head)
 {
@@ -198,22 +314,52 @@ namespace KCP
 	// write log
 	void kcp_core::ikcp_log(int mask, const char *fmt, ...)
 	{
-		char buffer[1024];
-		va_list argptr;
-		if ((mask & this->logmask) == 0 || this->writelog == 0) return;
-		va_start(argptr, fmt);
-		vsprintf(buffer, fmt, argptr);
-		va_end(argptr);
-		this->writelog(buffer, this->user);
+		if constexpr (log_enabled)
+		{
+			char buffer[1024];
+			va_list argptr;
+			if ((mask & this->logmask) == 0 || this->writelog == 0) return;
+			va_start(argptr, fmt);
+			vsnprintf(buffer, sizeof(buffer), fmt, argptr);
+			va_end(argptr);
+			this->writelog(buffer, this->user);
+		}
 	}
 
-	// check log mask
-	int kcp_core::ikcp_canlog(int mask)
+	// check log mask, a constant 0 without IKCP_ENABLE_LOG so that every
+	// 'if (ikcp_canlog(...))' block is removed at compile time
+	inline int kcp_core::ikcp_canlog(int mask)
 	{
+		if constexpr (!log_enabled)
+			return 0;
 		if ((mask & this->logmask) == 0 || this->writelog == nullptr) return 0;
 		return 1;
 	}
 
+	// append a binary trace record, trace_mask is 0 without a ring
+	void kcp_core::record_trace(trace_event ev, uint32_t sn, uint32_t ts, uint32_t len, uint32_t xmit)
+	{
+		if ((this->trace_mask & trace_bit(ev)) == 0) return;
+		uint32_t cwnd = 0;
+		if (trace_bit(ev) & trace_cwnd_events)
+		{
+			cwnd = _imin_(this->snd_wnd, this->rmt_wnd);
+			if (this->nocwnd == 0) cwnd = _imin_(this->congestion->get_cwnd(), cwnd);
+		}
+
+		trace_record rec;
+		rec.time = this->current;
+		rec.conv = this->conv;
+		rec.event = (uint16_t)ev;
+		rec.xmit = (uint16_t)_imin_(xmit, 0xffff);
+		rec.sn = sn;
+		rec.ts = ts;
+		rec.len = len;
+		rec.rto = (uint32_t)this->rx_rto;
+		rec.cwnd = cwnd;
+		this->trace->record(rec);
+	}
+
 	// output segment
 	int kcp_core::call_output(const void *data, int size)
 	{
@@ -222,7 +368,19 @@ namespace KCP
 			ikcp_log(IKCP_LOG_OUTPUT, "[RO] %ld bytes", (long)size);
 		}
 		if (size == 0) return 0;
-		return this->output_callback((const char*)data, size, this->user);
+		if (this->fec != nullptr)
+			return this->fec->encode((const char*)data, size, [this](const char *buf, int len)
+				{ return write_output(buf, len); });
+		return write_output((const char*)data, size);
+	}
+
+	// hand a datagram to the transport
+	int kcp_core::write_output(const char *data, int size)
+	{
+		record_trace(trace_event::datagram_out, 0, 0, size);
+		session_counters::add(this->stats.datagrams_sent, 1);
+		session_counters::add(this->stats.wire_bytes_sent, size);
+		return this->output_callback(data, size, this->user);
 	}
 
 	//---------------------------------------------------------------------
@@ -242,8 +400,6 @@ namespace KCP
 		this->snd_wnd = IKCP_WND_SND;
 		this->rcv_wnd = IKCP_WND_RCV;
 		this->rmt_wnd = IKCP_WND_RCV;
-		this->cwnd = 0;
-		this->incr = 0;
 		this->probe = 0;
 		this->mtu = IKCP_MTU_DEF;
 		this->mss = this->mtu - IKCP_OVERHEAD;
@@ -264,12 +420,90 @@ namespace KCP
 		this->nodelay = 0;
 		this->updated = 0;
 		this->logmask = 0;
-		this->ssthresh = IKCP_THRESH_INIT;
+		this->trace_mask = 0;
+		this->trace = nullptr;
+		this->latency = nullptr;
+		this->latency_unacked.clear();
+		this->congestion = std::make_unique<reno_controller>();
+		this->fec = nullptr;
 		this->fastresend = 0;
 		this->fastlimit = IKCP_FASTACK_LIMIT;
 		this->nocwnd = 0;
 		this->xmit = 0;
 		this->dead_link = IKCP_DEADLINK;
+		this->events = 0;
+		this->snd_watermark = 0;
+		this->readable = false;
+		this->snd_blocked = false;
+		this->snd_bytes = 0;
+		this->snd_high = 0;
+		this->snd_low = 0;
+		this->ack_every = 1;
+		this->ack_delay = 0;
+		this->ts_ack = 0;
+		this->rmt_ack_delay = 0;
+		this->ts_delay_announce = 0;
+		this->delay_announce_count = 0;
+		this->ack_immediate = false;
+		this->delay_acked = true;
+		this->rack = 0;
+		this->tlp = 0;
+		this->rack_ts = 0;
+		this->rack_sn = 0;
+		this->ts_rack = 0;
+		this->ts_tlp = 0;
+		this->rack_valid = false;
+		this->tlp_out = false;
+		this->features = 0;
+		this->rmt_features = 0;
+		this->negotiated = 0;
+		this->rcv_wscale = 0;
+		this->rmt_wscale = 0;
+		this->rcv_large = nullptr;
+		this->rcv_large_capacity = 0;
+		this->rcv_msg_max = IKCP_MSG_MAX;
+		this->rcv_large_drop = false;
+		this->streams.clear();
+		this->snd_stream_count = 0;
+		this->rcv_stream_count = 0;
+		this->snd_pass = 0;
+		this->rcv_delivered.clear();
+		this->rcv_waiting.clear();
+		this->ts_announce = 0;
+		this->announce_count = 0;
+		this->rmt_features_known = false;
+		this->features_acked = false;
+		this->wire_compact = false;
+		this->wire_ts = 0;
+		this->wire_sn = 0;
+		this->wire_una = 0;
+		this->pacing = 0;
+		this->ts_pacing = 0;
+		this->ts_pacing_next = 0;
+		this->pacing_bandwidth = 0;
+		this->pacing_credit = 0;
+		this->autotune = 0;
+		this->ts_tune = 0;
+		this->tune_rtt = 0;
+		this->ts_tune_rtt = 0;
+		this->tune_min_snd = 0;
+		this->tune_min_rcv = 0;
+		this->tune_max_snd = 0;
+		this->tune_max_rcv = 0;
+		this->tune_acked = 0;
+		this->tune_received = 0;
+		this->tune_snd_rate = 0;
+		this->tune_rcv_rate = 0;
+		this->tune_limited = false;
+		this->tune_lost = false;
+		this->tune_reserved = 0;
+		this->stats.reset();
+		this->mem_snd_queue = 0;
+		this->mem_snd_buf = 0;
+		this->mem_rcv_buf = 0;
+		this->mem_rcv_queue = 0;
+		this->mem_limit = 0;
+		report_memory();
 
 		return true;
 	}
@@ -288,8 +522,6 @@ namespace KCP
 		this->snd_wnd = other.snd_wnd;
 		this->rcv_wnd = other.rcv_wnd;
 		this->rmt_wnd = other.rmt_wnd;
-		this->cwnd = other.cwnd;
-		this->incr = other.incr;
 		this->probe = other.probe;
 		this->mtu = other.mtu;
 		this->mss = other.mss;
@@ -306,12 +538,96 @@ namespace KCP
 		this->nodelay = other.nodelay;
 		this->updated = other.updated;
 		this->logmask = other.logmask;
-		this->ssthresh = other.ssthresh;
+		this->trace_mask = other.trace_mask;
+		this->trace = std::move(other.trace);
+		other.trace_mask = 0;
+		this->latency = std::move(other.latency);
+		this->latency_unacked = std::move(other.latency_unacked);
+		this->congestion = std::move(other.congestion);
+		this->fec = std::move(other.fec);
 		this->fastresend = other.fastresend;
 		this->fastlimit = other.fastlimit;
 		this->nocwnd = other.nocwnd;
 		this->xmit = other.xmit;
 		this->dead_link = other.dead_link;
+		this->events = other.events;
+		this->snd_watermark = other.snd_watermark;
+		this->readable = other.readable;
+		this->snd_blocked = other.snd_blocked;
+		this->snd_high = other.snd_high;
+		this->snd_low = other.snd_low;
+		this->ack_every = other.ack_every;
+		this->ack_delay = other.ack_delay;
+		this->ts_ack = other.ts_ack;
+		this->rmt_ack_delay = other.rmt_ack_delay;
+		this->ts_delay_announce = other.ts_delay_announce;
+		this->delay_announce_count = other.delay_announce_count;
+		this->ack_immediate = other.ack_immediate;
+		this->delay_acked = other.delay_acked;
+		this->rack = other.rack;
+		this->tlp = other.tlp;
+		this->rack_ts = other.rack_ts;
+		this->rack_sn = other.rack_sn;
+		this->ts_rack = other.ts_rack;
+		this->ts_tlp = other.ts_tlp;
+		this->rack_valid = other.rack_valid;
+		this->tlp_out = other.tlp_out;
+		this->features = other.features;
+		this->rmt_features = other.rmt_features;
+		this->negotiated = other.negotiated;
+		this->rcv_wscale = other.rcv_wscale;
+		this->rmt_wscale = other.rmt_wscale;
+		this->rcv_large = std::move(other.rcv_large);
+		this->rcv_large_capacity = other.rcv_large_capacity;
+		this->rcv_msg_max = other.rcv_msg_max;
+		this->rcv_large_drop = other.rcv_large_drop;
+		this->ts_announce = other.ts_announce;
+		this->announce_count = other.announce_count;
+		this->rmt_features_known = other.rmt_features_known;
+		this->features_acked = other.features_acked;
+		this->wire_compact = other.wire_compact;
+		this->wire_ts = other.wire_ts;
+		this->wire_sn = other.wire_sn;
+		this->wire_una = other.wire_una;
+		this->pacing = other.pacing;
+		this->ts_pacing = other.ts_pacing;
+		this->ts_pacing_next = other.ts_pacing_next;
+		this->pacing_bandwidth = other.pacing_bandwidth;
+		this->pacing_credit = other.pacing_credit;
+		this->autotune = other.autotune;
+		this->ts_tune = other.ts_tune;
+		this->tune_rtt = other.tune_rtt;
+		this->ts_tune_rtt = other.ts_tune_rtt;
+		this->tune_min_snd = other.tune_min_snd;
+		this->tune_min_rcv = other.tune_min_rcv;
+		this->tune_max_snd = other.tune_max_snd;
+		this->tune_max_rcv = other.tune_max_rcv;
+		this->tune_acked = other.tune_acked;
+		this->tune_received = other.tune_received;
+		this->tune_snd_rate = other.tune_snd_rate;
+		this->tune_rcv_rate = other.tune_rcv_rate;
+		this->tune_limited = other.tune_limited;
+		this->tune_lost = other.tune_lost;
+		ikcp_tune_reserved.fetch_sub(this->tune_reserved, std::memory_order_relaxed);
+		this->tune_reserved = other.tune_reserved;
+		other.tune_reserved = 0;
+		this->stats.copy_from(other.stats);
+		// the queues stay with their objects and so do their byte counts,
+		// of the streams only the scheduling settings move
+		this->mem_limit = other.mem_limit;
+		for (auto &[id, other_stream] : other.streams)
+		{
+			this->streams[id].priority = other_stream.priority;
+			this->streams[id].weight = other_stream.weight;
+		}
+		report_memory();
+		other.report_memory();
+	}
+
+	kcp_core::~kcp_core()
+	{
+		ikcp_tune_reserved.fetch_sub(this->tune_reserved, std::memory_order_relaxed);
+		ikcp_memory_used.fetch_sub(this->mem_reported, std::memory_order_relaxed);
 	}
 
 
@@ -329,17 +645,32 @@ namespace KCP
 	// user/upper level recv: returns size, returns below zero for EAGAIN
 	//---------------------------------------------------------------------
 	int kcp_core::receive(char *buffer, int len)
+	{
+		return receive_queue(this->rcv_queue, buffer, len);
+	}
+
+	int kcp_core::receive_stream(uint32_t id, char *buffer, int len)
+	{
+		if (id == 0)
+			return receive_queue(this->rcv_queue, buffer, len);
+		auto iter = this->streams.find(id);
+		if (iter == this->streams.end())
+			return -1;
+		return receive_queue(iter->second.rcv_queue, buffer, len);
+	}
+
+	int kcp_core::receive_queue(std::list<segment> &queue, char *buffer, int len)
 	{
 		bool ispeek = (len < 0);
 		int peeksize;
 		int recover = 0;
 
-		if (this->rcv_queue.empty())
+		if (queue.empty())
 			return -1;
 
 		if (len < 0) len = -len;
 
-		peeksize = peek_size();
+		peeksize = peek_queue(queue);
 
 		if (peeksize < 0)
 			return -2;
@@ -347,12 +678,14 @@ namespace KCP
 		if (peeksize > len)
 			return -3;
 
-		if (this->rcv_queue.size() >= this->rcv_wnd)
+		if (get_rcv_queued() >= this->rcv_wnd)
 			recover = 1;
 
 		len = 0;
+		uint32_t first_sn = queue.front().sn;
+		uint32_t first_ts = queue.front().queue_ts;
 		// merge fragment
-		for (auto seg = rcv_queue.begin(), next = seg; seg != this->rcv_queue.end(); seg = next)
+		for (auto seg = queue.begin(), next = seg; seg != queue.end(); seg = next)
 		{
 			int fragment;
 			++next;
@@ -372,36 +705,49 @@ namespace KCP
 			}
 
 			if (ispeek == false)
-				this->rcv_queue.erase(seg);
+			{
+				this->mem_rcv_queue -= ikcp_segment_cost(*seg);
+				if (&queue != &this->rcv_queue)
+					this->rcv_stream_count--;
+				queue.erase(seg);
+			}
 
 			if (fragment == 0)
 				break;
 		}
 
 		assert(len == peeksize);
+		if (ispeek == false)
+		{
+			report_memory();
+			record_trace(trace_event::deliver, first_sn, 0, len);
+			if (this->latency != nullptr)
+				this->latency->receive_wait.record(_ielapsed(this->current, first_ts));
+		}
 
 		// move available data from rcv_buf -> rcv_queue
-		while (!this->rcv_buf.empty())
+		move_received();
+
+		// stream segments a full window held back in rcv_buf
+		if (recover && (this->features & IKCP_FEATURE_STREAMS))
 		{
-			auto iter = this->rcv_buf.begin();
-			uint32_t seg_sn = iter->first;
-			segment *seg = iter->second.get();
-			if (seg->sn == this->rcv_nxt && this->rcv_queue.size() < this->rcv_wnd)
-			{
-				this->rcv_queue.emplace_back(std::move(*seg));
-				this->rcv_nxt++;
-				rcv_buf.erase(iter);
-			}
-			else break;
+			std::vector<uint32_t> held;
+			for (auto &[seg_sn, seg] : this->rcv_buf)
+				if (seg->stream_tagged)
+					held.push_back(seg_sn);
+			for (uint32_t seg_sn : held)
+				deliver_stream(seg_sn);
 		}
 
 		// fast recover
-		if (this->rcv_queue.size() < this->rcv_wnd && recover) {
+		if (get_rcv_queued() < this->rcv_wnd && recover) {
 			// ready to send back IKCP_CMD_WINS in ikcp_flush
 			// tell remote my window size
 			this->probe |= IKCP_ASK_TELL;
 		}
 
+		check_readable();
+
 		return len;
 	}
 
@@ -410,17 +756,22 @@ namespace KCP
 	// peek data size
 	//---------------------------------------------------------------------
 	int kcp_core::peek_size()
+	{
+		return peek_queue(this->rcv_queue);
+	}
+
+	int kcp_core::peek_queue(const std::list<segment> &queue)
 	{
 		int length = 0;
 
-		if (this->rcv_queue.empty()) return -1;
+		if (queue.empty()) return -1;
 
-		auto seg = this->rcv_queue.begin();
+		auto seg = queue.begin();
 		if (seg->frg == 0) return (int)seg->len;
 
-		if (this->rcv_queue.size() < (size_t)(seg->frg) + 1) return -1;
+		if (queue.size() < (size_t)(seg->frg) + 1) return -1;
 
-		for (seg = this->rcv_queue.begin(); seg != this->rcv_queue.end(); ++seg)
+		for (seg = queue.begin(); seg != queue.end(); ++seg)
 		{
 			length += (int)seg->len;
 			if (seg->frg == 0) break;
@@ -429,27 +780,72 @@ namespace KCP
 		return length;
 	}
 
+	int kcp_core::peek_stream()
+	{
+		if (peek_queue(this->rcv_queue) >= 0)
+			return 0;
+		if (this->rcv_stream_count == 0)
+			return -1;
+		for (auto &[id, st] : this->streams)
+			if (id != 0 && peek_queue(st.rcv_queue) >= 0)
+				return (int)id;
+		return -1;
+	}
+
 
 	//---------------------------------------------------------------------
 	// user/upper level send, returns below zero for error
 	//---------------------------------------------------------------------
 	int kcp_core::send(const char *buffer, int len)
+	{
+		return send_stream(0, buffer, len);
+	}
+
+	int kcp_core::send_stream(uint32_t id, const char *buffer, int len)
 	{
 		int count, i;
 		int sent = 0;
 
 		assert(this->mss > 0);
-		if (len < 0) return -1;
+		if (len < 0 || id > IKCP_STREAM_MAX) return -1;
+		if (id != 0 && (this->negotiated & IKCP_FEATURE_STREAMS) == 0) return -5;
+
+		if (this->snd_high > 0)
+		{
+			if (this->snd_bytes >= this->snd_high)
+			{
+				this->snd_blocked = true;
+				session_counters::add(this->stats.would_block, 1);
+				return -4;
+			}
+			// a stream takes what fits, a message may go over once
+			if (this->stream != 0 && (uint64_t)len >= this->snd_high - this->snd_bytes)
+			{
+				len = (int)(this->snd_high - this->snd_bytes);
+				this->snd_blocked = true;
+			}
+		}
+
+		// a stream that was idle is scheduled from now on, not from its last turn
+		stream_state &state = this->streams[id];
+		std::list<std::unique_ptr<segment>> &queue = id != 0 ? state.snd_queue : this->snd_queue;
+		if (queue.empty() && state.pass < this->snd_pass)
+			state.pass = this->snd_pass;
+
+		// room for the stream header once IKCP_FEATURE_STREAMS is in use
+		uint32_t mss = this->mss;
+		if (this->negotiated & IKCP_FEATURE_STREAMS)
+			mss -= IKCP_STREAMEXT_SIZE;
 
 		// append to previous segment in streaming mode (if possible)
 		if (this->stream != 0)
 		{
-			if (!this->snd_queue.empty())
+			if (!queue.empty())
 			{
-				auto &seg = this->snd_queue.back();
-				if (seg->len < this->mss)
+				auto &seg = queue.back();
+				if (seg->len < mss)
 				{
-					int capacity = (int)((int64_t)this->mss - (int64_t)seg->len);
+					int capacity = (int)((int64_t)mss - (int64_t)seg->len);
 					int extend = (len < capacity) ? len : capacity;
 					uint32_t old_size = seg->len;
 					bool resized = seg->resize(old_size + (uint32_t)extend);
@@ -463,6 +859,8 @@ namespace KCP
 					}
 					seg->len = old_size + extend;
 					seg->frg = 0;
+					this->mem_snd_queue += extend;
+					this->snd_bytes += extend;
 					len -= extend;
 					sent = extend;
 				}
@@ -471,10 +869,19 @@ namespace KCP
 				return sent;
 		}
 
-		if (len <= (int)this->mss) count = 1;
-		else count = (len + this->mss - 1) / this->mss;
+		int fragment_size = (int)mss;
+		if (len <= fragment_size) count = 1;
+		else count = (len + fragment_size - 1) / fragment_size;
 
-		if (count >= (int)IKCP_WND_RCV)
+		if (count >= (int)IKCP_WND_RCV && this->stream == 0 && id == 0 && (this->negotiated & IKCP_FEATURE_LARGE_MSG))
+		{
+			// every fragment is two bytes shorter to make room for the wider frg
+			fragment_size -= IKCP_FRGEXT_SIZE;
+			count = (len + fragment_size - 1) / fragment_size;
+			if (count > (int)IKCP_FRG_LIMIT)
+				return -2;
+		}
+		else if (count >= (int)IKCP_WND_RCV)
 		{
 			if (this->stream != 0 && sent > 0)
 				return sent;
@@ -483,10 +890,16 @@ namespace KCP
 
 		if (count == 0) count = 1;
 
+		if (!memory_available((uint64_t)count * (sizeof(segment) + IKCP_NODE_OVERHEAD) + len))
+		{
+			session_counters::add(this->stats.over_budget, 1);
+			return (this->stream != 0 && sent > 0) ? sent : -3;
+		}
+
 		// fragment
 		for (i = 0; i < count; i++)
 		{
-			int size = len > (int)this->mss ? (int)this->mss : len;
+			int size = len > fragment_size ? fragment_size : len;
 			std::unique_ptr<segment> seg = std::make_unique<segment>(size);
 			if (seg == nullptr)
 				return -2;
@@ -496,7 +909,13 @@ namespace KCP
 
 			seg->len = size;
 			seg->frg = (this->stream == 0) ? (count - i - 1) : 0;
-			this->snd_queue.emplace_back(std::move(seg));
+			seg->queue_ts = this->current;
+			seg->stream = id;
+			this->mem_snd_queue += ikcp_segment_cost(*seg);
+			this->snd_bytes += size;
+			queue.emplace_back(std::move(seg));
+			if (id != 0)
+				this->snd_stream_count++;
 			if (buffer)
 				buffer += size;
 
@@ -504,6 +923,12 @@ namespace KCP
 			sent += size;
 		}
 
+		uint32_t watermark = this->snd_watermark > 0 ? this->snd_watermark : this->snd_wnd;
+		if (get_snd_queued() >= watermark || (this->snd_high > 0 && this->snd_bytes >= this->snd_high))
+			this->snd_blocked = true;
+
+		record_trace(trace_event::send, count, 0, sent);
+		report_memory();
 		return sent;
 	}
 
@@ -514,6 +939,23 @@ namespace KCP
 	void kcp_core::update_ack(int32_t rtt)
 	{
 		int32_t rto = 0;
+		this->congestion->on_rtt_sample(make_congestion_event(_imin_(this->snd_wnd, this->rmt_wnd)), rtt);
+		if (rtt > 0 && (this->tune_rtt == 0 || (uint32_t)rtt <= this->tune_rtt ||
+			_itimediff(this->current, this->ts_tune_rtt) > (long)IKCP_TUNE_RTT_WINDOW))
+		{
+			this->tune_rtt = (uint32_t)rtt;
+			this->ts_tune_rtt = this->current;
+		}
+		if (rtt >= 0)
+		{
+			if (this->stats.rtt_samples.load(std::memory_order_relaxed) == 0 ||
+				(uint64_t)rtt < this->stats.rtt_min.load(std::memory_order_relaxed))
+				session_counters::set(this->stats.rtt_min, rtt);
+			if ((uint64_t)rtt > this->stats.rtt_max.load(std::memory_order_relaxed))
+				session_counters::set(this->stats.rtt_max, rtt);
+			session_counters::add(this->stats.rtt_sum, rtt);
+			session_counters::add(this->stats.rtt_samples, 1);
+		}
 		if (this->rx_srtt == 0)
 		{
 			this->rx_srtt = rtt;
@@ -527,8 +969,12 @@ namespace KCP
 			this->rx_srtt = (7 * this->rx_srtt + rtt) / 8;
 			if (this->rx_srtt < 1) this->rx_srtt = 1;
 		}
-		rto = this->rx_srtt + _imax_(this->interval, 4 * this->rx_rttval);
+		// the remote side may hold its acks back for up to rmt_ack_delay
+		rto = this->rx_srtt + _imax_(this->interval, 4 * this->rx_rttval) + this->rmt_ack_delay;
 		this->rx_rto = _ibound_(this->rx_minrto, rto, IKCP_RTO_MAX);
+		session_counters::set(this->stats.srtt, this->rx_srtt);
+		session_counters::set(this->stats.rttvar, this->rx_rttval);
+		session_counters::set(this->stats.rto, this->rx_rto);
 	}
 
 	void kcp_core::shrink_buf()
@@ -539,48 +985,50 @@ namespace KCP
 			this->snd_una = this->snd_nxt;
 	}
 
+	// remove an acknowledged segment from snd_buf and its timer indexes
+	decltype(kcp_core::snd_buf)::iterator kcp_core::erase_snd_buf(decltype(snd_buf)::iterator iter)
+	{
+		uint32_t sn = iter->first;
+		segment *seg = iter->second.get();
+		this->mem_snd_buf -= ikcp_segment_cost(*seg);
+		this->snd_bytes -= seg->len;
+
+		if (auto resendts_iter = this->resendts_buf.find(seg->resendts); resendts_iter != this->resendts_buf.end())
+			if (auto um_iter = resendts_iter->second.find(sn); um_iter != resendts_iter->second.end())
+				resendts_iter->second.erase(um_iter);
+
+		if (auto fastack_iter = this->fastack_buf.find(seg->fastack); fastack_iter != this->fastack_buf.end())
+			if (auto um_iter = fastack_iter->second.find(sn); um_iter != fastack_iter->second.end())
+				fastack_iter->second.erase(um_iter);
+
+		this->congestion->on_segment_acked(make_congestion_event(_imin_(this->snd_wnd, this->rmt_wnd)), *seg);
+		this->tune_acked++;
+		return this->snd_buf.erase(iter);
+	}
+
 	void kcp_core::parse_ack(uint32_t sn)
 	{
 		if (sn < this->snd_una || sn >= this->snd_nxt)
 			return;
 
 		if (auto iter = this->snd_buf.find(sn); iter != this->snd_buf.end())
-		{
-			std::shared_ptr<segment> seg = iter->second;
-
-			if (auto resendts_iter = this->resendts_buf.find(seg->resendts); resendts_iter != this->resendts_buf.end())
-				if (auto um_iter = resendts_iter->second.find(sn); um_iter != resendts_iter->second.end())
-					resendts_iter->second.erase(um_iter);
+			erase_snd_buf(iter);
+	}
 
-			if (auto fastack_iter = this->fastack_buf.find(seg->fastack); fastack_iter != this->fastack_buf.end())
-				if (auto um_iter = fastack_iter->second.find(sn); um_iter != fastack_iter->second.end())
-					fastack_iter->second.erase(um_iter);
+	// acknowledge every segment in [first, last] with one pass over snd_buf
+	void kcp_core::parse_ack_range(uint32_t first, uint32_t last)
+	{
+		if (last < this->snd_una || first >= this->snd_nxt)
+			return;
 
-			this->snd_buf.erase(iter);
-		}
+		for (auto iter = this->snd_buf.lower_bound(first); iter != this->snd_buf.end() && iter->first <= last; )
+			iter = erase_snd_buf(iter);
 	}
 
 	void kcp_core::parse_una(uint32_t una)
 	{
-		for (auto iter = this->snd_buf.begin(), next = iter; iter != this->snd_buf.end(); iter = next)
-		{
-			++next;
-			uint32_t sn = iter->first;
-			std::shared_ptr<segment> seg = iter->second;
-			if (una > sn)
-			{
-				if (auto resendts_iter = this->resendts_buf.find(seg->resendts); resendts_iter != this->resendts_buf.end())
-					if (auto um_iter = resendts_iter->second.find(sn); um_iter != resendts_iter->second.end())
-						resendts_iter->second.erase(um_iter);
-
-				if (auto fastack_iter = this->fastack_buf.find(seg->fastack); fastack_iter != this->fastack_buf.end())
-					if (auto um_iter = fastack_iter->second.find(sn); um_iter != fastack_iter->second.end())
-						fastack_iter->second.erase(um_iter);
-
-				this->snd_buf.erase(iter);
-			}
-			else break;
-		}
+		for (auto iter = this->snd_buf.begin(); iter != this->snd_buf.end() && una > iter->first; )
+			iter = erase_snd_buf(iter);
 	}
 
 	void kcp_core::parse_fastack(uint32_t sn, uint32_t ts)
@@ -613,8 +1061,24 @@ namespace KCP
 		if (sn >= this->rcv_nxt + this->rcv_wnd || sn < this->rcv_nxt)
 			return;
 
-		if (auto iter = this->rcv_buf.find(sn); iter == this->rcv_buf.end())
+		if (this->rcv_buf.find(sn) == this->rcv_buf.end() && this->rcv_delivered.count(sn) == 0)
+		{
+			bool tagged = newseg.stream_tagged;
+			this->tune_received++;
+			session_counters::add(this->stats.segments_received, 1);
+			session_counters::add(this->stats.bytes_received, newseg.len);
+			record_trace(trace_event::push_in, sn, newseg.ts, newseg.len);
+			newseg.queue_ts = this->current;
+			this->mem_rcv_buf += ikcp_segment_cost(newseg);
 			this->rcv_buf.insert({ sn, std::make_unique<segment>(std::move(newseg))});
+			if (tagged)
+				deliver_stream(sn);
+		}
+		else
+		{
+			session_counters::add(this->stats.duplicates, 1);
+			record_trace(trace_event::push_duplicate, sn, newseg.ts, newseg.len);
+		}
 
 #if 0
 		PrintQueue("rcvbuf", &this->rcv_buf);
@@ -622,20 +1086,9 @@ namespace KCP
 #endif
 
 		// move available data from rcv_buf -> rcv_queue
-		while (!this->rcv_buf.empty())
-		{
-			auto iter = this->rcv_buf.begin();
-			uint32_t seg_sn = iter->first;
-			segment *seg = iter->second.get();
-			if (seg->sn == this->rcv_nxt && this->rcv_queue.size() < this->rcv_wnd)
-			{
-				this->rcv_queue.emplace_back(std::move(*seg));
-				this->rcv_nxt++;
-				rcv_buf.erase(iter);
-			}
-			else break;
-		}
+		move_received();
 
+		check_readable();
 
 #if 0
 		PrintQueue("queue", &this->rcv_queue);
@@ -649,56 +1102,309 @@ namespace KCP
 	}
 
 
+	//---------------------------------------------------------------------
+	// move an in order segment to the rcv_queue of its stream. Fragments
+	// of a large message (frg >= IKCP_WND_RCV, stream 0 only) are copied
+	// into one buffer, grown as they arrive, and leave the receive window
+	// at once, the whole message enters rcv_queue with its last fragment
+	//---------------------------------------------------------------------
+	void kcp_core::queue_received(segment &seg)
+	{
+		this->mem_rcv_buf -= ikcp_segment_cost(seg);
+		if (seg.stream != 0)
+		{
+			this->mem_rcv_queue += ikcp_segment_cost(seg);
+			this->streams[seg.stream].rcv_queue.emplace_back(std::move(seg));
+			this->rcv_stream_count++;
+			return;
+		}
+
+		if (this->rcv_large == nullptr && !this->rcv_large_drop && (seg.frg < IKCP_WND_RCV || this->stream != 0))
+		{
+			this->mem_rcv_queue += ikcp_segment_cost(seg);
+			this->rcv_queue.emplace_back(std::move(seg));
+			return;
+		}
+
+		// the rest of a dropped message, up to its last fragment
+		if (this->rcv_large_drop)
+		{
+			this->rcv_large_drop = seg.frg != 0;
+			return;
+		}
+
+		uint32_t capacity = large_capacity(seg.frg, seg.len);
+		if (capacity == 0)
+		{
+			drop_large(seg);
+			return;
+		}
+
+		if (this->rcv_large == nullptr)
+		{
+			this->rcv_large = std::make_unique<segment>();
+			this->rcv_large->conv = seg.conv;
+			this->rcv_large->cmd = seg.cmd;
+			this->rcv_large->ts = seg.ts;
+			this->rcv_large->sn = seg.sn;
+			this->rcv_large->una = seg.una;
+			this->rcv_large->queue_ts = seg.queue_ts;
+		}
+
+		segment &message = *this->rcv_large;
+		if (capacity > this->rcv_large_capacity)
+		{
+			if (!message.resize(capacity))
+			{
+				drop_large(seg);
+				return;
+			}
+			this->rcv_large_capacity = capacity;
+		}
+		std::copy_n(seg.data.get(), seg.len, message.data.get() + message.len);
+		message.len += seg.len;
+
+		if (seg.frg == 0)
+		{
+			this->mem_rcv_queue += ikcp_segment_cost(message);
+			this->rcv_queue.emplace_back(std::move(message));
+			this->rcv_large.reset();
+			this->rcv_large_capacity = 0;
+		}
+	}
+
+	//---------------------------------------------------------------------
+	// buffer size rcv_large needs to take a fragment of a large message,
+	// 0 when the message would exceed rcv_msg_max. Only the last fragment
+	// may be shorter than this one, the buffer doubles up to the largest
+	// size the fragments left can add up to
+	//---------------------------------------------------------------------
+	uint32_t kcp_core::large_capacity(uint32_t frg, uint32_t len)
+	{
+		uint64_t received = this->rcv_large != nullptr ? this->rcv_large->len : 0;
+		uint64_t smallest = received + len + (frg > 0 ? (uint64_t)(frg - 1) * len + 1 : 0);
+		uint64_t largest = std::min<uint64_t>(received + (uint64_t)(frg + 1) * len, this->rcv_msg_max);
+		if (smallest > this->rcv_msg_max)
+			return 0;
+		if (received + len <= this->rcv_large_capacity)
+			return this->rcv_large_capacity;
+
+		uint64_t capacity = std::max<uint64_t>(2 * (uint64_t)this->rcv_large_capacity, IKCP_LARGE_INITIAL);
+		return (uint32_t)std::max<uint64_t>(std::min(capacity, largest), received + len);
+	}
+
+	// discard the large message 'seg' belongs to, its fragments were acknowledged
+	void kcp_core::drop_large(const segment &seg)
+	{
+		session_counters::add(this->stats.messages_dropped, 1);
+		record_trace(trace_event::message_dropped, seg.sn, seg.ts, seg.len);
+		this->rcv_large.reset();
+		this->rcv_large_capacity = 0;
+		this->rcv_large_drop = seg.frg != 0;
+	}
+
+
+	//---------------------------------------------------------------------
+	// move in order segments from rcv_buf to the receive queues, rcv_nxt
+	// also steps over the segments delivered ahead of it by deliver_stream
+	//---------------------------------------------------------------------
+	void kcp_core::move_received()
+	{
+		while (true)
+		{
+			if (!this->rcv_delivered.empty() && *this->rcv_delivered.begin() == this->rcv_nxt)
+			{
+				this->rcv_delivered.erase(this->rcv_delivered.begin());
+				this->rcv_nxt++;
+				continue;
+			}
+
+			if (this->rcv_buf.empty())
+				break;
+			auto iter = this->rcv_buf.begin();
+			segment *seg = iter->second.get();
+			if (seg->sn != this->rcv_nxt || get_rcv_queued() >= this->rcv_wnd)
+				break;
+
+			uint32_t sn = seg->sn;
+			queue_received(*seg);
+			this->rcv_nxt++;
+			this->rcv_buf.erase(iter);
+
+			// the next segment of its stream may be waiting for this one
+			if (auto waiting = this->rcv_waiting.find(sn); waiting != this->rcv_waiting.end())
+			{
+				uint32_t next = waiting->second;
+				this->rcv_waiting.erase(waiting);
+				deliver_stream(next);
+			}
+		}
+	}
+
+	//---------------------------------------------------------------------
+	// deliver a segment of rcv_buf that carries a stream header ahead of
+	// rcv_nxt once the previous segment of its stream has been delivered,
+	// then the segments of the stream that were waiting behind it
+	//---------------------------------------------------------------------
+	void kcp_core::deliver_stream(uint32_t sn)
+	{
+		while (true)
+		{
+			auto iter = this->rcv_buf.find(sn);
+			if (iter == this->rcv_buf.end())
+				return;
+
+			segment &seg = *iter->second;
+			uint32_t prev = sn - seg.stream_gap;
+			if (seg.stream_gap != 0 && prev >= this->rcv_nxt && this->rcv_delivered.count(prev) == 0)
+			{
+				this->rcv_waiting[prev] = sn;
+				return;
+			}
+
+			// a full receive window leaves it to move_received
+			if (get_rcv_queued() >= this->rcv_wnd)
+				return;
+
+			queue_received(seg);
+			this->rcv_buf.erase(iter);
+			this->rcv_delivered.insert(sn);
+
+			auto waiting = this->rcv_waiting.find(sn);
+			if (waiting == this->rcv_waiting.end())
+				return;
+			sn = waiting->second;
+			this->rcv_waiting.erase(waiting);
+		}
+	}
+
+
 	//---------------------------------------------------------------------
 	// input data
 	//---------------------------------------------------------------------
 	int kcp_core::input(const char *data, long size)
+	{
+		if (ikcp_canlog(IKCP_LOG_INPUT))
+			ikcp_log(IKCP_LOG_INPUT, "[RI] %d bytes", (int)size);
+
+		if (data != nullptr && size > 0)
+		{
+			session_counters::add(this->stats.datagrams_received, 1);
+			session_counters::add(this->stats.wire_bytes_received, size);
+			record_trace(trace_event::datagram_in, 0, 0, (uint32_t)size);
+		}
+
+		// unwrap fec packets, recovered datagrams are parsed like received ones
+		if (this->fec != nullptr && fec_codec::is_fec_packet(data, size))
+		{
+			if (kcp_core::get_conv(data) != this->conv) return -1;
+			return this->fec->decode(data, size, [this](const char *datagram, long len)
+				{ return input_datagram(datagram, len); });
+		}
+
+		return input_datagram(data, size);
+	}
+
+	int kcp_core::input_datagram(const char *data, long size)
 	{
 		uint32_t prev_una = this->snd_una;
 		uint32_t maxack = 0, latest_ts = 0;
 		int flag = 0;
 
-		if (ikcp_canlog(IKCP_LOG_INPUT))
-			ikcp_log(IKCP_LOG_INPUT, "[RI] %d bytes", (int)size);
+		if (data == nullptr || size < (long)IKCP_COMPACT_MIN) return -1;
 
-		if (data == nullptr || size < (long)IKCP_OVERHEAD) return -1;
+		// a compact datagram carries conv once, its segments set IKCP_CMD_COMPACT
+		uint32_t ts = 0, sn = 0, una = 0, conv = 0;
+		bool compact = (*(const unsigned char*)(data + 4) & IKCP_CMD_COMPACT) != 0;
+		if (compact)
+		{
+			data = ikcp_decode32u(data, &conv);
+			if (conv != this->conv) return -1;
+			size -= 4;
+		}
+		else if (size < (long)IKCP_OVERHEAD) return -1;
 
-		while (size >= (long)IKCP_OVERHEAD)
+		while (size >= (long)(compact ? IKCP_COMPACT_MIN - 4 : IKCP_OVERHEAD))
 		{
-			uint32_t ts, sn, len, una, conv;
+			uint32_t len;
 			uint16_t wnd;
 			uint8_t cmd, frg;
 
-			data = ikcp_decode32u(data, &conv);
-			if (conv != this->conv) return -1;
+			if (compact)
+			{
+				const char *next = ikcp_decode_compact(data, data + size, &cmd, &frg, &wnd, &ts, &sn, &una, &len);
+				if (next == nullptr) return -2;
+				if ((cmd & IKCP_CMD_COMPACT) == 0) return -3;
+				cmd &= ~IKCP_CMD_COMPACT;
+				size -= (long)(next - data);
+				data = next;
+			}
+			else
+			{
+				data = ikcp_decode32u(data, &conv);
+				if (conv != this->conv) return -1;
+
+				data = ikcp_decode8u(data, &cmd);
+				data = ikcp_decode8u(data, &frg);
+				data = ikcp_decode16u(data, &wnd);
+				data = ikcp_decode32u(data, &ts);
+				data = ikcp_decode32u(data, &sn);
+				data = ikcp_decode32u(data, &una);
+				data = ikcp_decode32u(data, &len);
+
+				size -= IKCP_OVERHEAD;
+			}
 
-			data = ikcp_decode8u(data, &cmd);
-			data = ikcp_decode8u(data, &frg);
-			data = ikcp_decode16u(data, &wnd);
-			data = ikcp_decode32u(data, &ts);
-			data = ikcp_decode32u(data, &sn);
-			data = ikcp_decode32u(data, &una);
-			data = ikcp_decode32u(data, &len);
+			if (size < (long)len || (int)len < 0) return -2;
 
-			size -= IKCP_OVERHEAD;
+			// fragment counter above 255, the high bits precede the payload
+			uint32_t fragment = frg;
+			if (cmd & IKCP_CMD_FRGEXT)
+			{
+				uint16_t high;
+				if (len < IKCP_FRGEXT_SIZE) return -2;
+				data = ikcp_decode16u(data, &high);
+				size -= IKCP_FRGEXT_SIZE;
+				len -= IKCP_FRGEXT_SIZE;
+				fragment |= (uint32_t)high << 8;
+				cmd &= ~IKCP_CMD_FRGEXT;
+			}
 
-			if (size < (long)len || (int)len < 0) return -2;
+			// stream id and distance to the previous segment of the stream
+			uint32_t stream_id = 0, stream_gap = 0;
+			bool stream_tagged = (cmd & IKCP_CMD_STREAM) != 0;
+			if (stream_tagged)
+			{
+				uint16_t id;
+				if ((this->features & IKCP_FEATURE_STREAMS) == 0) return -3;
+				if (len < IKCP_STREAMEXT_SIZE) return -2;
+				data = ikcp_decode16u(data, &id);
+				data = ikcp_decode32u(data, &stream_gap);
+				size -= IKCP_STREAMEXT_SIZE;
+				len -= IKCP_STREAMEXT_SIZE;
+				stream_id = id;
+				cmd &= ~IKCP_CMD_STREAM;
+			}
 
 			if (cmd != IKCP_CMD_PUSH && cmd != IKCP_CMD_ACK &&
-				cmd != IKCP_CMD_WASK && cmd != IKCP_CMD_WINS)
+				cmd != IKCP_CMD_WASK && cmd != IKCP_CMD_WINS &&
+				cmd != IKCP_CMD_SACK)
 				return -3;
 
-			this->rmt_wnd = wnd;
+			this->rmt_wnd = (uint32_t)wnd << this->rmt_wscale;
 			parse_una(una);
 			shrink_buf();
 
 			if (cmd == IKCP_CMD_ACK)
 			{
+				session_counters::add(this->stats.acks_received, 1);
 				if (this->current >= ts)
 					update_ack(_itimediff(this->current, ts));
 
+				rack_update(ts, sn);
 				parse_ack(sn);
 				shrink_buf();
+				record_trace(trace_event::ack_in, sn, ts, 0);
 				if (flag == 0)
 				{
 					flag = 1;
@@ -721,31 +1427,106 @@ namespace KCP
 						(long)this->rx_rto);
 				}
 			}
+			else if (cmd == IKCP_CMD_SACK)
+			{
+				// sn: number of ranges, ts: newest timestamp seen by the remote
+				if ((uint64_t)sn * IKCP_SACK_RANGE > len) return -2;
+				session_counters::add(this->stats.acks_received, 1);
+
+				if (this->current >= ts)
+					update_ack(_itimediff(this->current, ts));
+
+				const char *ranges = data;
+				for (uint32_t i = 0; i < sn; i++)
+				{
+					uint32_t first;
+					uint16_t count;
+					ranges = ikcp_decode32u(ranges, &first);
+					ranges = ikcp_decode16u(ranges, &count);
+					uint32_t last = first + count;
+					rack_update(ts, last);
+					parse_ack_range(first, last);
+					if (flag == 0 || last > maxack)
+					{
+						flag = 1;
+						maxack = last;
+						latest_ts = ts;
+					}
+				}
+				shrink_buf();
+				record_trace(trace_event::sack_in, una, ts, sn);
+
+				if (ikcp_canlog(IKCP_LOG_IN_ACK))
+				{
+					ikcp_log(IKCP_LOG_IN_ACK,
+						"input sack: ranges=%lu una=%lu rtt=%ld rto=%ld", (unsigned long)sn,
+						(unsigned long)una, (long)_itimediff(this->current, ts),
+						(long)this->rx_rto);
+				}
+			}
 			else if (cmd == IKCP_CMD_PUSH)
 			{
 				if (ikcp_canlog(IKCP_LOG_IN_DATA))
 					ikcp_log(IKCP_LOG_IN_DATA, "input psh: sn=%lu ts=%lu", (unsigned long)sn, (unsigned long)ts);
 
-				if (sn < this->rcv_nxt + this->rcv_wnd)
+				// the next in-order segment is always taken so the window can
+				// move, unless it adds to the buffer of a large message
+				uint64_t needed = sizeof(segment) + len + IKCP_NODE_OVERHEAD;
+				bool exempt = sn == this->rcv_nxt;
+				if (exempt && stream_id == 0 && this->stream == 0 && !this->rcv_large_drop &&
+					(this->rcv_large != nullptr || fragment >= IKCP_WND_RCV))
 				{
-					this->acklist.push_back({ sn , ts });
+					uint32_t capacity = large_capacity(fragment, len);
+					if (capacity > this->rcv_large_capacity)
+						needed += capacity - this->rcv_large_capacity;
+					exempt = false;
+				}
+
+				if (sn < this->rcv_nxt + this->rcv_wnd && !exempt && !memory_available(needed))
+				{
+					// left unacknowledged, the sender retransmits it
+					session_counters::add(this->stats.over_budget, 1);
+					record_trace(trace_event::push_over_budget, sn, ts, len);
+				}
+				else if (sn < this->rcv_nxt + this->rcv_wnd)
+				{
+					if (this->acklist.size() >= _imax_(IKCP_ACKLIST_TRIM * this->rcv_wnd, IKCP_WND_RCV))
+						trim_acklist();
+					if (this->acklist.empty())
+						this->ts_ack = this->current;
+					if (sn != this->rcv_nxt)
+						this->ack_immediate = true;
+					this->acklist.push_back({ sn , ts });
 					if (sn >= this->rcv_nxt)
 					{
 						segment seg(len);
 						seg.conv = conv;
 						seg.cmd = cmd;
-						seg.frg = frg;
+						seg.frg = fragment;
 						seg.wnd = wnd;
 						seg.ts = ts;
 						seg.sn = sn;
 						seg.una = una;
 						seg.len = len;
+						seg.stream = stream_id;
+						seg.stream_gap = stream_gap;
+						seg.stream_tagged = stream_tagged;
 
 						if (len > 0)
 							std::copy_n(data, len, seg.data.get());
 
 						parse_data(seg);
 					}
+					else
+					{
+						session_counters::add(this->stats.duplicates, 1);
+						record_trace(trace_event::push_duplicate, sn, ts, len);
+					}
+				}
+				else
+				{
+					session_counters::add(this->stats.out_of_window, 1);
+					record_trace(trace_event::push_dropped, sn, ts, len);
 				}
 			}
 			else if (cmd == IKCP_CMD_WASK)
@@ -753,12 +1534,15 @@ namespace KCP
 				// ready to send back IKCP_CMD_WINS in ikcp_flush
 				// tell remote my window size
 				this->probe |= IKCP_ASK_TELL;
+				parse_features(frg, sn, ts);
+				record_trace(trace_event::probe_in, sn, ts, 0);
 				if (ikcp_canlog(IKCP_LOG_IN_PROBE))
 					ikcp_log(IKCP_LOG_IN_PROBE, "input probe");
 			}
 			else if (cmd == IKCP_CMD_WINS)
 			{
-				// do nothing
+				parse_features(frg, sn, ts);
+				record_trace(trace_event::wins_in, sn, ts, wnd);
 				if (ikcp_canlog(IKCP_LOG_IN_WINS))
 					ikcp_log(IKCP_LOG_IN_WINS, "input wins: %lu", (unsigned long)(wnd));
 			}
@@ -773,36 +1557,24 @@ namespace KCP
 			parse_fastack(maxack, latest_ts);
 
 		if (this->snd_una > prev_una)
+			this->congestion->on_ack(make_congestion_event(_imin_(this->snd_wnd, this->rmt_wnd)));
+
+		// messages whose last fragment is below snd_una are fully acknowledged
+		while (!this->latency_unacked.empty() && _itimediff(this->snd_una, this->latency_unacked.front().first) > 0)
 		{
-			if (this->cwnd < this->rmt_wnd)
-			{
-				uint32_t mss = this->mss;
-				if (this->cwnd < this->ssthresh)
-				{
-					this->cwnd++;
-					this->incr += mss;
-				}
-				else
-				{
-					if (this->incr < mss) this->incr = mss;
-					this->incr += (mss * mss) / this->incr + (mss / 16);
-					if ((this->cwnd + 1) * mss <= this->incr)
-					{
-#if 1
-						this->cwnd = (this->incr + mss - 1) / ((mss > 0) ? mss : 1);
-#else
-						this->cwnd++;
-#endif
-					}
-				}
-				if (this->cwnd > this->rmt_wnd)
-				{
-					this->cwnd = this->rmt_wnd;
-					this->incr = this->rmt_wnd * mss;
-				}
-			}
+			this->latency->ack_latency.record(_ielapsed(this->current, this->latency_unacked.front().second));
+			this->latency_unacked.pop_front();
 		}
 
+		// progress re-arms the tail loss probe
+		if (flag != 0 || this->snd_una > prev_una)
+		{
+			this->ts_tlp = 0;
+			this->tlp_out = false;
+		}
+
+		update_writable();
+		report_memory();
 		return 0;
 	}
 
@@ -810,40 +1582,125 @@ namespace KCP
 	//---------------------------------------------------------------------
 	// ikcp_encode_seg
 	//---------------------------------------------------------------------
-	static char *ikcp_encode_seg(char *ptr, const segment *seg)
-	{
-		ptr = ikcp_encode32u(ptr, seg->conv);
-		ptr = ikcp_encode8u(ptr, (uint8_t)seg->cmd);
-		ptr = ikcp_encode8u(ptr, (uint8_t)seg->frg);
-		ptr = ikcp_encode16u(ptr, (uint16_t)seg->wnd);
-		ptr = ikcp_encode32u(ptr, seg->ts);
-		ptr = ikcp_encode32u(ptr, seg->sn);
-		ptr = ikcp_encode32u(ptr, seg->una);
-		ptr = ikcp_encode32u(ptr, seg->len);
+	static inline uint32_t ikcp_ext_size(const segment &seg)
+	{
+		return (seg.frg > 0xff ? IKCP_FRGEXT_SIZE : 0) + (seg.stream_tagged ? IKCP_STREAMEXT_SIZE : 0);
+	}
+
+	static inline uint32_t ikcp_ext_flags(const segment &seg)
+	{
+		return (seg.frg > 0xff ? IKCP_CMD_FRGEXT : 0) | (seg.stream_tagged ? IKCP_CMD_STREAM : 0);
+	}
+
+	// high bits of a fragment counter above 255, then the stream header,
+	// counted in len
+	static inline char *ikcp_encode_ext(char *ptr, const segment &seg)
+	{
+		if (seg.frg > 0xff)
+			ptr = ikcp_encode16u(ptr, (uint16_t)(seg.frg >> 8));
+		if (seg.stream_tagged)
+		{
+			ptr = ikcp_encode16u(ptr, (uint16_t)seg.stream);
+			ptr = ikcp_encode32u(ptr, seg.stream_gap);
+		}
 		return ptr;
 	}
 
 	static char *ikcp_encode_seg(char *ptr, const segment &seg)
 	{
 		ptr = ikcp_encode32u(ptr, seg.conv);
-		ptr = ikcp_encode8u(ptr, (uint8_t)seg.cmd);
+		ptr = ikcp_encode8u(ptr, (uint8_t)(seg.cmd | ikcp_ext_flags(seg)));
 		ptr = ikcp_encode8u(ptr, (uint8_t)seg.frg);
 		ptr = ikcp_encode16u(ptr, (uint16_t)seg.wnd);
 		ptr = ikcp_encode32u(ptr, seg.ts);
 		ptr = ikcp_encode32u(ptr, seg.sn);
 		ptr = ikcp_encode32u(ptr, seg.una);
-		ptr = ikcp_encode32u(ptr, seg.len);
-		return ptr;
+		ptr = ikcp_encode32u(ptr, seg.len + ikcp_ext_size(seg));
+		return ikcp_encode_ext(ptr, seg);
+	}
+
+	//---------------------------------------------------------------------
+	// compact segment header: cmd | IKCP_CMD_COMPACT, frg, wnd, then ts, sn
+	// and una as zigzag varint deltas from the previous segment of the
+	// datagram (zero for the first one) and len as varint
+	//---------------------------------------------------------------------
+	static int ikcp_compact_size(const segment &seg, uint32_t ts, uint32_t sn, uint32_t una)
+	{
+		uint32_t ext = ikcp_ext_size(seg);
+		return 4 + ikcp_varint_size(ikcp_zigzag(seg.ts - ts)) + ikcp_varint_size(ikcp_zigzag(seg.sn - sn)) +
+			ikcp_varint_size(ikcp_zigzag(seg.una - una)) + ikcp_varint_size(seg.len + ext) + (int)ext;
+	}
+
+	static char *ikcp_encode_compact(char *ptr, const segment &seg, uint32_t ts, uint32_t sn, uint32_t una)
+	{
+		ptr = ikcp_encode8u(ptr, (uint8_t)(seg.cmd | IKCP_CMD_COMPACT | ikcp_ext_flags(seg)));
+		ptr = ikcp_encode8u(ptr, (uint8_t)seg.frg);
+		ptr = ikcp_encode16u(ptr, (uint16_t)seg.wnd);
+		ptr = ikcp_encode_varint(ptr, ikcp_zigzag(seg.ts - ts));
+		ptr = ikcp_encode_varint(ptr, ikcp_zigzag(seg.sn - sn));
+		ptr = ikcp_encode_varint(ptr, ikcp_zigzag(seg.una - una));
+		ptr = ikcp_encode_varint(ptr, seg.len + ikcp_ext_size(seg));
+		return ikcp_encode_ext(ptr, seg);
 	}
 
 	int kcp_core::get_wnd_unused()
 	{
-		if (this->rcv_queue.size() < this->rcv_wnd)
-			return (int)((int64_t)this->rcv_wnd - (int64_t)this->rcv_queue.size());
+		if (get_rcv_queued() < this->rcv_wnd)
+			return (int)((int64_t)this->rcv_wnd - (int64_t)get_rcv_queued());
 
 		return 0;
 	}
 
+	//---------------------------------------------------------------------
+	// value of the wnd field: scaled while the remote side may know the
+	// shift, clamped instead of truncated to 16 bits
+	//---------------------------------------------------------------------
+	uint32_t kcp_core::get_wnd_advertised()
+	{
+		uint32_t unused = (uint32_t)get_wnd_unused();
+		bool scaled = (this->features & IKCP_FEATURE_WSCALE) &&
+			!(this->rmt_features_known && (this->rmt_features & IKCP_FEATURE_WSCALE) == 0);
+		if (scaled && this->rcv_wscale > 0)
+		{
+			uint32_t wnd = unused >> this->rcv_wscale;
+			if (wnd == 0 && unused > 0)
+				wnd = 1;	// a zero window would stall the sender until its next probe
+			unused = wnd;
+		}
+		return _imin_(unused, IKCP_WND_FIELD_MAX);
+	}
+
+	// largest rcv_wnd the wnd field can describe
+	uint32_t kcp_core::get_wnd_limit()
+	{
+		if (this->features & IKCP_FEATURE_WSCALE)
+			return IKCP_WND_FIELD_MAX << IKCP_WSCALE_MAX;
+		return IKCP_WND_FIELD_MAX;
+	}
+
+	//---------------------------------------------------------------------
+	// smallest shift that covers rcv_wnd and the autotune cap. It only
+	// grows: until the remote side hears of a new shift it reads the
+	// window smaller than it is, never larger
+	//---------------------------------------------------------------------
+	void kcp_core::update_wscale()
+	{
+		if ((this->features & IKCP_FEATURE_WSCALE) == 0)
+			return;
+
+		uint32_t largest = _imin_(_imax_(this->rcv_wnd, this->autotune ? this->tune_max_rcv : 0), get_wnd_limit());
+		uint32_t shift = 0;
+		while ((largest >> shift) > IKCP_WND_FIELD_MAX)
+			shift++;
+
+		if (shift > this->rcv_wscale)
+		{
+			this->rcv_wscale = shift;
+			if (this->rmt_features_known)
+				this->probe |= IKCP_ASK_TELL;
+		}
+	}
+
 
 	//---------------------------------------------------------------------
 	// ikcp_flush
@@ -863,32 +1720,72 @@ namespace KCP
 		uint32_t resent, cwnd;
 		uint32_t rtomin;
 		int change = 0;
+		int rack_lost = 0;
 		int lost = 0;
 		segment seg;
 
 		seg.conv = this->conv;
 		seg.cmd = IKCP_CMD_ACK;
 		seg.frg = 0;
-		seg.wnd = get_wnd_unused();
+		seg.wnd = get_wnd_advertised();
 		seg.una = this->rcv_nxt;
 		seg.sn = 0;
 		seg.ts = 0;
 
-		// flush acknowledges
-		for (auto [ack_sn, ack_ts] : this->acklist)
+		// flush acknowledges, unless held back by the ack policy
+		if (ack_due(current))
 		{
-			int size = (int)(ptr - buffer);
-			if (size + (int)IKCP_OVERHEAD > (int)this->mtu)
+			dedup_acklist();
+			if (!this->acklist.empty())
+				record_trace(trace_event::acks_out, this->rcv_nxt, 0, (uint32_t)this->acklist.size());
+
+			if (this->negotiated & IKCP_FEATURE_SACK)
 			{
-				call_output(buffer, size);
-				ptr = buffer;
+				ptr = flush_sack(ptr, buffer, seg);
+			}
+			else
+			{
+				for (auto [ack_sn, ack_ts] : this->acklist)
+				{
+					seg.sn = ack_sn;
+					seg.ts = ack_ts;
+					ptr = encode_seg(ptr, buffer, seg);
+				}
+				session_counters::add(this->stats.acks_sent, this->acklist.size());
 			}
-			seg.sn = ack_sn;
-			seg.ts = ack_ts;
-			ptr = ikcp_encode_seg(ptr, seg);
+
+			this->acklist.clear();
+			this->ack_immediate = false;
 		}
+		seg.sn = 0;
+		seg.ts = 0;
 
-		this->acklist.clear();
+		// announce features until the remote side confirms them
+		if (this->features != 0 && !this->features_acked &&
+			!(this->rmt_features_known && this->rmt_features == 0) &&
+			this->announce_count < IKCP_ANNOUNCE_LIMIT &&
+			_itimediff(current, this->ts_announce) >= 0)
+		{
+			this->probe |= IKCP_ASK_SEND;
+			this->announce_count++;
+			this->ts_announce = current + this->rx_rto;
+		}
+		// the same for our ack delay, the remote side answers WASK with WINS
+		if (!this->delay_acked && this->delay_announce_count < IKCP_ANNOUNCE_LIMIT &&
+			_itimediff(current, this->ts_delay_announce) >= 0)
+		{
+			this->probe |= IKCP_ASK_SEND;
+			this->delay_announce_count++;
+			this->ts_delay_announce = current + this->rx_rto;
+		}
+		if (this->features != 0)
+			seg.frg = this->features | (this->rmt_features_known ? IKCP_FEATURE_ACK : 0);
+		if (this->features & IKCP_FEATURE_WSCALE)
+			seg.sn = this->rcv_wscale;
+		// our ack delay, so the remote side can allow for it in its rto,
+		// and an echo of the remote one above the window shift
+		seg.ts = this->ack_delay;
+		seg.sn |= this->rmt_ack_delay << 8;
 
 		// probe window size (if remote window size equals zero)
 		if (this->rmt_wnd == 0)
@@ -922,33 +1819,28 @@ namespace KCP
 		if (this->probe & IKCP_ASK_SEND)
 		{
 			seg.cmd = IKCP_CMD_WASK;
-			int size = (int)(ptr - buffer);
-			if (size + (int)IKCP_OVERHEAD > (int)this->mtu)
-			{
-				call_output(buffer, size);
-				ptr = buffer;
-			}
-			ptr = ikcp_encode_seg(ptr, seg);
+			ptr = encode_seg(ptr, buffer, seg);
+			record_trace(trace_event::probe_out, seg.sn, 0, 0);
 		}
 
 		// flush window probing commands
 		if (this->probe & IKCP_ASK_TELL)
 		{
 			seg.cmd = IKCP_CMD_WINS;
-			int size = (int)(ptr - buffer);
-			if (size + (int)IKCP_OVERHEAD > (int)this->mtu)
-			{
-				call_output(buffer, size);
-				ptr = buffer;
-			}
-			ptr = ikcp_encode_seg(ptr, seg);
+			ptr = encode_seg(ptr, buffer, seg);
+			record_trace(trace_event::wins_out, seg.sn, 0, seg.wnd);
 		}
 
 		this->probe = 0;
+		seg.sn = 0;
+		seg.ts = 0;
 
 		// calculate window size
 		cwnd = _imin_(this->snd_wnd, this->rmt_wnd);
-		if (this->nocwnd == 0) cwnd = _imin_(this->cwnd, cwnd);
+		if (this->nocwnd == 0) cwnd = _imin_(this->congestion->get_cwnd(), cwnd);
+
+		if (this->pacing)
+			refill_pacing(current, cwnd);
 
 		// calculate resent
 		resent = (this->fastresend > 0) ? (uint32_t)this->fastresend : 0xffffffff;
@@ -983,6 +1875,8 @@ namespace KCP
 
 				segptr->xmit++;
 				this->xmit++;
+				session_counters::add(this->stats.retransmits_rto, 1);
+				record_trace(trace_event::resend_rto, seg_sn, current, segptr->len, segptr->xmit);
 				if (this->nodelay == 0)
 				{
 					segptr->rto += _imax_(segptr->rto, (uint32_t)this->rx_rto);
@@ -1003,6 +1897,7 @@ namespace KCP
 				segptr->wnd = seg.wnd;
 				segptr->una = this->rcv_nxt;
 				ptr = send_out(ptr, buffer, segptr.get());
+				this->pacing_credit -= IKCP_OVERHEAD + segptr->len;
 			}
 
 			if (seg_list.empty())
@@ -1038,6 +1933,8 @@ namespace KCP
 					segptr->fastack = 0;
 					segptr->resendts = current + segptr->rto;
 					change++;
+					session_counters::add(this->stats.retransmits_fast, 1);
+					record_trace(trace_event::resend_fast, seg_sn, current, segptr->len, segptr->xmit);
 
 					seg_list.erase(seg_iter);
 					this->fastack_buf[segptr->fastack][seg_sn] = segptr;
@@ -1052,15 +1949,72 @@ namespace KCP
 					segptr->wnd = seg.wnd;
 					segptr->una = this->rcv_nxt;
 					ptr = send_out(ptr, buffer, segptr.get());
+					this->pacing_credit -= IKCP_OVERHEAD + segptr->len;
 				}
 			}
 		}
 
+		// time based loss detection: resend what was sent before the newest
+		// acknowledged transmission once it is older than srtt + srtt / 4
+		this->ts_rack = 0;
+		if (this->rack && this->rack_valid && this->rx_srtt > 0)
+		{
+			uint32_t window = (uint32_t)this->rx_srtt + _imax_((uint32_t)this->rx_srtt / 4, 1);
+			for (auto &[seg_sn, segptr] : this->snd_buf)
+			{
+				int32_t order = _itimediff(segptr->ts, this->rack_ts);
+				if (order > 0 || (order == 0 && seg_sn >= this->rack_sn))
+				{
+					// first transmissions of later sn were sent later still
+					if (segptr->xmit == 1) break;
+					continue;
+				}
+
+				uint32_t deadline = segptr->ts + window;
+				if (_itimediff(current, deadline) < 0)
+				{
+					if (this->ts_rack == 0 || _itimediff(deadline, this->ts_rack) < 0)
+						this->ts_rack = deadline;
+					continue;
+				}
+
+				uint32_t old_resendts = segptr->resendts;
+				segptr->xmit++;
+				segptr->resendts = current + segptr->rto;
+				rack_lost++;
+				session_counters::add(this->stats.retransmits_rack, 1);
+				record_trace(trace_event::resend_rack, seg_sn, current, segptr->len, segptr->xmit);
+
+				if (auto fastack_iter = this->fastack_buf.find(segptr->fastack); fastack_iter != this->fastack_buf.end())
+					fastack_iter->second.erase(seg_sn);
+				segptr->fastack = 0;
+				this->fastack_buf[0][seg_sn] = segptr;
+
+				if (auto resendts_iter = this->resendts_buf.find(old_resendts); resendts_iter != this->resendts_buf.end())
+					resendts_iter->second.erase(seg_sn);
+				this->resendts_buf[segptr->resendts][seg_sn] = segptr;
+
+				segptr->ts = current;
+				segptr->wnd = seg.wnd;
+				segptr->una = this->rcv_nxt;
+				ptr = send_out(ptr, buffer, segptr.get());
+				this->pacing_credit -= IKCP_OVERHEAD + segptr->len;
+			}
+		}
+
+		uint32_t prev_nxt = this->snd_nxt;
+
 		// move data from snd_queue to snd_buf
-		while (this->snd_nxt < this->snd_una + cwnd && !this->snd_queue.empty())
+		while (this->snd_nxt < this->snd_una + cwnd && get_snd_queued() > 0)
 		{
-			auto iter = this->snd_queue.begin();
-			std::shared_ptr<segment> newseg = std::move(*iter);
+			if (this->pacing && this->pacing_credit <= 0)
+				break;
+
+			std::list<std::unique_ptr<segment>> &queue = next_stream_queue();
+			std::shared_ptr<segment> newseg = std::move(queue.front());
+			queue.pop_front();
+			if (&queue != &this->snd_queue)
+				this->snd_stream_count--;
 
 			newseg->conv = this->conv;
 			newseg->cmd = IKCP_CMD_PUSH;
@@ -1073,44 +2027,112 @@ namespace KCP
 			newseg->fastack = 0;
 			newseg->xmit = 1;
 
+			// stream header: other streams always carry it, stream 0 once
+			// negotiated if the segment still fits (it was queued before)
+			stream_state &state = this->streams[newseg->stream];
+			newseg->stream_gap = state.snd_started ? newseg->sn - state.snd_last : 0;
+			newseg->stream_tagged = newseg->stream != 0 || ((this->negotiated & IKCP_FEATURE_STREAMS) &&
+				newseg->len + (newseg->frg > 0xff ? IKCP_FRGEXT_SIZE : 0) + IKCP_STREAMEXT_SIZE <= this->mss);
+			state.snd_last = newseg->sn;
+			state.snd_started = true;
+			state.pass += (newseg->len + IKCP_OVERHEAD) * IKCP_STREAM_STRIDE / state.weight;
+			this->snd_pass = state.pass;
+
 			this->snd_buf[newseg->sn] = newseg;
-			this->snd_queue.pop_front();
+			this->mem_snd_queue -= ikcp_segment_cost(*newseg);
+			this->mem_snd_buf += ikcp_segment_cost(*newseg);
 			resendts_buf[newseg->resendts][newseg->sn] = newseg;
 			fastack_buf[newseg->fastack][newseg->sn] = newseg;
 
+			if (this->latency != nullptr && newseg->frg == 0)
+			{
+				this->latency->queue_delay.record(_ielapsed(current, newseg->queue_ts));
+				this->latency_unacked.push_back({ newseg->sn, newseg->queue_ts });
+			}
+
 			ptr = send_out(ptr, buffer, newseg.get());
+			this->pacing_credit -= IKCP_OVERHEAD + newseg->len;
 		}
 
-		// flash remain segments	
-		if (int size = (int)(ptr - buffer); size > 0)
-			call_output(buffer, size);
-
+		if (get_snd_queued() > 0 && _itimediff(this->snd_nxt, this->snd_una + this->snd_wnd) >= 0)
+			this->tune_limited = true;
 
-		// update ssthresh
-		if (change)
+		// tail loss probe: resend the newest segment once nothing has been
+		// acknowledged for 2 * srtt, its ack lets rack find earlier losses
+		if (this->tlp && !this->snd_buf.empty() && this->rx_srtt > 0)
 		{
-			uint32_t inflight = this->snd_nxt - this->snd_una;
-			this->ssthresh = inflight / 2;
-			if (this->ssthresh < IKCP_THRESH_MIN)
-				this->ssthresh = IKCP_THRESH_MIN;
-			this->cwnd = this->ssthresh + resent;
-			this->incr = this->cwnd * this->mss;
+			uint32_t pto = 2 * (uint32_t)this->rx_srtt + this->rmt_ack_delay;
+			if (lost || change || rack_lost || this->snd_nxt != prev_nxt)
+			{
+				this->tlp_out = false;
+				this->ts_tlp = current + pto;
+			}
+			else if (!this->tlp_out && this->ts_tlp == 0)
+			{
+				this->ts_tlp = current + pto;
+			}
+			else if (!this->tlp_out && _itimediff(current, this->ts_tlp) >= 0)
+			{
+				std::shared_ptr<segment> &segptr = this->snd_buf.rbegin()->second;
+				if (_itimediff(segptr->resendts, current) > 0)
+				{
+					segptr->xmit++;
+					session_counters::add(this->stats.retransmits_tlp, 1);
+					record_trace(trace_event::resend_tlp, segptr->sn, current, segptr->len, segptr->xmit);
+					segptr->ts = current;
+					segptr->wnd = seg.wnd;
+					segptr->una = this->rcv_nxt;
+					ptr = send_out(ptr, buffer, segptr.get());
+					this->pacing_credit -= IKCP_OVERHEAD + segptr->len;
+				}
+				this->tlp_out = true;
+				this->ts_tlp = 0;
+			}
 		}
-
-		if (lost)
+		else
 		{
-			this->ssthresh = cwnd / 2;
-			if (this->ssthresh < IKCP_THRESH_MIN)
-				this->ssthresh = IKCP_THRESH_MIN;
-			this->cwnd = 1;
-			this->incr = this->mss;
+			this->ts_tlp = 0;
 		}
 
-		if (this->cwnd < 1)
+		// schedule the next paced sub-burst
+		this->ts_pacing_next = 0;
+		if (this->pacing && this->pacing_credit <= 0 &&
+			this->snd_nxt < this->snd_una + cwnd && get_snd_queued() > 0)
 		{
-			this->cwnd = 1;
-			this->incr = this->mss;
+			uint64_t rate = pacing_rate(cwnd);
+			uint64_t wait = ((uint64_t)(1 - this->pacing_credit) * 1000 + rate - 1) / rate;
+			if (wait > this->interval) wait = this->interval;
+			this->ts_pacing_next = current + _imax_((uint32_t)wait, 1);
 		}
+
+		update_writable();
+
+		// flash remain segments	
+		if (int size = (int)(ptr - buffer); size > 0)
+			call_output(buffer, size);
+
+		if (this->fec != nullptr)
+			this->fec->flush([this](const char *buf, int len) { return write_output(buf, len); });
+
+
+		// update ssthresh
+		if (change || rack_lost)
+			this->congestion->on_fast_retransmit(make_congestion_event(cwnd));
+
+		if (lost)
+			this->congestion->on_loss(make_congestion_event(cwnd));
+
+		if (lost || change || rack_lost)
+			this->tune_lost = true;
+		autotune_windows(current);
+
+		session_counters::set(this->stats.cwnd, this->nocwnd == 0 ? this->congestion->get_cwnd() : cwnd);
+		session_counters::set(this->stats.inflight, this->snd_nxt - this->snd_una);
+		session_counters::set(this->stats.snd_queue, get_snd_queued());
+		session_counters::set(this->stats.snd_buf, this->snd_buf.size());
+		session_counters::set(this->stats.rcv_queue, get_rcv_queued());
+		session_counters::set(this->stats.rcv_buf, this->rcv_buf.size());
+		report_memory();
 	}
 
 
@@ -1147,6 +2169,19 @@ namespace KCP
 
 			flush();
 		}
+		else if (this->ts_pacing_next != 0 && _itimediff(this->current, this->ts_pacing_next) >= 0)
+		{
+			flush();
+		}
+		else if (this->ack_delay > 0 && ack_due(this->current))
+		{
+			flush();
+		}
+		else if ((this->ts_rack != 0 && _itimediff(this->current, this->ts_rack) >= 0) ||
+			(this->ts_tlp != 0 && _itimediff(this->current, this->ts_tlp) >= 0))
+		{
+			flush();
+		}
 	}
 
 
@@ -1177,6 +2212,39 @@ namespace KCP
 
 		tm_flush = _itimediff(ts_flush, current);
 
+		if (this->ts_pacing_next != 0)
+		{
+			int32_t diff = _itimediff(this->ts_pacing_next, current);
+			if (diff <= 0)
+				return current;
+
+			if (diff < tm_packet)
+				tm_packet = diff;
+		}
+
+		if (this->ack_delay > 0 && !this->acklist.empty())
+		{
+			if (ack_due(current))
+				return current;
+
+			int32_t diff = _itimediff(this->ts_ack + this->ack_delay, current);
+			if (diff < tm_packet)
+				tm_packet = diff;
+		}
+
+		for (uint32_t deadline : { this->ts_rack, this->ts_tlp })
+		{
+			if (deadline == 0)
+				continue;
+
+			int32_t diff = _itimediff(deadline, current);
+			if (diff <= 0)
+				return current;
+
+			if (diff < tm_packet)
+				tm_packet = diff;
+		}
+
 		if (!this->resendts_buf.empty())
 		{
 			auto &[resend_ts, seg_list] = *this->resendts_buf.begin();
@@ -1203,6 +2271,8 @@ namespace KCP
 		if (buffer == nullptr)
 			return -2;
 		this->mtu = mtu;
+		if (this->fec != nullptr)
+			this->mtu -= IKCP_FEC_OVERHEAD;
 		this->mss = this->mtu - IKCP_OVERHEAD;
 		this->buffer = std::move(buffer);
 		return 0;
@@ -1241,6 +2311,60 @@ namespace KCP
 		return 0;
 	}
 
+	int kcp_core::set_pacing(int pacing, uint64_t bandwidth)
+	{
+		if (pacing >= 0)
+		{
+			this->pacing = pacing;
+			this->pacing_credit = 0;
+			this->ts_pacing = 0;
+			this->ts_pacing_next = 0;
+		}
+		this->pacing_bandwidth = bandwidth;
+		return 0;
+	}
+
+	int kcp_core::set_autotune(int autotune, uint32_t max_sndwnd, uint32_t max_rcvwnd)
+	{
+		if (autotune == 0)
+		{
+			this->autotune = 0;
+			ikcp_tune_reserved.fetch_sub(this->tune_reserved, std::memory_order_relaxed);
+			this->tune_reserved = 0;
+			return 0;
+		}
+
+		if (this->autotune == 0)
+		{
+			this->tune_min_snd = this->snd_wnd;
+			this->tune_min_rcv = this->rcv_wnd;
+			this->ts_tune = this->current;
+			this->tune_rtt = 0;
+			this->tune_acked = 0;
+			this->tune_received = 0;
+			this->tune_snd_rate = 0;
+			this->tune_rcv_rate = 0;
+			this->tune_limited = false;
+			this->tune_lost = false;
+		}
+		this->autotune = 1;
+		this->tune_max_snd = _imax_(max_sndwnd, this->tune_min_snd);
+		this->tune_max_rcv = _imax_(max_rcvwnd, this->tune_min_rcv);
+		update_wscale();
+		reserve_windows();
+		return 0;
+	}
+
+	void kcp_core::set_autotune_memory(uint64_t bytes)
+	{
+		ikcp_tune_limit.store(bytes, std::memory_order_relaxed);
+	}
+
+	uint64_t kcp_core::get_autotune_memory()
+	{
+		return ikcp_tune_reserved.load(std::memory_order_relaxed);
+	}
+
 	int kcp_core::set_wndsize(int sndwnd, int rcvwnd)
 	{
 		if (sndwnd > 0)
@@ -1249,12 +2373,553 @@ namespace KCP
 		if (rcvwnd > 0)   // must >= max fragment size
 			this->rcv_wnd = _imax_(rcvwnd, IKCP_WND_RCV);
 
+		update_wscale();
+
 		return 0;
 	}
 
 	int kcp_core::get_waitsnd()
 	{
-		return (int)(this->snd_buf.size() + this->snd_queue.size());
+		return (int)(this->snd_buf.size() + get_snd_queued());
+	}
+
+	uint32_t kcp_core::get_snd_queued()
+	{
+		return (uint32_t)this->snd_queue.size() + this->snd_stream_count;
+	}
+
+	uint32_t kcp_core::get_rcv_queued()
+	{
+		return (uint32_t)this->rcv_queue.size() + this->rcv_stream_count;
+	}
+
+	int kcp_core::set_snd_watermark(int watermark)
+	{
+		if (watermark < 0)
+			return -1;
+		this->snd_watermark = (uint32_t)watermark;
+		return 0;
+	}
+
+	int kcp_core::set_snd_bytes_watermarks(uint64_t high, uint64_t low)
+	{
+		if (low > high)
+			return -1;
+		this->snd_high = high;
+		this->snd_low = low;
+		return 0;
+	}
+
+	uint64_t kcp_core::get_snd_bytes()
+	{
+		return this->snd_bytes;
+	}
+
+	// raise IKCP_EVENT_WRITABLE once snd_queue is below the segment watermark
+	// and snd_bytes has drained to the low byte watermark
+	void kcp_core::update_writable()
+	{
+		if (!this->snd_blocked)
+			return;
+		uint32_t watermark = this->snd_watermark > 0 ? this->snd_watermark : this->snd_wnd;
+		if (get_snd_queued() >= watermark)
+			return;
+		if (this->snd_high > 0 && this->snd_bytes > this->snd_low)
+			return;
+		this->snd_blocked = false;
+		this->events |= IKCP_EVENT_WRITABLE;
+	}
+
+	uint32_t kcp_core::take_events()
+	{
+		uint32_t events = this->events;
+		this->events = 0;
+		return events;
+	}
+
+	int kcp_core::set_ack_policy(int every, int delay)
+	{
+		uint32_t ack_every = every >= 0 ? (uint32_t)_imax_(every, 1) : this->ack_every;
+		uint32_t ack_delay = delay >= 0 ? (uint32_t)_imin_(delay, IKCP_RTO_MIN) : this->ack_delay;
+		if (ack_every > 1 && ack_delay == 0)
+			return -1;
+
+		this->ack_every = ack_every;
+		if (ack_delay != this->ack_delay)
+		{
+			// tell the remote side until it echoes, it adds the delay to its rto
+			this->ack_delay = ack_delay;
+			this->delay_acked = false;
+			this->delay_announce_count = 0;
+			this->ts_delay_announce = this->current;
+		}
+		return 0;
+	}
+
+	int kcp_core::set_loss_detection(int rack, int tlp)
+	{
+		if (rack >= 0)
+			this->rack = rack;
+		if (tlp >= 0)
+			this->tlp = tlp;
+		return 0;
+	}
+
+	// remember the newest transmission the remote has seen, ack / sack echo
+	// the ts of that very transmission, sn breaks ties within one flush
+	void kcp_core::rack_update(uint32_t ts, uint32_t sn)
+	{
+		if (_itimediff(ts, this->current) > 0)
+			return;
+		int32_t order = _itimediff(ts, this->rack_ts);
+		if (!this->rack_valid || order > 0 || (order == 0 && _itimediff(sn, this->rack_sn) > 0))
+		{
+			this->rack_ts = ts;
+			this->rack_sn = sn;
+			this->rack_valid = true;
+		}
+	}
+
+	//---------------------------------------------------------------------
+	// whether pending acks must leave on this flush
+	//---------------------------------------------------------------------
+	bool kcp_core::ack_due(uint32_t current)
+	{
+		if (this->acklist.empty())
+			return false;
+
+		return this->acklist.size() >= this->ack_every || this->ack_immediate ||
+			_itimediff(current, this->ts_ack) >= (int32_t)this->ack_delay;
+	}
+
+	//---------------------------------------------------------------------
+	// sort acklist by sn, a retransmitted sn is acked once with its newest ts
+	//---------------------------------------------------------------------
+	void kcp_core::dedup_acklist()
+	{
+		std::sort(this->acklist.begin(), this->acklist.end());
+
+		size_t count = 0;
+		for (size_t i = 0; i < this->acklist.size(); i++)
+		{
+			auto [ack_sn, ack_ts] = this->acklist[i];
+			if (count > 0 && this->acklist[count - 1].first == ack_sn)
+			{
+				if (_itimediff(ack_ts, this->acklist[count - 1].second) > 0)
+					this->acklist[count - 1].second = ack_ts;
+				continue;
+			}
+			this->acklist[count++] = this->acklist[i];
+		}
+		this->acklist.resize(count);
+	}
+
+	// keep acklist bounded under a flood of duplicates: acks below rcv_nxt
+	// are covered by una, what remains is unique sn inside the window
+	void kcp_core::trim_acklist()
+	{
+		dedup_acklist();
+		uint32_t rcv_nxt = this->rcv_nxt;
+		this->acklist.erase(std::remove_if(this->acklist.begin(), this->acklist.end(),
+			[rcv_nxt](const std::pair<uint32_t, uint32_t> &ack) { return ack.first < rcv_nxt; }), this->acklist.end());
+	}
+
+	int kcp_core::set_features(uint32_t features)
+	{
+		if (features & ~IKCP_FEATURE_MASK)
+			return -1;
+		this->features = features;
+		this->features_acked = false;
+		if ((features & IKCP_FEATURE_WSCALE) == 0)
+			this->rmt_wscale = 0;
+		update_wscale();
+		this->negotiated = 0;
+		this->announce_count = 0;
+		this->ts_announce = 0;
+		return 0;
+	}
+
+	uint32_t kcp_core::get_negotiated()
+	{
+		return this->negotiated;
+	}
+
+	int kcp_core::set_max_message_size(uint32_t bytes)
+	{
+		if (bytes == 0 || bytes > 0x7fffffff)
+			return -1;
+		this->rcv_msg_max = bytes;
+		return 0;
+	}
+
+	int kcp_core::set_stream_priority(uint32_t id, uint32_t priority, uint32_t weight)
+	{
+		if (id > IKCP_STREAM_MAX || weight == 0)
+			return -1;
+		stream_state &state = this->streams[id];
+		state.priority = priority;
+		state.weight = weight;
+		return 0;
+	}
+
+	//---------------------------------------------------------------------
+	// send queue the next segment comes from: the lowest priority value,
+	// among equal priorities the stream with the smallest pass (stride
+	// scheduling, a stream advances by bytes / weight per segment)
+	//---------------------------------------------------------------------
+	std::list<std::unique_ptr<segment>>& kcp_core::next_stream_queue()
+	{
+		if (this->snd_stream_count == 0)
+			return this->snd_queue;
+
+		std::list<std::unique_ptr<segment>> *best = nullptr;
+		const stream_state *best_state = nullptr;
+		for (auto &[id, state] : this->streams)
+		{
+			std::list<std::unique_ptr<segment>> &queue = id != 0 ? state.snd_queue : this->snd_queue;
+			if (queue.empty())
+				continue;
+			if (best == nullptr || state.priority < best_state->priority ||
+				(state.priority == best_state->priority && state.pass < best_state->pass))
+			{
+				best = &queue;
+				best_state = &state;
+			}
+		}
+		return best != nullptr ? *best : this->snd_queue;
+	}
+
+	//---------------------------------------------------------------------
+	// features carried in the frg field of IKCP_CMD_WASK / IKCP_CMD_WINS,
+	// the window shift in the low byte of sn, the echo of our ack delay
+	// in the next one and the remote ack delay in ts (0 from older peers)
+	//---------------------------------------------------------------------
+	void kcp_core::parse_features(uint32_t frg, uint32_t sn, uint32_t ts)
+	{
+		this->rmt_ack_delay = _imin_(ts, IKCP_RTO_MIN);
+		if (((sn >> 8) & 0xff) == this->ack_delay)
+			this->delay_acked = true;
+
+		bool first = !this->rmt_features_known;
+		this->rmt_features = frg & IKCP_FEATURE_MASK;
+		this->rmt_features_known = true;
+		if (frg & IKCP_FEATURE_ACK)
+			this->features_acked = true;
+		this->negotiated = this->features_acked ? (this->features & this->rmt_features) : 0;
+
+		// the remote side scales its window as soon as it announces the
+		// feature, until it knows whether we have it: reading a scaled
+		// window unscaled only underestimates it
+		if ((this->features & IKCP_FEATURE_WSCALE) && (this->rmt_features & IKCP_FEATURE_WSCALE))
+			this->rmt_wscale = _imin_(sn & 0xff, IKCP_WSCALE_MAX);
+		else
+			this->rmt_wscale = 0;
+
+		// tell the remote side we have its features
+		if (this->features != 0 && this->rmt_features != 0 && (first || (frg & IKCP_FEATURE_ACK) == 0))
+			this->probe |= IKCP_ASK_TELL;
+	}
+
+	//---------------------------------------------------------------------
+	// encode acklist as IKCP_CMD_SACK: una plus ranges of received sn
+	//---------------------------------------------------------------------
+	char* kcp_core::flush_sack(char *ptr, char *buffer, const segment &seg)
+	{
+		if (this->acklist.empty())
+			return ptr;
+
+		uint32_t newest_ts = this->acklist.front().second;
+		for (auto &[ack_sn, ack_ts] : this->acklist)
+			if (_itimediff(ack_ts, newest_ts) > 0)
+				newest_ts = ack_ts;
+
+		// acklist is sorted by dedup_acklist(), merge into [first, last] ranges, reuse acklist storage
+		size_t count = 0;
+		for (size_t i = 0; i < this->acklist.size(); i++)
+		{
+			uint32_t ack_sn = this->acklist[i].first;
+			if (ack_sn < this->rcv_nxt)
+				continue;
+			if (count > 0 && ack_sn <= this->acklist[count - 1].second + 1 &&
+				ack_sn - this->acklist[count - 1].first < 0xffff)
+			{
+				this->acklist[count - 1].second = _imax_(this->acklist[count - 1].second, ack_sn);
+				continue;
+			}
+			this->acklist[count++] = { ack_sn, ack_sn };
+		}
+
+		uint32_t max_ranges = (this->mtu - IKCP_OVERHEAD) / IKCP_SACK_RANGE;
+		size_t index = 0;
+		do
+		{
+			uint32_t ranges = _imin_((uint32_t)(count - index), max_ranges);
+			segment sack;
+			sack.conv = seg.conv;
+			sack.cmd = IKCP_CMD_SACK;
+			sack.frg = 0;
+			sack.wnd = seg.wnd;
+			sack.ts = newest_ts;
+			sack.sn = ranges;
+			sack.una = seg.una;
+			sack.len = ranges * IKCP_SACK_RANGE;
+
+			ptr = encode_seg(ptr, buffer, sack);
+			session_counters::add(this->stats.acks_sent, 1);
+			for (size_t i = index; i < index + ranges; i++)
+			{
+				auto [first, last] = this->acklist[i];
+				ptr = ikcp_encode32u(ptr, first);
+				ptr = ikcp_encode16u(ptr, (uint16_t)(last - first));
+			}
+			index += ranges;
+		} while (index < count);
+
+		return ptr;
+	}
+
+	void kcp_core::set_congestion_controller(std::unique_ptr<congestion_controller> controller)
+	{
+		if (controller == nullptr)
+			controller = std::make_unique<reno_controller>();
+		this->congestion = std::move(controller);
+	}
+
+	int kcp_core::set_fec(int data_shards, int parity_shards)
+	{
+		if (data_shards < 0 || data_shards > IKCP_FEC_MAX_SHARDS || parity_shards < 0 || parity_shards > IKCP_FEC_MAX_SHARDS)
+			return -1;
+		if ((data_shards == 0) != (parity_shards == 0))
+			return -1;
+
+		int mtu = (int)this->mtu + (this->fec != nullptr ? IKCP_FEC_OVERHEAD : 0);
+		if (data_shards == 0)
+			this->fec = nullptr;
+		else
+			this->fec = std::make_unique<fec_codec>(data_shards, parity_shards);
+		return set_mtu(mtu);
+	}
+
+	uint32_t kcp_core::get_cwnd()
+	{
+		return this->congestion->get_cwnd();
+	}
+
+	void kcp_core::set_trace(std::shared_ptr<trace_ring> ring, uint32_t mask)
+	{
+		this->trace_mask = ring != nullptr ? mask & trace_all : 0;
+		this->trace = std::move(ring);
+	}
+
+	int kcp_core::set_memory_limit(uint64_t bytes)
+	{
+		this->mem_limit = bytes;
+		return 0;
+	}
+
+	void kcp_core::set_memory_budget(uint64_t bytes)
+	{
+		ikcp_memory_budget.store(bytes, std::memory_order_relaxed);
+	}
+
+	memory_usage kcp_core::get_memory()
+	{
+		memory_usage usage;
+		usage.snd_queue = this->mem_snd_queue;
+		usage.snd_buf = this->mem_snd_buf;
+		usage.rcv_buf = this->mem_rcv_buf;
+		usage.rcv_queue = this->mem_rcv_queue;
+		usage.acklist = this->acklist.capacity() * sizeof(this->acklist[0]);
+		usage.buffers = (this->buffer != nullptr ? (this->mtu + IKCP_OVERHEAD) * 3 : 0) +
+			(this->rcv_large != nullptr ? this->rcv_large_capacity : 0);
+		return usage;
+	}
+
+	uint64_t kcp_core::get_memory_used()
+	{
+		return ikcp_memory_used.load(std::memory_order_relaxed);
+	}
+
+	uint64_t kcp_core::memory_total()
+	{
+		return get_memory().total();
+	}
+
+	// room for 'bytes' more under the session limit and the process budget
+	bool kcp_core::memory_available(uint64_t bytes)
+	{
+		uint64_t budget = ikcp_memory_budget.load(std::memory_order_relaxed);
+		if (this->mem_limit == 0 && budget == 0)
+			return true;
+
+		uint64_t total = memory_total();
+		if (this->mem_limit > 0 && total + bytes > this->mem_limit)
+			return false;
+
+		// the process total with this session's unreported change
+		uint64_t used = ikcp_memory_used.load(std::memory_order_relaxed) - this->mem_reported + total;
+		return budget == 0 || used + bytes <= budget;
+	}
+
+	// publish the change of this session to the process wide total
+	void kcp_core::report_memory()
+	{
+		uint64_t total = memory_total();
+		if (total == this->mem_reported)
+			return;
+		ikcp_memory_used.fetch_add(total - this->mem_reported, std::memory_order_relaxed);
+		this->mem_reported = total;
+	}
+
+	void kcp_core::set_latency_tracking(bool enable)
+	{
+		if (enable && this->latency == nullptr)
+			this->latency = std::make_unique<latency_recorders>();
+		else if (!enable)
+			this->latency = nullptr;
+		this->latency_unacked.clear();
+	}
+
+	message_latency kcp_core::get_latency()
+	{
+		return this->latency != nullptr ? this->latency->snapshot() : message_latency{};
+	}
+
+	session_stats kcp_core::get_stats()
+	{
+		return this->stats.snapshot();
+	}
+
+	congestion_event kcp_core::make_congestion_event(uint32_t wnd)
+	{
+		congestion_event ev;
+		ev.current = this->current;
+		ev.mss = this->mss;
+		ev.rmt_wnd = this->rmt_wnd;
+		ev.wnd = wnd;
+		ev.inflight = this->snd_nxt - this->snd_una;
+		ev.unacked = (uint32_t)this->snd_buf.size();
+		ev.resent = (this->fastresend > 0) ? (uint32_t)this->fastresend : 0;
+		ev.srtt = this->rx_srtt;
+		return ev;
+	}
+
+	//---------------------------------------------------------------------
+	// pacing rate in bytes per second
+	//---------------------------------------------------------------------
+	uint64_t kcp_core::pacing_rate(uint32_t cwnd)
+	{
+		if (this->pacing_bandwidth > 0)
+			return this->pacing_bandwidth;
+
+		if (uint64_t rate = this->congestion->pacing_rate(); rate > 0)
+			return rate;
+
+		uint32_t srtt = this->rx_srtt > 0 ? (uint32_t)this->rx_srtt : (uint32_t)this->rx_rto;
+		uint64_t rate = (uint64_t)_imax_(cwnd, 1) * (this->mss + IKCP_OVERHEAD) * 1000 / _imax_(srtt, 1);
+		rate = rate * IKCP_PACING_GAIN / 100;
+		return rate > 0 ? rate : 1;
+	}
+
+	//---------------------------------------------------------------------
+	// accumulate pacing credit, at most one sub-burst is kept in reserve
+	//---------------------------------------------------------------------
+	void kcp_core::refill_pacing(uint32_t current, uint32_t cwnd)
+	{
+		uint64_t rate = pacing_rate(cwnd);
+		int64_t burst = (int64_t)(rate * this->interval / 1000 / IKCP_PACING_SPLIT);
+		int64_t minimal = 2 * (int64_t)(this->mss + IKCP_OVERHEAD);
+		if (burst < minimal)
+			burst = minimal;
+		// the clock ticks in millisec, a shorter sub-burst would cap the rate
+		if (burst < (int64_t)(rate / 1000))
+			burst = (int64_t)(rate / 1000);
+
+		int32_t elapsed = _itimediff(current, this->ts_pacing);
+		if (this->ts_pacing == 0 || elapsed < 0 || elapsed > (int32_t)this->interval)
+			this->pacing_credit = burst;
+		else
+			this->pacing_credit += (int64_t)(rate * (uint32_t)elapsed / 1000);
+
+		if (this->pacing_credit > burst)
+			this->pacing_credit = burst;
+		this->ts_pacing = current;
+	}
+
+	//---------------------------------------------------------------------
+	// window autotuning, once per srtt at the end of flush
+	//---------------------------------------------------------------------
+	static uint32_t ikcp_tune_window(uint32_t wnd, uint64_t rate, uint32_t rtt,
+		uint32_t gain, uint32_t lower, uint32_t upper, bool pressure, bool grow)
+	{
+		uint64_t bdp = rate * rtt / 1000;
+		uint64_t target = pressure ? bdp : bdp * gain / 100;
+		if (pressure)
+			target = std::min<uint64_t>(target, wnd);
+		else if (grow)
+			target = std::max<uint64_t>(target, (uint64_t)wnd * 2);
+		else if (target < wnd)
+			target = std::max<uint64_t>(target, wnd - wnd / 4);	// shrink gently
+		return (uint32_t)std::clamp<uint64_t>(target, lower, upper);
+	}
+
+	void kcp_core::autotune_windows(uint32_t current)
+	{
+		if (this->autotune == 0)
+			return;
+
+		uint32_t srtt = this->rx_srtt > 0 ? (uint32_t)this->rx_srtt : IKCP_RTO_DEF;
+		int32_t elapsed = _itimediff(current, this->ts_tune);
+		if (elapsed < 0 || elapsed < (int32_t)_imax_(srtt, this->interval))
+			return;
+		this->ts_tune = current;
+
+		// the smallest recent sample, srtt grows with the queue a large
+		// window builds and would feed back into the window
+		uint32_t rtt = this->tune_rtt > 0 ? this->tune_rtt : srtt;
+
+		// while snd_wnd holds new data back and each round still delivers a
+		// quarter more, snd_wnd doubles like slow start. A resend ends the
+		// round's growth as loss ends slow start. A window limited
+		// receiver sees about rcv_wnd / rtt, the gain doubles it each round
+		uint64_t snd_rate = this->tune_acked * 1000 / (uint32_t)elapsed;
+		uint64_t rcv_rate = this->tune_received * 1000 / (uint32_t)elapsed;
+		bool grow = this->tune_limited && !this->tune_lost && snd_rate >= this->tune_snd_rate + this->tune_snd_rate / 4;
+		this->tune_limited = false;
+		this->tune_lost = false;
+		this->tune_snd_rate = std::max(snd_rate, this->tune_snd_rate - this->tune_snd_rate / 8);
+		this->tune_rcv_rate = std::max(rcv_rate, this->tune_rcv_rate - this->tune_rcv_rate / 8);
+		this->tune_acked = 0;
+		this->tune_received = 0;
+
+		uint64_t limit = ikcp_tune_limit.load(std::memory_order_relaxed);
+		bool pressure = limit > 0 && ikcp_tune_reserved.load(std::memory_order_relaxed) > limit;
+
+		this->snd_wnd = ikcp_tune_window(this->snd_wnd, this->tune_snd_rate, rtt,
+			this->nocwnd ? IKCP_TUNE_GAIN_NC : IKCP_TUNE_GAIN, this->tune_min_snd, this->tune_max_snd, pressure, grow);
+		uint32_t max_rcv = _imax_(_imin_(this->tune_max_rcv, get_wnd_limit()), this->tune_min_rcv);
+		this->rcv_wnd = ikcp_tune_window(this->rcv_wnd, this->tune_rcv_rate, rtt,
+			IKCP_TUNE_GAIN, this->tune_min_rcv, max_rcv, pressure, false);
+		reserve_windows();
+	}
+
+	void kcp_core::reserve_windows()
+	{
+		uint64_t reserved = (uint64_t)(this->snd_wnd + this->rcv_wnd) * this->mss;
+		ikcp_tune_reserved.fetch_add(reserved, std::memory_order_relaxed);
+		ikcp_tune_reserved.fetch_sub(this->tune_reserved, std::memory_order_relaxed);
+		this->tune_reserved = reserved;
+	}
+
+	//---------------------------------------------------------------------
+	// raise IKCP_EVENT_READABLE when a complete message becomes available
+	//---------------------------------------------------------------------
+	void kcp_core::check_readable()
+	{
+		bool now_readable = peek_stream() >= 0;
+		if (now_readable && !this->readable)
+			this->events |= IKCP_EVENT_READABLE;
+		this->readable = now_readable;
 	}
 
 	// read conv
@@ -1270,18 +2935,62 @@ namespace KCP
 		return conv;
 	}
 
-	char* KCP::kcp_core::send_out(char *ptr, char *buffer, segment *segptr)
+	//---------------------------------------------------------------------
+	// append a segment header to the flush buffer, the buffer is sent first
+	// when header and payload would exceed mtu. Once IKCP_FEATURE_COMPACT is
+	// negotiated, datagrams use the compact header unless the first segment
+	// does not fit that way
+	//---------------------------------------------------------------------
+	char* kcp_core::encode_seg(char *ptr, char *buffer, const segment &seg)
 	{
 		int size = (int)(ptr - buffer);
-		int need = (int)IKCP_OVERHEAD + (int)segptr->len;
+		int need = (int)seg.len + (this->wire_compact ?
+			ikcp_compact_size(seg, this->wire_ts, this->wire_sn, this->wire_una) : (int)(IKCP_OVERHEAD + ikcp_ext_size(seg)));
 
-		if (size + need > (int)this->mtu)
+		if (size > 0 && size + need > (int)this->mtu)
 		{
 			call_output(buffer, size);
 			ptr = buffer;
+			size = 0;
 		}
 
-		ptr = ikcp_encode_seg(ptr, segptr);
+		if (size == 0)
+		{
+			this->wire_ts = 0;
+			this->wire_sn = 0;
+			this->wire_una = 0;
+			this->wire_compact = (this->negotiated & IKCP_FEATURE_COMPACT) != 0 &&
+				4 + ikcp_compact_size(seg, 0, 0, 0) + (int)seg.len <= (int)this->mtu;
+			if (this->wire_compact)
+				ptr = ikcp_encode32u(ptr, seg.conv);
+		}
+
+		if (!this->wire_compact)
+			return ikcp_encode_seg(ptr, seg);
+
+		ptr = ikcp_encode_compact(ptr, seg, this->wire_ts, this->wire_sn, this->wire_una);
+		this->wire_ts = seg.ts;
+		this->wire_sn = seg.sn;
+		this->wire_una = seg.una;
+		return ptr;
+	}
+
+	char* KCP::kcp_core::send_out(char *ptr, char *buffer, segment *segptr)
+	{
+		this->congestion->on_send(make_congestion_event(_imin_(this->snd_wnd, this->rmt_wnd)), *segptr);
+
+		ptr = encode_seg(ptr, buffer, *segptr);
+
+		if (segptr->xmit <= 1)
+		{
+			session_counters::add(this->stats.segments_sent, 1);
+			session_counters::add(this->stats.bytes_sent, segptr->len);
+			record_trace(trace_event::push_out, segptr->sn, segptr->ts, segptr->len, segptr->xmit);
+		}
+		else
+		{
+			session_counters::add(this->stats.bytes_retransmitted, segptr->len);
+		}
 
 		if (segptr->len > 0)
 		{
@@ -1289,8 +2998,12 @@ namespace KCP
 			ptr += segptr->len;
 		}
 
-		if (segptr->xmit >= this->dead_link)
+		if (segptr->xmit >= this->dead_link && this->state != (uint32_t)-1)
+		{
 			this->state = (uint32_t)-1;
+			this->events |= IKCP_EVENT_DEADLINK;
+			record_trace(trace_event::dead_link, segptr->sn, segptr->ts, segptr->len, segptr->xmit);
+		}
 
 		return ptr;
 	}
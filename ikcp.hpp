@@ -17,13 +17,22 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <stdint.h>
+#include <deque>
 #include <functional>
 #include <list>
 #include <map>
 #include <memory>
+#include <new>
+#include <set>
 #include <vector>
 #include <unordered_map>
 
+#include "ikcp_congestion.hpp"
+#include "ikcp_fec.hpp"
+#include "ikcp_latency.hpp"
+#include "ikcp_stats.hpp"
+#include "ikcp_trace.hpp"
+
 
 #ifdef _MSC_VER
 #pragma warning(disable:4311)
@@ -31,6 +40,17 @@
 #pragma warning(disable:4996)
 #endif
 
+// ikcp_log and the logmask checks are compiled in only with
+// IKCP_ENABLE_LOG=1, the default of builds without NDEBUG. With 0 the
+// log branches disappear and logmask / writelog are ignored
+#ifndef IKCP_ENABLE_LOG
+#ifdef NDEBUG
+#define IKCP_ENABLE_LOG 0
+#else
+#define IKCP_ENABLE_LOG 1
+#endif
+#endif
+
 
 namespace KCP
 {
@@ -51,6 +71,12 @@ namespace KCP
 		uint32_t rto = 0;
 		uint32_t fastack = 0;
 		uint32_t xmit = 0;
+		uint64_t delivered = 0;		// delivery rate sample, stamped by the congestion controller
+		uint32_t delivered_ts = 0;
+		uint32_t queue_ts = 0;		// latency tracking: send() time, or arrival at the receiver
+		uint32_t stream = 0;		// stream id, IKCP_FEATURE_STREAMS
+		uint32_t stream_gap = 0;	// sn minus the sn of the previous segment of the stream, 0: first one
+		bool stream_tagged = false;	// stream id and gap are sent with the segment
 		std::unique_ptr<char[]> data;
 
 		segment() = default;
@@ -65,7 +91,7 @@ namespace KCP
 
 		bool resize(uint32_t new_size)
 		{
-			std::unique_ptr<char[]> new_data = std::make_unique<char[]>(new_size);
+			std::unique_ptr<char[]> new_data(new (std::nothrow) char[new_size]);
 			if (new_data == nullptr) return false;
 			if (data != nullptr)
 				std::copy_n(data.get(), len, new_data.get());
@@ -75,6 +101,23 @@ namespace KCP
 	};
 
 
+	//---------------------------------------------------------------------
+	// one stream of a session (IKCP_FEATURE_STREAMS). Stream 0 keeps its
+	// segments in kcp_core::snd_queue and rcv_queue, its queues here stay
+	// empty
+	//---------------------------------------------------------------------
+	struct stream_state
+	{
+		uint32_t priority = 0;		// lower values are sent first
+		uint32_t weight = 1;		// share among the streams of one priority
+		uint64_t pass = 0;			// stride scheduling: bytes sent / weight
+		uint32_t snd_last = 0;		// sn of the newest segment moved to snd_buf
+		bool snd_started = false;
+		std::list<std::unique_ptr<segment>> snd_queue;
+		std::list<segment> rcv_queue;
+	};
+
+
 	//---------------------------------------------------------------------
 	// IKCPCB
 	//---------------------------------------------------------------------
@@ -82,26 +125,74 @@ namespace KCP
 	{
 		uint32_t conv, mtu, mss, state;
 		uint32_t snd_una, snd_nxt, rcv_nxt;
-		uint32_t ts_recent, ts_lastack, ssthresh;
+		uint32_t ts_recent, ts_lastack;
 		int32_t rx_rttval, rx_srtt, rx_rto, rx_minrto;
-		uint32_t snd_wnd, rcv_wnd, rmt_wnd, cwnd, probe;
+		uint32_t snd_wnd, rcv_wnd, rmt_wnd, probe;
 		uint32_t current, interval, ts_flush, xmit;
 		uint32_t nodelay, updated;
 		uint32_t ts_probe, probe_wait;
-		uint32_t dead_link, incr;
+		uint32_t dead_link;
+		uint32_t events, snd_watermark;
+		bool readable, snd_blocked;
+		uint64_t snd_bytes = 0;					// payload bytes in snd_queue and unacknowledged in snd_buf
+		uint64_t snd_high = 0, snd_low = 0;		// byte watermarks, 0: off
+		uint32_t ack_every, ack_delay, ts_ack;
+		uint32_t rmt_ack_delay;				// ack delay announced by the remote side in WASK / WINS ts
+		uint32_t ts_delay_announce, delay_announce_count;
+		bool ack_immediate, delay_acked;	// delay_acked: the remote side echoed our ack_delay
+		uint32_t rack, tlp, rack_ts, rack_sn, ts_rack, ts_tlp;
+		bool rack_valid, tlp_out;
+		uint32_t features, rmt_features, negotiated;
+		uint32_t rcv_wscale, rmt_wscale;		// shift of the advertised window, IKCP_FEATURE_WSCALE
+		uint32_t ts_announce, announce_count;
+		bool rmt_features_known, features_acked;
+		bool wire_compact;
+		uint32_t wire_ts, wire_sn, wire_una;	// previous segment of the compact datagram being built
+		uint32_t pacing, ts_pacing, ts_pacing_next;
+		uint64_t pacing_bandwidth;
+		int64_t pacing_credit;
+		uint32_t autotune, ts_tune;
+		uint32_t tune_rtt, ts_tune_rtt;			// min rtt of the last IKCP_TUNE_RTT_WINDOW millisec
+		uint32_t tune_min_snd, tune_min_rcv, tune_max_snd, tune_max_rcv;
+		uint64_t tune_acked, tune_received;		// segments since ts_tune
+		uint64_t tune_snd_rate, tune_rcv_rate;	// decaying max, segments per second
+		bool tune_limited;						// snd_wnd stopped new data since ts_tune
+		bool tune_lost;							// a segment was resent since ts_tune
+		uint64_t tune_reserved = 0;				// share of the process wide autotune budget
+		session_counters stats;
+		uint64_t mem_snd_queue = 0, mem_snd_buf = 0;	// bytes, see memory_usage
+		uint64_t mem_rcv_buf = 0, mem_rcv_queue = 0;
+		uint64_t mem_limit = 0;					// per session cap in bytes, 0: none
+		uint64_t mem_reported = 0;				// share of the process wide total
 		std::list<std::unique_ptr<segment>> snd_queue;
 		std::list<segment> rcv_queue;
 		std::map<uint32_t, std::shared_ptr<segment>> snd_buf;	// SN -> segment
 		std::map<uint32_t, std::unordered_map<uint32_t, std::weak_ptr<segment>>> resendts_buf;	// resendts -> segment
 		std::map<uint32_t, std::unordered_map<uint32_t, std::weak_ptr<segment>>> fastack_buf;	// fastack -> segment
 		std::map<uint32_t, std::unique_ptr<segment>> rcv_buf;	// SN -> segment
+		std::map<uint32_t, stream_state> streams;	// stream id -> state
+		uint32_t snd_stream_count = 0;			// segments in the snd_queue of streams other than 0
+		uint32_t rcv_stream_count = 0;			// segments in the rcv_queue of streams other than 0
+		uint64_t snd_pass = 0;					// pass of the stream scheduled last
+		std::set<uint32_t> rcv_delivered;		// SN above rcv_nxt already delivered to its stream
+		std::unordered_map<uint32_t, uint32_t> rcv_waiting;	// SN -> next segment of its stream, waiting for it
+		std::unique_ptr<segment> rcv_large;		// large message being reassembled
+		uint32_t rcv_large_capacity;
+		uint32_t rcv_msg_max;					// bytes, larger incoming messages are dropped
+		bool rcv_large_drop;					// skipping the rest of a dropped large message
 		std::vector<std::pair<uint32_t, uint32_t>> acklist;
+		std::unique_ptr<congestion_controller> congestion;
+		std::unique_ptr<fec_codec> fec;
 		void *user;
 		std::unique_ptr<char[]> buffer;
 		int fastresend;
 		int fastlimit;
 		int nocwnd, stream;
-		int logmask;
+		int logmask;							// IKCP_LOG_*, needs IKCP_ENABLE_LOG
+		uint32_t trace_mask;					// trace_bit() of the recorded events, 0 without a ring
+		std::shared_ptr<trace_ring> trace;
+		std::unique_ptr<latency_recorders> latency;			// nullptr unless set_latency_tracking(true)
+		std::deque<std::pair<uint32_t, uint32_t>> latency_unacked;	// last sn of a message in flight, send() time
 		std::function<int(const char *, int, void *)> output_callback;	// int(*output)(const char *buf, int len, void *user)
 		std::function<void(const char *, void *)> writelog;	//void(*writelog)(const char *log, void *user)
 
@@ -122,7 +213,7 @@ namespace KCP
 		kcp_core& operator=(kcp_core &&other) noexcept { move_kcp(other); return *this; }
 
 		// release kcp control object
-		~kcp_core() = default;
+		~kcp_core();
 
 		// set output callback, which will be invoked by kcp
 		void set_output(std::function<int(const char *, int, void *)> output_callback);
@@ -130,7 +221,15 @@ namespace KCP
 		// user/upper level recv: returns size, returns below zero for EAGAIN
 		int receive(char *buffer, int len);
 
-		// user/upper level send, returns below zero for error
+		// user/upper level send, returns below zero for error. A message
+		// takes at most 127 fragments, or up to 2^24 once IKCP_FEATURE_LARGE_MSG
+		// is negotiated; the receiver then reassembles it in one buffer
+		// outside the receive window, up to set_max_message_size().
+		// -3: the message would exceed the session or process memory limit,
+		// retry once acknowledgements have freed snd_buf
+		// -4: snd_bytes reached the high watermark (set_snd_bytes_watermarks),
+		// wait for IKCP_EVENT_WRITABLE. In stream mode the bytes up to the
+		// high watermark are taken and their count is returned
 		int send(const char *buffer, int len);
 
 		// update state (call it repeatedly, every 10ms-100ms), or you can ask 
@@ -165,6 +264,28 @@ namespace KCP
 		// get how many packet is waiting to be sent
 		int get_waitsnd();
 
+		// segments waiting in the send queues of all streams, and complete or
+		// partial messages in the receive queues of all streams
+		uint32_t get_snd_queued();
+		uint32_t get_rcv_queued();
+
+		// IKCP_EVENT_WRITABLE fires when snd_queue drops below this many
+		// segments after having reached it, 0 means follow snd_wnd
+		int set_snd_watermark(int watermark);
+
+		// byte based backpressure over snd_queue plus unacknowledged snd_buf
+		// payload: send() refuses with -4 once it holds 'high' bytes, and
+		// IKCP_EVENT_WRITABLE fires when it drains to 'low' or below.
+		// high=0 turns it off, low must not be above high
+		int set_snd_bytes_watermarks(uint64_t high, uint64_t low);
+
+		// payload bytes queued or in flight, see set_snd_bytes_watermarks
+		uint64_t get_snd_bytes();
+
+		// fetch and clear pending IKCP_EVENT_* bits, each event is raised
+		// only on transition (edge-triggered)
+		uint32_t take_events();
+
 		int set_interval(int interval);
 
 		// fastest: ikcp_nodelay(kcp, 1, 20, 2, 1)
@@ -174,7 +295,123 @@ namespace KCP
 		// nc: 0:normal congestion control(default), 1:disable congestion control
 		int set_nodelay(int nodelay, int interval, int resend, int nc);
 
-
+		// delayed ack: pending acks are sent once 'every' of them are queued
+		// or the oldest has waited 'delay' millisec, whichever comes first,
+		// and at once when a segment arrives out of order.
+		// every=1, delay=0 (default) sends all acks on each flush.
+		// every > 1 needs a delay, otherwise the acks would never wait:
+		// returns -1 and keeps the policy.
+		// 'delay' is announced to the remote side, which adds it to its rto,
+		// until the remote side echoes it
+		int set_ack_policy(int every, int delay);
+
+		// time based loss detection, off by default
+		// rack: a segment sent before the newest acknowledged one is resent
+		//       once it is older than srtt plus a reorder window of srtt / 4
+		// tlp:  tail loss probe, the newest segment is resent once when
+		//       nothing was acknowledged for 2 * srtt, before its rto
+		int set_loss_detection(int rack, int tlp);
+
+		// optional protocol extensions (IKCP_FEATURE_*), announced to the remote
+		// side through IKCP_CMD_WASK / IKCP_CMD_WINS and only used once both
+		// ends have exchanged and confirmed them
+		int set_features(uint32_t features);
+
+		// features usable in this session: local & remote, once confirmed
+		uint32_t get_negotiated();
+
+		// largest message input() reassembles with IKCP_FEATURE_LARGE_MSG,
+		// 64 MB by default, at most 0x7fffffff. The buffer grows as the
+		// fragments arrive. A larger message, or one whose buffer cannot be
+		// allocated, is dropped whole and counted in messages_dropped
+		int set_max_message_size(uint32_t bytes);
+
+		// independent streams in one session, IKCP_FEATURE_STREAMS. Messages
+		// of a stream arrive in order, but a lost segment only holds back its
+		// own stream. send() and receive() use stream 0, other ids up to
+		// 65535 return -5 until the feature is negotiated. Messages beyond
+		// 127 fragments (IKCP_FEATURE_LARGE_MSG) are limited to stream 0
+		int send_stream(uint32_t id, const char *buffer, int len);
+		int receive_stream(uint32_t id, char *buffer, int len);
+
+		// lowest stream id with a complete message, -1 when there is none
+		int peek_stream();
+
+		// order in which flush() moves segments of the streams to snd_buf: a
+		// lower priority value first, streams of equal priority share the
+		// bandwidth by weight. Default priority 0, weight 1
+		int set_stream_priority(uint32_t id, uint32_t priority, uint32_t weight);
+
+		// replace the congestion controller, nullptr restores the default one
+		void set_congestion_controller(std::unique_ptr<congestion_controller> controller);
+
+		// congestion window in segments
+		uint32_t get_cwnd();
+
+		// forward error correction: every 'data_shards' output datagrams are
+		// followed by 'parity_shards' parity packets, partial groups are closed
+		// at the end of each flush. Both ends must use it, mtu shrinks by
+		// IKCP_FEC_OVERHEAD. set_fec(0, 0) turns it off
+		int set_fec(int data_shards, int parity_shards);
+
+		// spread new segments across the update interval instead of one burst
+		// pacing: 0:disable(default), 1:enable
+		// bandwidth: bytes per second, 0:derive the rate from cwnd / srtt
+		int set_pacing(int pacing, uint64_t bandwidth);
+
+		// window autotuning, off by default. Once per srtt snd_wnd and rcv_wnd
+		// move towards twice the measured delivery rate * rtt, bounded below
+		// by the windows of set_wndsize() (call it first) and above by the caps.
+		// rcv_wnd is capped at 65535, the width of the wnd field, unless
+		// IKCP_FEATURE_WSCALE is enabled. A receiver
+		// that sends no data has no rtt of its own and assumes 200ms
+		int set_autotune(int autotune, uint32_t max_sndwnd, uint32_t max_rcvwnd);
+
+		// process wide budget for autotuned windows, (snd_wnd + rcv_wnd) * mss
+		// summed over all sessions. Above it every session shrinks to its bdp
+		// and stops growing. 0: no limit (default)
+		static void set_autotune_memory(uint64_t bytes);
+		static uint64_t get_autotune_memory();	// bytes reserved now
+
+		// hard memory caps, 0: no limit (default). Above its limit, or while
+		// all sessions together are above the process budget, send() returns
+		// -3 and input() drops data segments unacknowledged so the remote
+		// side retransmits them later. The next in-order segment is always
+		// accepted, a session may exceed its cap by one segment. Fragments
+		// of a large message are checked with the growth of its buffer, a
+		// message beyond the cap is not received
+		int set_memory_limit(uint64_t bytes);
+		static void set_memory_budget(uint64_t bytes);
+
+		// bytes held by this session, call it from the thread driving it
+		memory_usage get_memory();
+		// bytes held by all sessions, updated at the end of each send,
+		// receive, input and flush
+		static uint64_t get_memory_used();
+
+		// copy of the session counters, may be called from any thread
+		// while another one drives this session
+		session_stats get_stats();
+
+		// binary event tracing into 'ring' for the events in 'mask' (trace_bit,
+		// trace_all, trace_segments), a record costs a few nanosec instead of a
+		// formatted ikcp_log line. With trace_all, flush() and input() of full
+		// size segments run about 5% and 10% slower (microbench). nullptr or
+		// mask 0 turns it off
+		void set_trace(std::shared_ptr<trace_ring> ring, uint32_t mask = trace_all);
+
+		// per-message latency histograms, see message_latency. Off by default,
+		// switch it on before other threads call get_latency(). Switching it
+		// off frees the histograms
+		void set_latency_tracking(bool enable);
+
+		// copy of the histograms, empty while tracking is off; merge them
+		// across sessions. Other threads may call it while tracking stays on,
+		// KCP::GetLatency() takes the lock
+		message_latency get_latency();
+
+
+		static constexpr bool log_enabled = IKCP_ENABLE_LOG != 0;
 		void ikcp_log(int mask, const char *fmt, ...);
 
 		// read conv
@@ -184,14 +421,47 @@ namespace KCP
 	protected:
 		void update_ack(int32_t rtt);
 		void shrink_buf();
+		decltype(snd_buf)::iterator erase_snd_buf(decltype(snd_buf)::iterator iter);
 		void parse_ack(uint32_t sn);
+		void parse_ack_range(uint32_t first, uint32_t last);
+		void parse_features(uint32_t frg, uint32_t sn, uint32_t ts);
+		bool ack_due(uint32_t current);
+		void rack_update(uint32_t ts, uint32_t sn);
+		void dedup_acklist();
+		void trim_acklist();
+		void update_writable();
+		uint64_t memory_total();
+		bool memory_available(uint64_t bytes);
+		void report_memory();
+		char* flush_sack(char *ptr, char *buffer, const segment &seg);
 		void parse_una(uint32_t una);
 		void parse_fastack(uint32_t sn, uint32_t ts);
 		int get_wnd_unused();
 		void parse_data(segment &newseg);
+		void queue_received(segment &seg);
+		uint32_t large_capacity(uint32_t frg, uint32_t len);
+		void drop_large(const segment &seg);
+		void move_received();
+		void deliver_stream(uint32_t sn);
+		int receive_queue(std::list<segment> &queue, char *buffer, int len);
+		static int peek_queue(const std::list<segment> &queue);
+		std::list<std::unique_ptr<segment>>& next_stream_queue();
 		int ikcp_canlog(int mask);
+		void record_trace(trace_event ev, uint32_t sn, uint32_t ts, uint32_t len, uint32_t xmit = 0);
+		void check_readable();
 		int call_output(const void *data, int size);
+		int write_output(const char *data, int size);
+		int input_datagram(const char *data, long size);
+		char* encode_seg(char *ptr, char *buffer, const segment &seg);
 		char* send_out(char *ptr, char *buffer, segment *newseg);
+		congestion_event make_congestion_event(uint32_t wnd);
+		uint64_t pacing_rate(uint32_t cwnd);
+		void refill_pacing(uint32_t current, uint32_t cwnd);
+		void autotune_windows(uint32_t current);
+		void reserve_windows();
+		void update_wscale();
+		uint32_t get_wnd_advertised();
+		uint32_t get_wnd_limit();
 	};
 }
 
@@ -208,6 +478,16 @@ namespace KCP
 #define IKCP_LOG_OUT_PROBE		1024
 #define IKCP_LOG_OUT_WINS		2048
 
+#define IKCP_FEATURE_SACK		1	// range based IKCP_CMD_SACK instead of one IKCP_CMD_ACK per segment
+#define IKCP_FEATURE_COMPACT	2	// conv once per datagram, delta / varint encoded segment headers
+#define IKCP_FEATURE_WSCALE		4	// wnd field counts units of 2^shift segments, shift sent in WASK / WINS sn
+#define IKCP_FEATURE_LARGE_MSG	8	// 24 bit fragment counter, messages beyond 127 fragments
+#define IKCP_FEATURE_STREAMS	16	// stream id per data segment, ordered delivery per stream
+
+#define IKCP_EVENT_READABLE		1	// a complete message is ready in the rcv_queue of a stream
+#define IKCP_EVENT_WRITABLE		2	// snd_queue dropped below the watermarks
+#define IKCP_EVENT_DEADLINK		4	// state became -1 (retransmit limit reached)
+
 
 
 #endif
@@ -0,0 +1,261 @@
+//=====================================================================
+//
+// KCP - A Better ARQ Protocol Implementation
+// skywind3000 (at) gmail.com, 2010-2011
+// Modifier: cnbatch, 2023
+//
+//=====================================================================
+#include "ikcp_congestion.hpp"
+#include "ikcp.hpp"
+
+#include <algorithm>
+
+
+constexpr uint32_t IKCP_THRESH_MIN = 2;
+constexpr uint32_t BBR_HIGH_GAIN = 289;			// 2 / ln(2), percent
+constexpr uint32_t BBR_DRAIN_GAIN = 35;			// 1 / high gain, percent
+constexpr uint32_t BBR_MIN_CWND = 4;
+constexpr uint32_t BBR_MIN_RTT_WINDOW = 10000;	// millisec
+constexpr uint32_t BBR_PROBE_RTT_TIME = 200;	// millisec
+constexpr uint32_t BBR_GAIN_CYCLE[] = { 125, 75, 100, 100, 100, 100, 100, 100 };
+
+
+namespace KCP
+{
+	//---------------------------------------------------------------------
+	// reno_controller
+	//---------------------------------------------------------------------
+	void reno_controller::on_ack(const congestion_event &ev)
+	{
+		if (this->cwnd >= ev.rmt_wnd)
+			return;
+
+		uint32_t mss = ev.mss;
+		if (this->cwnd < this->ssthresh)
+		{
+			this->cwnd++;
+			this->incr += mss;
+		}
+		else
+		{
+			if (this->incr < mss) this->incr = mss;
+			this->incr += (mss * mss) / this->incr + (mss / 16);
+			if ((this->cwnd + 1) * mss <= this->incr)
+				this->cwnd = (this->incr + mss - 1) / ((mss > 0) ? mss : 1);
+		}
+		if (this->cwnd > ev.rmt_wnd)
+		{
+			this->cwnd = ev.rmt_wnd;
+			this->incr = ev.rmt_wnd * mss;
+		}
+		if (this->cwnd < 1)
+		{
+			this->cwnd = 1;
+			this->incr = mss;
+		}
+	}
+
+	void reno_controller::on_loss(const congestion_event &ev)
+	{
+		this->ssthresh = ev.wnd / 2;
+		if (this->ssthresh < IKCP_THRESH_MIN)
+			this->ssthresh = IKCP_THRESH_MIN;
+		this->cwnd = 1;
+		this->incr = ev.mss;
+	}
+
+	void reno_controller::on_fast_retransmit(const congestion_event &ev)
+	{
+		this->ssthresh = ev.inflight / 2;
+		if (this->ssthresh < IKCP_THRESH_MIN)
+			this->ssthresh = IKCP_THRESH_MIN;
+		this->cwnd = this->ssthresh + ev.resent;
+		this->incr = this->cwnd * ev.mss;
+	}
+}
+
+
+namespace KCP
+{
+	//---------------------------------------------------------------------
+	// bbr_controller
+	//---------------------------------------------------------------------
+	void bbr_controller::on_send(const congestion_event &ev, segment &seg)
+	{
+		if (ev.inflight == 0 || this->delivered_ts == 0)
+			this->delivered_ts = ev.current;
+		seg.delivered = this->delivered;
+		seg.delivered_ts = this->delivered_ts;
+	}
+
+	void bbr_controller::on_segment_acked(const congestion_event &ev, const segment &seg)
+	{
+		this->delivered += seg.len;
+		this->delivered_ts = ev.current;
+
+		if (seg.delivered >= this->next_round_delivered)
+		{
+			this->next_round_delivered = this->delivered;
+			this->round_count++;
+			this->round_start = true;
+			this->bw_samples[this->round_count % bw_filter_rounds] = 0;
+		}
+
+		int32_t interval = (int32_t)(ev.current - seg.delivered_ts);
+		if (interval < (int32_t)this->min_rtt)
+			interval = (int32_t)this->min_rtt;
+		if (interval <= 0)
+			return;
+
+		uint64_t rate = (this->delivered - seg.delivered) * 1000 / (uint32_t)interval;
+		uint64_t &slot = this->bw_samples[this->round_count % bw_filter_rounds];
+		if (rate > slot)
+			slot = rate;
+	}
+
+	void bbr_controller::on_rtt_sample(const congestion_event &ev, int32_t rtt)
+	{
+		if (rtt <= 0)
+			rtt = 1;
+		bool expired = (int32_t)(ev.current - this->min_rtt_stamp) > (int32_t)BBR_MIN_RTT_WINDOW;
+		if (this->min_rtt == 0 || (uint32_t)rtt <= this->min_rtt || (expired && this->state != mode::probe_rtt))
+		{
+			if (expired && (uint32_t)rtt > this->min_rtt && this->min_rtt != 0 && this->state != mode::startup)
+			{
+				// no new minimum for a whole window, drain the queue to measure it
+				this->state = mode::probe_rtt;
+				this->pacing_gain = 100;
+				this->cwnd_gain = 100;
+				this->prior_cwnd = this->cwnd;
+				this->probe_rtt_done = ev.current + BBR_PROBE_RTT_TIME;
+			}
+			this->min_rtt = (uint32_t)rtt;
+			this->min_rtt_stamp = ev.current;
+		}
+	}
+
+	void bbr_controller::on_ack(const congestion_event &ev)
+	{
+		// kcp limits sending by snd_una + cwnd, segments already acknowledged
+		// behind a lost one must not count against the window
+		this->holes = ev.inflight > ev.unacked ? ev.inflight - ev.unacked : 0;
+
+		if (this->round_start)
+		{
+			this->round_start = false;
+
+			if (!this->filled_pipe)
+			{
+				uint64_t bw = get_bottleneck_bandwidth();
+				if (bw >= this->full_bw * 5 / 4)
+				{
+					this->full_bw = bw;
+					this->full_bw_count = 0;
+				}
+				else if (++this->full_bw_count >= 3)
+				{
+					this->filled_pipe = true;
+				}
+			}
+		}
+
+		switch (this->state)
+		{
+		case mode::startup:
+			if (this->filled_pipe)
+			{
+				this->state = mode::drain;
+				this->pacing_gain = BBR_DRAIN_GAIN;
+				this->cwnd_gain = BBR_HIGH_GAIN;
+			}
+			break;
+
+		case mode::drain:
+			if ((uint64_t)ev.inflight * ev.mss <= bdp_bytes(100))
+				enter_probe_bw(ev.current);
+			break;
+
+		case mode::probe_bw:
+			if ((int32_t)(ev.current - this->cycle_stamp) > (int32_t)std::max(this->min_rtt, 1u))
+			{
+				this->cycle_index = (this->cycle_index + 1) % (int)std::size(BBR_GAIN_CYCLE);
+				this->cycle_stamp = ev.current;
+				this->pacing_gain = BBR_GAIN_CYCLE[this->cycle_index];
+			}
+			break;
+
+		case mode::probe_rtt:
+			if ((int32_t)(ev.current - this->probe_rtt_done) >= 0)
+			{
+				this->min_rtt_stamp = ev.current;
+				this->cwnd = std::max(this->cwnd, this->prior_cwnd);
+				if (this->filled_pipe)
+					enter_probe_bw(ev.current);
+				else
+				{
+					this->state = mode::startup;
+					this->pacing_gain = BBR_HIGH_GAIN;
+					this->cwnd_gain = BBR_HIGH_GAIN;
+				}
+			}
+			break;
+		}
+
+		update_cwnd(ev);
+	}
+
+	void bbr_controller::on_loss(const congestion_event &ev)
+	{
+		// a timeout only caps cwnd to what is still in flight, the bandwidth
+		// model survives so random loss does not collapse the sending rate
+		this->cwnd = std::max(std::min(this->cwnd, ev.inflight + 1), BBR_MIN_CWND);
+	}
+
+	uint64_t bbr_controller::pacing_rate() const
+	{
+		return get_bottleneck_bandwidth() * this->pacing_gain / 100;
+	}
+
+	uint64_t bbr_controller::get_bottleneck_bandwidth() const
+	{
+		return *std::max_element(std::begin(this->bw_samples), std::end(this->bw_samples));
+	}
+
+	void bbr_controller::enter_probe_bw(uint32_t current)
+	{
+		this->state = mode::probe_bw;
+		this->cwnd_gain = 200;
+		this->cycle_index = (int)(current % std::size(BBR_GAIN_CYCLE));
+		if (this->cycle_index == 1)
+			this->cycle_index = 2;
+		this->cycle_stamp = current;
+		this->pacing_gain = BBR_GAIN_CYCLE[this->cycle_index];
+	}
+
+	uint64_t bbr_controller::bdp_bytes(uint32_t gain_percent) const
+	{
+		return get_bottleneck_bandwidth() * this->min_rtt / 1000 * gain_percent / 100;
+	}
+
+	void bbr_controller::update_cwnd(const congestion_event &ev)
+	{
+		if (this->state == mode::probe_rtt)
+		{
+			this->cwnd = BBR_MIN_CWND;
+			return;
+		}
+
+		uint64_t bdp = bdp_bytes(this->cwnd_gain);
+		if (bdp == 0 || ev.mss == 0)
+		{
+			// no model yet, grow like slow start
+			this->cwnd = std::min(this->cwnd * 2, std::max(ev.rmt_wnd, BBR_MIN_CWND));
+			return;
+		}
+
+		uint64_t target = bdp / ev.mss + 3;
+		if (!this->filled_pipe && target < this->cwnd)
+			target = this->cwnd;
+		this->cwnd = (uint32_t)std::max<uint64_t>(std::min<uint64_t>(target, std::max(ev.rmt_wnd, BBR_MIN_CWND)), BBR_MIN_CWND);
+	}
+}
@@ -0,0 +1,142 @@
+//=====================================================================
+//
+// KCP - A Better ARQ Protocol Implementation
+// skywind3000 (at) gmail.com, 2010-2011
+// Modifier: cnbatch, 2023
+//
+// Congestion control interface, extracted from ikcp_input / ikcp_flush
+//
+//=====================================================================
+#ifndef __IKCP_CONGESTION_HPP__
+#define __IKCP_CONGESTION_HPP__
+
+#include <stdint.h>
+#include <memory>
+
+
+namespace KCP
+{
+	struct segment;
+
+	//---------------------------------------------------------------------
+	// snapshot of kcp_core handed to every hook
+	//---------------------------------------------------------------------
+	struct congestion_event
+	{
+		uint32_t current;	// timestamp in millisec
+		uint32_t mss;
+		uint32_t rmt_wnd;	// remote receive window
+		uint32_t wnd;		// window used by this flush: min(snd_wnd, rmt_wnd, cwnd)
+		uint32_t inflight;	// snd_nxt - snd_una
+		uint32_t unacked;	// segments still in snd_buf, inflight minus the acknowledged holes
+		uint32_t resent;	// fast resend trigger count, 0 when fast resend is off
+		int32_t srtt;
+	};
+
+	//---------------------------------------------------------------------
+	// congestion controller, installed by kcp_core::set_congestion_controller
+	//---------------------------------------------------------------------
+	class congestion_controller
+	{
+	public:
+		virtual ~congestion_controller() = default;
+
+		// snd_una advanced after an ikcp_input call
+		virtual void on_ack(const congestion_event &ev) = 0;
+
+		// at least one segment timed out (RTO) in ikcp_flush
+		virtual void on_loss(const congestion_event &ev) = 0;
+
+		// at least one segment was resent by fast retransmit or rack in ikcp_flush
+		virtual void on_fast_retransmit(const congestion_event &ev) = 0;
+
+		// a data segment is about to be written to the output buffer
+		virtual void on_send(const congestion_event &/*ev*/, segment &/*seg*/) {}
+
+		// a segment left snd_buf, acknowledged by ack or una
+		virtual void on_segment_acked(const congestion_event &/*ev*/, const segment &/*seg*/) {}
+
+		// a new rtt sample, taken before rx_srtt is updated
+		virtual void on_rtt_sample(const congestion_event &/*ev*/, int32_t /*rtt*/) {}
+
+		// congestion window in segments
+		virtual uint32_t get_cwnd() const = 0;
+
+		// bytes per second, 0 lets kcp_core derive the rate from cwnd / srtt
+		virtual uint64_t pacing_rate() const { return 0; }
+	};
+
+	//---------------------------------------------------------------------
+	// default controller: the original slow start / congestion avoidance
+	//---------------------------------------------------------------------
+	class reno_controller : public congestion_controller
+	{
+	public:
+		void on_ack(const congestion_event &ev) override;
+		void on_loss(const congestion_event &ev) override;
+		void on_fast_retransmit(const congestion_event &ev) override;
+		uint32_t get_cwnd() const override { return cwnd; }
+
+	protected:
+		uint32_t cwnd = 1;
+		uint32_t ssthresh = 2;
+		uint32_t incr = 0;
+	};
+
+	//---------------------------------------------------------------------
+	// model-based controller in the style of BBR: delivery rate sampling,
+	// min rtt tracking and pacing gain cycling, random loss is not
+	// treated as a congestion signal. Use it with pacing enabled.
+	//---------------------------------------------------------------------
+	class bbr_controller : public congestion_controller
+	{
+	public:
+		void on_ack(const congestion_event &ev) override;
+		void on_loss(const congestion_event &ev) override;
+		void on_fast_retransmit(const congestion_event &/*ev*/) override {}
+		void on_send(const congestion_event &ev, segment &seg) override;
+		void on_segment_acked(const congestion_event &ev, const segment &seg) override;
+		void on_rtt_sample(const congestion_event &ev, int32_t rtt) override;
+		uint32_t get_cwnd() const override { return cwnd + holes; }
+		uint64_t pacing_rate() const override;
+
+		enum class mode { startup, drain, probe_bw, probe_rtt };
+		mode get_mode() const { return state; }
+		uint64_t get_bottleneck_bandwidth() const;	// bytes per second
+		uint32_t get_min_rtt() const { return min_rtt; }
+
+	protected:
+		void enter_probe_bw(uint32_t current);
+		void update_cwnd(const congestion_event &ev);
+		uint64_t bdp_bytes(uint32_t gain_percent) const;
+
+		static constexpr int bw_filter_rounds = 10;
+
+		mode state = mode::startup;
+		uint32_t cwnd = 4;
+		uint32_t pacing_gain = 289;		// percent
+		uint32_t cwnd_gain = 289;		// percent
+		int cycle_index = 0;
+		uint32_t cycle_stamp = 0;
+
+		uint64_t delivered = 0;			// bytes acknowledged so far
+		uint32_t delivered_ts = 0;
+		uint64_t next_round_delivered = 0;
+		uint64_t round_count = 0;
+		bool round_start = false;
+
+		uint64_t bw_samples[bw_filter_rounds] = {};	// max delivery rate per round, bytes per second
+		uint64_t full_bw = 0;
+		int full_bw_count = 0;
+		bool filled_pipe = false;
+
+		uint32_t min_rtt = 0;
+		uint32_t min_rtt_stamp = 0;
+		uint32_t probe_rtt_done = 0;
+		uint32_t prior_cwnd = 0;
+		uint32_t holes = 0;				// acknowledged segments above snd_una
+	};
+}
+
+
+#endif
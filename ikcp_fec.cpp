@@ -0,0 +1,559 @@
+//=====================================================================
+//
+// KCP - A Better ARQ Protocol Implementation
+// skywind3000 (at) gmail.com, 2010-2011
+// Modifier: cnbatch, 2023
+//
+//=====================================================================
+#include "ikcp_fec.hpp"
+
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define IKCP_FEC_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#else
+#define IKCP_FEC_X86 0
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define IKCP_FEC_TARGET(x) __attribute__((target(x)))
+#else
+#define IKCP_FEC_TARGET(x)
+#endif
+
+
+// type bytes sit where a datagram has its first cmd. Every cmd (81-85, with
+// or without the 0x80 / 0x20 / 0x08 flags) has bits 0x40 and 0x10 set, these have neither
+constexpr uint8_t IKCP_FEC_DATA = 0xa6;
+constexpr uint8_t IKCP_FEC_PARITY = 0xa7;
+constexpr uint32_t IKCP_FEC_WINDOW = 64;		// receive groups kept for recovery
+constexpr uint32_t IKCP_GF_POLY = 0x11d;		// x^8 + x^4 + x^3 + x^2 + 1
+
+
+//---------------------------------------------------------------------
+// GF(2^8) tables
+//---------------------------------------------------------------------
+struct gf_tables
+{
+	uint8_t exp[512];
+	uint8_t log[256];
+	uint8_t mul[256][256];
+	alignas(16) uint8_t low[256][16];	// c * x for x < 16
+	alignas(16) uint8_t high[256][16];	// c * (x << 4) for x < 16
+
+	gf_tables()
+	{
+		uint32_t x = 1;
+		for (int i = 0; i < 255; i++)
+		{
+			exp[i] = (uint8_t)x;
+			log[x] = (uint8_t)i;
+			x <<= 1;
+			if (x & 0x100) x ^= IKCP_GF_POLY;
+		}
+		for (int i = 255; i < 512; i++)
+			exp[i] = exp[i - 255];
+		log[0] = 0;
+
+		for (int a = 0; a < 256; a++)
+			for (int b = 0; b < 256; b++)
+				mul[a][b] = (a == 0 || b == 0) ? 0 : exp[log[a] + log[b]];
+
+		for (int c = 0; c < 256; c++)
+		{
+			for (int i = 0; i < 16; i++)
+			{
+				low[c][i] = mul[c][i];
+				high[c][i] = mul[c][i << 4];
+			}
+		}
+	}
+
+	uint8_t inverse(uint8_t a) const { return exp[255 - log[a]]; }
+};
+
+static const gf_tables& tables()
+{
+	static const gf_tables instance;
+	return instance;
+}
+
+
+//---------------------------------------------------------------------
+// region kernels: dst ^= c * src
+//---------------------------------------------------------------------
+using mul_add_function = void (*)(uint8_t *dst, const uint8_t *src, uint8_t c, size_t size);
+
+static void mul_add_scalar(uint8_t *dst, const uint8_t *src, uint8_t c, size_t size)
+{
+	const uint8_t *row = tables().mul[c];
+	for (size_t i = 0; i < size; i++)
+		dst[i] ^= row[src[i]];
+}
+
+#if IKCP_FEC_X86
+// split each byte into nibbles and look both up with pshufb
+IKCP_FEC_TARGET("ssse3")
+static void mul_add_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c, size_t size)
+{
+	const gf_tables &t = tables();
+	__m128i low = _mm_load_si128((const __m128i*)t.low[c]);
+	__m128i high = _mm_load_si128((const __m128i*)t.high[c]);
+	__m128i mask = _mm_set1_epi8(0x0f);
+
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16)
+	{
+		__m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+		__m128i l = _mm_shuffle_epi8(low, _mm_and_si128(s, mask));
+		__m128i h = _mm_shuffle_epi8(high, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+		__m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(d, _mm_xor_si128(l, h)));
+	}
+	for (; i < size; i++)
+		dst[i] ^= t.mul[c][src[i]];
+}
+
+IKCP_FEC_TARGET("avx2")
+static void mul_add_avx2(uint8_t *dst, const uint8_t *src, uint8_t c, size_t size)
+{
+	const gf_tables &t = tables();
+	__m256i low = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)t.low[c]));
+	__m256i high = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)t.high[c]));
+	__m256i mask = _mm256_set1_epi8(0x0f);
+
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32)
+	{
+		__m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+		__m256i l = _mm256_shuffle_epi8(low, _mm256_and_si256(s, mask));
+		__m256i h = _mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask));
+		__m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_xor_si256(d, _mm256_xor_si256(l, h)));
+	}
+	for (; i < size; i++)
+		dst[i] ^= t.mul[c][src[i]];
+}
+
+static bool cpu_supports(KCP::gf_kernel kernel)
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	int max_leaf = info[0];
+	__cpuid(info, 1);
+	bool ssse3 = (info[2] & (1 << 9)) != 0;
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	if (kernel == KCP::gf_kernel::ssse3)
+		return ssse3;
+	if (max_leaf < 7 || !osxsave || (_xgetbv(0) & 6) != 6)
+		return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	if (kernel == KCP::gf_kernel::ssse3)
+		return __builtin_cpu_supports("ssse3");
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#else
+static bool cpu_supports(KCP::gf_kernel kernel)
+{
+	return false;
+}
+#endif
+
+static mul_add_function kernel_function(KCP::gf_kernel kernel)
+{
+#if IKCP_FEC_X86
+	if (kernel == KCP::gf_kernel::avx2) return mul_add_avx2;
+	if (kernel == KCP::gf_kernel::ssse3) return mul_add_ssse3;
+#endif
+	return mul_add_scalar;
+}
+
+static std::atomic<KCP::gf_kernel> active_kernel{ KCP::reed_solomon::best_kernel() };
+static std::atomic<mul_add_function> mul_add{ kernel_function(active_kernel.load()) };
+
+
+namespace KCP
+{
+	//---------------------------------------------------------------------
+	// reed_solomon
+	//---------------------------------------------------------------------
+	gf_kernel reed_solomon::best_kernel()
+	{
+		if (cpu_supports(gf_kernel::avx2)) return gf_kernel::avx2;
+		if (cpu_supports(gf_kernel::ssse3)) return gf_kernel::ssse3;
+		return gf_kernel::scalar;
+	}
+
+	gf_kernel reed_solomon::get_kernel()
+	{
+		return active_kernel.load(std::memory_order_relaxed);
+	}
+
+	bool reed_solomon::set_kernel(gf_kernel kernel)
+	{
+		if (kernel != gf_kernel::scalar && !cpu_supports(kernel))
+			return false;
+		active_kernel.store(kernel, std::memory_order_relaxed);
+		mul_add.store(kernel_function(kernel), std::memory_order_relaxed);
+		return true;
+	}
+
+	uint8_t reed_solomon::coefficient(int parity_row, int data_column)
+	{
+		return tables().inverse((uint8_t)((IKCP_FEC_MAX_SHARDS + parity_row) ^ data_column));
+	}
+
+	void reed_solomon::encode(const uint8_t * const *data, int data_shards,
+		uint8_t * const *parity, int parity_shards, size_t size)
+	{
+		mul_add_function kernel = mul_add.load(std::memory_order_relaxed);
+		for (int i = 0; i < parity_shards; i++)
+		{
+			memset(parity[i], 0, size);
+			for (int j = 0; j < data_shards; j++)
+				kernel(parity[i], data[j], coefficient(i, j), size);
+		}
+	}
+
+	bool reed_solomon::reconstruct(uint8_t * const *data, const bool *data_present, int data_shards,
+		const uint8_t * const *parity, const bool *parity_present, int parity_shards, size_t size)
+	{
+		std::vector<int> missing, rows;
+		for (int j = 0; j < data_shards; j++)
+			if (!data_present[j])
+				missing.push_back(j);
+		if (missing.empty())
+			return true;
+
+		for (int i = 0; i < parity_shards && rows.size() < missing.size(); i++)
+			if (parity_present[i])
+				rows.push_back(i);
+		if (rows.size() < missing.size())
+			return false;
+
+		// invert the square Cauchy sub-matrix of the lost columns, any such
+		// sub-matrix is non-singular
+		const gf_tables &t = tables();
+		size_t count = missing.size();
+		std::vector<uint8_t> matrix(count * count), inverse(count * count, 0);
+		for (size_t r = 0; r < count; r++)
+		{
+			for (size_t c = 0; c < count; c++)
+				matrix[r * count + c] = coefficient(rows[r], missing[c]);
+			inverse[r * count + r] = 1;
+		}
+
+		for (size_t c = 0; c < count; c++)
+		{
+			size_t pivot = c;
+			while (pivot < count && matrix[pivot * count + c] == 0)
+				pivot++;
+			if (pivot == count)
+				return false;
+			if (pivot != c)
+			{
+				std::swap_ranges(matrix.begin() + pivot * count, matrix.begin() + (pivot + 1) * count, matrix.begin() + c * count);
+				std::swap_ranges(inverse.begin() + pivot * count, inverse.begin() + (pivot + 1) * count, inverse.begin() + c * count);
+			}
+
+			uint8_t scale = t.inverse(matrix[c * count + c]);
+			for (size_t k = 0; k < count; k++)
+			{
+				matrix[c * count + k] = t.mul[scale][matrix[c * count + k]];
+				inverse[c * count + k] = t.mul[scale][inverse[c * count + k]];
+			}
+
+			for (size_t r = 0; r < count; r++)
+			{
+				uint8_t factor = matrix[r * count + c];
+				if (r == c || factor == 0)
+					continue;
+				for (size_t k = 0; k < count; k++)
+				{
+					matrix[r * count + k] ^= t.mul[factor][matrix[c * count + k]];
+					inverse[r * count + k] ^= t.mul[factor][inverse[c * count + k]];
+				}
+			}
+		}
+
+		// remove the known data from the chosen parity shards
+		mul_add_function kernel = mul_add.load(std::memory_order_relaxed);
+		std::vector<std::vector<uint8_t>> syndromes(count);
+		for (size_t r = 0; r < count; r++)
+		{
+			syndromes[r].assign(parity[rows[r]], parity[rows[r]] + size);
+			for (int j = 0; j < data_shards; j++)
+				if (data_present[j])
+					kernel(syndromes[r].data(), data[j], coefficient(rows[r], j), size);
+		}
+
+		for (size_t c = 0; c < count; c++)
+		{
+			uint8_t *target = data[missing[c]];
+			memset(target, 0, size);
+			for (size_t r = 0; r < count; r++)
+				kernel(target, syndromes[r].data(), inverse[c * count + r], size);
+		}
+
+		return true;
+	}
+
+
+	//---------------------------------------------------------------------
+	// fec_codec
+	//---------------------------------------------------------------------
+	fec_codec::fec_codec(int data_shards, int parity_shards) :
+		data_shards(data_shards), parity_shards(parity_shards),
+		send_shards(data_shards), parity_buffer(parity_shards)
+	{
+	}
+
+	bool fec_codec::is_fec_packet(const char *data, long size)
+	{
+		if (data == nullptr || size < IKCP_FEC_HEADER)
+			return false;
+		uint8_t type = (uint8_t)data[4];
+		return type == IKCP_FEC_DATA || type == IKCP_FEC_PARITY;
+	}
+
+	char* fec_codec::encode_header(char *ptr, uint8_t type, int index, int count, uint32_t group_id)
+	{
+		memcpy(ptr, &this->conv, 4);
+		ptr[4] = (char)type;
+		ptr[5] = (char)index;
+		ptr[6] = (char)count;
+		ptr[7] = (char)this->parity_shards;
+		for (int i = 0; i < 4; i++)
+			ptr[8 + i] = (char)(group_id >> (i * 8));
+		return ptr + IKCP_FEC_HEADER;
+	}
+
+	int fec_codec::encode(const char *data, int size, const std::function<int(const char *, int)> &output)
+	{
+		// too large to be described by the length field, send as is
+		if (size < 4 || size > 0xffff)
+			return output(data, size);
+
+		memcpy(&this->conv, data, 4);
+		this->packet.resize(IKCP_FEC_OVERHEAD + size);
+		char *ptr = encode_header(this->packet.data(), IKCP_FEC_DATA, this->pending, this->data_shards, this->send_group);
+		ptr[0] = (char)(size & 0xff);
+		ptr[1] = (char)(size >> 8);
+		memcpy(ptr + 2, data, size);
+
+		std::vector<uint8_t> &shard = this->send_shards[this->pending];
+		shard.assign((const uint8_t*)ptr, (const uint8_t*)ptr + 2 + size);
+		this->pending_size = std::max(this->pending_size, shard.size());
+
+		int hr = output(this->packet.data(), (int)this->packet.size());
+		if (++this->pending == this->data_shards)
+			emit_parity(output);
+		return hr;
+	}
+
+	void fec_codec::flush(const std::function<int(const char *, int)> &output)
+	{
+		if (this->pending > 0)
+			emit_parity(output);
+	}
+
+	void fec_codec::emit_parity(const std::function<int(const char *, int)> &output)
+	{
+		std::vector<const uint8_t*> data(this->pending);
+		std::vector<uint8_t*> parity(this->parity_shards);
+		for (int j = 0; j < this->pending; j++)
+		{
+			this->send_shards[j].resize(this->pending_size, 0);
+			data[j] = this->send_shards[j].data();
+		}
+		for (int i = 0; i < this->parity_shards; i++)
+		{
+			this->parity_buffer[i].resize(this->pending_size);
+			parity[i] = this->parity_buffer[i].data();
+		}
+
+		reed_solomon::encode(data.data(), this->pending, parity.data(), this->parity_shards, this->pending_size);
+
+		for (int i = 0; i < this->parity_shards; i++)
+		{
+			this->packet.resize(IKCP_FEC_HEADER + this->pending_size);
+			char *ptr = encode_header(this->packet.data(), IKCP_FEC_PARITY, i, this->pending, this->send_group);
+			memcpy(ptr, parity[i], this->pending_size);
+			output(this->packet.data(), (int)this->packet.size());
+		}
+
+		this->send_group++;
+		this->pending = 0;
+		this->pending_size = 0;
+	}
+
+	int fec_codec::decode(const char *data, long size, const std::function<int(const char *, long)> &deliver)
+	{
+		if (!is_fec_packet(data, size))
+			return -1;
+
+		const uint8_t *header = (const uint8_t*)data;
+		uint8_t type = header[4];
+		int index = header[5];
+		int count = header[6];
+		int parity = header[7];
+		uint32_t group_id = header[8] | (header[9] << 8) | (header[10] << 16) | ((uint32_t)header[11] << 24);
+		const uint8_t *shard = header + IKCP_FEC_HEADER;
+		size_t shard_size = (size_t)(size - IKCP_FEC_HEADER);
+
+		if (count == 0 || count > IKCP_FEC_MAX_SHARDS || parity == 0 || parity > IKCP_FEC_MAX_SHARDS)
+			return -2;
+
+		// track the newest group, older ones beyond the window are dropped
+		if (!this->any_group || (int32_t)(group_id - this->newest_group) > 0)
+		{
+			this->any_group = true;
+			this->newest_group = group_id;
+			for (auto iter = this->recv_groups.begin(); iter != this->recv_groups.end(); )
+			{
+				if ((int32_t)(this->newest_group - iter->first) >= (int32_t)IKCP_FEC_WINDOW)
+					iter = this->recv_groups.erase(iter);
+				else
+					++iter;
+			}
+		}
+		bool tracked = (int32_t)(this->newest_group - group_id) < (int32_t)IKCP_FEC_WINDOW;
+
+		if (type == IKCP_FEC_DATA)
+		{
+			if (index >= count || shard_size < 2)
+				return -2;
+			size_t len = shard[0] | (shard[1] << 8);
+			if (len + 2 > shard_size)
+				return -2;
+
+			group *grp = tracked ? &this->recv_groups[group_id] : nullptr;
+			if (grp != nullptr)
+			{
+				// already recovered, or a duplicate
+				if (grp->done || ((size_t)index < grp->data.size() && !grp->data[index].empty()))
+					return 0;
+			}
+
+			int hr = deliver((const char*)shard + 2, (long)len);
+
+			if (grp != nullptr)
+			{
+				if (grp->data.size() <= (size_t)index)
+					grp->data.resize(index + 1);
+				grp->data[index].assign(shard, shard + len + 2);
+				try_recover(*grp, deliver);
+			}
+			return hr;
+		}
+
+		if (index >= parity)
+			return -2;
+		if (!tracked)
+			return 0;
+
+		group &grp = this->recv_groups[group_id];
+		if (grp.done)
+			return 0;
+		if (grp.data_shards == 0)
+		{
+			grp.data_shards = count;
+			grp.shard_size = shard_size;
+		}
+		if (grp.data_shards != count || grp.shard_size != shard_size)
+			return -2;
+		if (grp.parity.size() <= (size_t)index)
+			grp.parity.resize(index + 1);
+		grp.parity[index].assign(shard, shard + shard_size);
+		try_recover(grp, deliver);
+		return 0;
+	}
+
+	void fec_codec::try_recover(group &grp, const std::function<int(const char *, long)> &deliver)
+	{
+		if (grp.done || grp.data_shards == 0)
+			return;
+
+		int data_count = grp.data_shards;
+		int present = 0, parity_present = 0;
+		for (size_t j = 0; j < grp.data.size(); j++)
+			if (!grp.data[j].empty())
+				present++;
+		for (auto &shard : grp.parity)
+			if (!shard.empty())
+				parity_present++;
+
+		if (grp.data.size() > (size_t)data_count)
+		{
+			// shard index outside the group, give up on it
+			grp.done = true;
+			return;
+		}
+
+		if (present == data_count || present + parity_present < data_count)
+		{
+			if (present == data_count)
+			{
+				grp.done = true;
+				grp.data.clear();
+				grp.parity.clear();
+			}
+			return;
+		}
+
+		grp.data.resize(data_count);
+		std::vector<uint8_t*> data(data_count);
+		std::unique_ptr<bool[]> data_present = std::make_unique<bool[]>(data_count);
+		for (int j = 0; j < data_count; j++)
+		{
+			data_present[j] = !grp.data[j].empty();
+			if (grp.data[j].size() > grp.shard_size)
+			{
+				grp.done = true;
+				return;
+			}
+			grp.data[j].resize(grp.shard_size, 0);
+			data[j] = grp.data[j].data();
+		}
+
+		int parity_count = (int)grp.parity.size();
+		std::vector<const uint8_t*> parity(parity_count);
+		std::unique_ptr<bool[]> parity_ok = std::make_unique<bool[]>(parity_count);
+		for (int i = 0; i < parity_count; i++)
+		{
+			parity_ok[i] = !grp.parity[i].empty();
+			parity[i] = grp.parity[i].data();
+		}
+
+		grp.done = true;
+		if (reed_solomon::reconstruct(data.data(), data_present.get(), data_count,
+			parity.data(), parity_ok.get(), parity_count, grp.shard_size))
+		{
+			for (int j = 0; j < data_count; j++)
+			{
+				if (data_present[j])
+					continue;
+				size_t len = data[j][0] | (data[j][1] << 8);
+				if (len + 2 > grp.shard_size)
+					continue;
+				this->recovered++;
+				deliver((const char*)data[j] + 2, (long)len);
+			}
+		}
+		grp.data.clear();
+		grp.parity.clear();
+	}
+}
@@ -0,0 +1,120 @@
+//=====================================================================
+//
+// KCP - A Better ARQ Protocol Implementation
+// skywind3000 (at) gmail.com, 2010-2011
+// Modifier: cnbatch, 2023
+//
+// Forward error correction between ikcp_flush output and the transport,
+// Reed-Solomon over GF(2^8)
+//
+//=====================================================================
+#ifndef __IKCP_FEC_HPP__
+#define __IKCP_FEC_HPP__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+#include <map>
+#include <vector>
+
+
+//---------------------------------------------------------------------
+// fec packet: conv(4) type(1) index(1) data shards(1) parity shards(1)
+// group(4), then len(2) + datagram for a data shard or the parity shard.
+// Parity shards carry the real number of data shards of their group
+//---------------------------------------------------------------------
+#define IKCP_FEC_HEADER			12
+#define IKCP_FEC_OVERHEAD		14	// header + datagram length
+#define IKCP_FEC_MAX_SHARDS		128	// limit for both data and parity shards
+
+
+namespace KCP
+{
+	enum class gf_kernel { scalar, ssse3, avx2 };
+
+	//---------------------------------------------------------------------
+	// systematic Reed-Solomon code with a Cauchy parity matrix, the
+	// coefficient of parity row i and data column j is 1 / (x_i + y_j)
+	// with x_i = 128 + i and y_j = j, so groups with fewer data shards
+	// use the same coefficients
+	//---------------------------------------------------------------------
+	class reed_solomon
+	{
+	public:
+		// region multiply kernels, chosen once at startup from cpuid
+		static gf_kernel best_kernel();
+		static gf_kernel get_kernel();
+		static bool set_kernel(gf_kernel kernel);	// false if the cpu lacks it
+
+		// parity[i] = sum of coefficient(i, j) * data[j], all shards are 'size' bytes
+		static void encode(const uint8_t * const *data, int data_shards,
+			uint8_t * const *parity, int parity_shards, size_t size);
+
+		// rebuild data[j] for every missing j in place, needs at least as
+		// many present parity shards as missing data shards
+		static bool reconstruct(uint8_t * const *data, const bool *data_present, int data_shards,
+			const uint8_t * const *parity, const bool *parity_present, int parity_shards, size_t size);
+
+		static uint8_t coefficient(int parity_row, int data_column);
+	};
+
+	//---------------------------------------------------------------------
+	// groups outgoing datagrams N at a time and appends M parity packets,
+	// recovers lost datagrams on the receiving side. Datagrams are passed
+	// on at once, a group is closed by flush() when it is not full yet
+	//---------------------------------------------------------------------
+	class fec_codec
+	{
+	public:
+		fec_codec(int data_shards, int parity_shards);
+
+		static bool is_fec_packet(const char *data, long size);
+
+		int encode(const char *data, int size, const std::function<int(const char *, int)> &output);
+
+		// close the current group early, sends its parity shards
+		void flush(const std::function<int(const char *, int)> &output);
+
+		// deliver receives the datagram of a data shard and every recovered one
+		int decode(const char *data, long size, const std::function<int(const char *, long)> &deliver);
+
+		int get_data_shards() const { return data_shards; }
+		int get_parity_shards() const { return parity_shards; }
+		uint64_t get_recovered() const { return recovered; }
+
+	protected:
+		struct group
+		{
+			int data_shards = 0;	// 0 until a parity shard tells
+			size_t shard_size = 0;
+			bool done = false;
+			std::vector<std::vector<uint8_t>> data;		// len(2) + datagram, empty: missing
+			std::vector<std::vector<uint8_t>> parity;
+		};
+
+		void emit_parity(const std::function<int(const char *, int)> &output);
+		void try_recover(group &grp, const std::function<int(const char *, long)> &deliver);
+		char* encode_header(char *ptr, uint8_t type, int index, int count, uint32_t group_id);
+
+		int data_shards;
+		int parity_shards;
+
+		// sender
+		uint32_t conv = 0;
+		uint32_t send_group = 0;
+		int pending = 0;
+		size_t pending_size = 0;
+		std::vector<std::vector<uint8_t>> send_shards;
+		std::vector<std::vector<uint8_t>> parity_buffer;
+		std::vector<char> packet;
+
+		// receiver
+		std::map<uint32_t, group> recv_groups;
+		uint32_t newest_group = 0;
+		bool any_group = false;
+		uint64_t recovered = 0;
+	};
+}
+
+
+#endif
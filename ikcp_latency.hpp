@@ -0,0 +1,185 @@
+//=====================================================================
+//
+// KCP - A Better ARQ Protocol Implementation
+// skywind3000 (at) gmail.com, 2010-2011
+// Modifier: cnbatch, 2023
+//
+// Per-message latency histograms, recorded by kcp_core once
+// set_latency_tracking() is on and mergeable across sessions
+//
+//=====================================================================
+#ifndef __IKCP_LATENCY_HPP__
+#define __IKCP_LATENCY_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+
+namespace KCP
+{
+	//---------------------------------------------------------------------
+	// log-linear histogram of millisec values: exact below 16, then 16
+	// sub-buckets per power of two (at most 1/16 relative error) up to
+	// 2^24 ms, larger values land in the last bucket
+	//---------------------------------------------------------------------
+	struct latency_histogram
+	{
+		static constexpr uint32_t sub_bits = 4;
+		static constexpr uint32_t sub_count = 1 << sub_bits;
+		static constexpr uint32_t max_bits = 24;
+		static constexpr uint32_t max_value = (1u << max_bits) - 1;
+		static constexpr size_t bucket_count = (max_bits - sub_bits + 1) * sub_count;
+
+		uint64_t counts[bucket_count] = {};
+		uint64_t total = 0;
+		uint64_t sum = 0;
+		uint32_t min = 0;
+		uint32_t max = 0;
+
+		static size_t bucket_of(uint32_t value)
+		{
+			if (value > max_value) value = max_value;
+			if (value < sub_count) return value;
+			uint32_t exponent = sub_bits;
+			while ((value >> (exponent + 1)) != 0) exponent++;
+			return (exponent - sub_bits + 1) * sub_count + (value >> (exponent - sub_bits)) - sub_count;
+		}
+
+		// smallest and largest value counted in 'bucket'
+		static uint32_t lowest(size_t bucket)
+		{
+			if (bucket < sub_count) return (uint32_t)bucket;
+			uint32_t shift = (uint32_t)(bucket / sub_count) - 1;
+			return (uint32_t)(bucket % sub_count + sub_count) << shift;
+		}
+
+		static uint32_t highest(size_t bucket)
+		{
+			return bucket + 1 < bucket_count ? lowest(bucket + 1) - 1 : max_value;
+		}
+
+		void record(uint32_t value)
+		{
+			counts[bucket_of(value)]++;
+			if (total == 0 || value < min) min = value;
+			if (value > max) max = value;
+			total++;
+			sum += value;
+		}
+
+		void merge(const latency_histogram &other)
+		{
+			if (other.total == 0) return;
+			for (size_t i = 0; i < bucket_count; i++)
+				counts[i] += other.counts[i];
+			if (total == 0 || other.min < min) min = other.min;
+			if (other.max > max) max = other.max;
+			total += other.total;
+			sum += other.sum;
+		}
+
+		// value below which 'percent' of the samples fall, reported as the
+		// upper end of its bucket and never above the recorded maximum
+		uint32_t percentile(double percent) const
+		{
+			if (total == 0) return 0;
+			uint64_t rank = (uint64_t)(percent / 100.0 * total + 0.5);
+			if (rank < 1) rank = 1;
+			if (rank > total) rank = total;
+			uint64_t seen = 0;
+			for (size_t i = 0; i < bucket_count; i++)
+			{
+				seen += counts[i];
+				if (seen >= rank)
+					return highest(i) < max ? highest(i) : max;
+			}
+			return max;
+		}
+
+		uint32_t mean() const { return total > 0 ? (uint32_t)(sum / total) : 0; }
+	};
+
+	//---------------------------------------------------------------------
+	// what a session measures per message, times come from
+	// kcp_core::current, so their resolution is the update interval
+	//---------------------------------------------------------------------
+	struct message_latency
+	{
+		latency_histogram queue_delay;		// send() until the last fragment moves to snd_buf
+		latency_histogram ack_latency;		// send() until every fragment is acknowledged
+		latency_histogram receive_wait;		// first fragment arrived until receive() returns the message
+
+		void merge(const message_latency &other)
+		{
+			queue_delay.merge(other.queue_delay);
+			ack_latency.merge(other.ack_latency);
+			receive_wait.merge(other.receive_wait);
+		}
+	};
+
+	//---------------------------------------------------------------------
+	// live histogram inside kcp_core, single writer with relaxed load +
+	// store like session_counters, so another thread can take a snapshot
+	//---------------------------------------------------------------------
+	struct latency_recorder
+	{
+		std::atomic<uint64_t> counts[latency_histogram::bucket_count];
+		std::atomic<uint64_t> total, sum;
+		std::atomic<uint32_t> min, max;
+
+		latency_recorder() { reset(); }
+
+		void reset()
+		{
+			for (auto &count : counts)
+				count.store(0, std::memory_order_relaxed);
+			total.store(0, std::memory_order_relaxed);
+			sum.store(0, std::memory_order_relaxed);
+			min.store(0, std::memory_order_relaxed);
+			max.store(0, std::memory_order_relaxed);
+		}
+
+		void record(uint32_t value)
+		{
+			std::atomic<uint64_t> &count = counts[latency_histogram::bucket_of(value)];
+			count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			uint64_t samples = total.load(std::memory_order_relaxed);
+			if (samples == 0 || value < min.load(std::memory_order_relaxed))
+				min.store(value, std::memory_order_relaxed);
+			if (value > max.load(std::memory_order_relaxed))
+				max.store(value, std::memory_order_relaxed);
+			sum.store(sum.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+			total.store(samples + 1, std::memory_order_relaxed);
+		}
+
+		latency_histogram snapshot() const
+		{
+			latency_histogram copy;
+			for (size_t i = 0; i < latency_histogram::bucket_count; i++)
+				copy.counts[i] = counts[i].load(std::memory_order_relaxed);
+			copy.total = total.load(std::memory_order_relaxed);
+			copy.sum = sum.load(std::memory_order_relaxed);
+			copy.min = min.load(std::memory_order_relaxed);
+			copy.max = max.load(std::memory_order_relaxed);
+			return copy;
+		}
+	};
+
+	struct latency_recorders
+	{
+		latency_recorder queue_delay, ack_latency, receive_wait;
+
+		message_latency snapshot() const
+		{
+			message_latency copy;
+			copy.queue_delay = queue_delay.snapshot();
+			copy.ack_latency = ack_latency.snapshot();
+			copy.receive_wait = receive_wait.snapshot();
+			return copy;
+		}
+	};
+}
+
+
+#endif
@@ -0,0 +1,136 @@
+//=====================================================================
+//
+// KCP - A Better ARQ Protocol Implementation
+// skywind3000 (at) gmail.com, 2010-2011
+// Modifier: cnbatch, 2023
+//
+// Per-session counters, written by the owner of kcp_core and read by
+// any thread without locking
+//
+//=====================================================================
+#ifndef __IKCP_STATS_HPP__
+#define __IKCP_STATS_HPP__
+
+#include <stdint.h>
+#include <atomic>
+
+
+namespace KCP
+{
+	//---------------------------------------------------------------------
+	// counters since initialise() and gauges refreshed by every flush,
+	// times in millisec. Data segments count their first transmission in
+	// segments_sent, each retransmission in one of retransmits_*
+	//---------------------------------------------------------------------
+	template<typename T>
+	struct basic_session_stats
+	{
+		T segments_sent, bytes_sent;			// payload bytes
+		T retransmits_rto, retransmits_fast, retransmits_rack, retransmits_tlp;
+		T bytes_retransmitted;
+		T segments_received, bytes_received;	// new segments inside the receive window
+		T duplicates, out_of_window;			// data segments dropped
+		T over_budget;							// sends refused and data segments dropped by the memory limits
+		T messages_dropped;						// large messages over the size limit or out of memory
+		T would_block;							// sends refused at the high byte watermark
+		T acks_sent, acks_received;				// IKCP_CMD_ACK or IKCP_CMD_SACK segments
+		T datagrams_sent, datagrams_received;	// output callback / input calls, fec included
+		T wire_bytes_sent, wire_bytes_received;
+		T cwnd, inflight;						// gauges in segments, cwnd is the send window with nc=1
+		T snd_queue, snd_buf, rcv_queue, rcv_buf;
+		T rtt_min, rtt_max, rtt_sum, rtt_samples;
+		T srtt, rttvar, rto;
+
+		// calls f(field, other.field) for every field
+		template<typename Other, typename Func>
+		void zip(Other &other, Func &&f)
+		{
+			f(segments_sent, other.segments_sent); f(bytes_sent, other.bytes_sent);
+			f(retransmits_rto, other.retransmits_rto); f(retransmits_fast, other.retransmits_fast);
+			f(retransmits_rack, other.retransmits_rack); f(retransmits_tlp, other.retransmits_tlp);
+			f(bytes_retransmitted, other.bytes_retransmitted);
+			f(segments_received, other.segments_received); f(bytes_received, other.bytes_received);
+			f(duplicates, other.duplicates); f(out_of_window, other.out_of_window);
+			f(over_budget, other.over_budget); f(would_block, other.would_block);
+			f(messages_dropped, other.messages_dropped);
+			f(acks_sent, other.acks_sent); f(acks_received, other.acks_received);
+			f(datagrams_sent, other.datagrams_sent); f(datagrams_received, other.datagrams_received);
+			f(wire_bytes_sent, other.wire_bytes_sent); f(wire_bytes_received, other.wire_bytes_received);
+			f(cwnd, other.cwnd); f(inflight, other.inflight);
+			f(snd_queue, other.snd_queue); f(snd_buf, other.snd_buf);
+			f(rcv_queue, other.rcv_queue); f(rcv_buf, other.rcv_buf);
+			f(rtt_min, other.rtt_min); f(rtt_max, other.rtt_max);
+			f(rtt_sum, other.rtt_sum); f(rtt_samples, other.rtt_samples);
+			f(srtt, other.srtt); f(rttvar, other.rttvar); f(rto, other.rto);
+		}
+	};
+
+	//---------------------------------------------------------------------
+	// plain copy handed out by kcp_core::get_stats()
+	//---------------------------------------------------------------------
+	struct session_stats : basic_session_stats<uint64_t>
+	{
+		session_stats() : basic_session_stats<uint64_t>{} {}
+
+		uint64_t retransmits() const { return retransmits_rto + retransmits_fast + retransmits_rack + retransmits_tlp; }
+		uint64_t rtt_avg() const { return rtt_samples > 0 ? rtt_sum / rtt_samples : 0; }
+	};
+
+	//---------------------------------------------------------------------
+	// bytes held by one session, kcp_core::get_memory(). A segment counts
+	// its payload, the segment object and an estimate of its container
+	// nodes, acklist its capacity
+	//---------------------------------------------------------------------
+	struct memory_usage
+	{
+		uint64_t snd_queue = 0, snd_buf = 0;
+		uint64_t rcv_buf = 0, rcv_queue = 0;
+		uint64_t acklist = 0;
+		uint64_t buffers = 0;		// flush buffer, large message being reassembled
+
+		uint64_t total() const { return snd_queue + snd_buf + rcv_buf + rcv_queue + acklist + buffers; }
+	};
+
+	//---------------------------------------------------------------------
+	// live counters inside kcp_core. There is one writer at a time (kcp_core
+	// is not thread safe), so updates are relaxed load + store instead of
+	// locked read-modify-write. A snapshot is consistent per field only
+	//---------------------------------------------------------------------
+	struct session_counters : basic_session_stats<std::atomic<uint64_t>>
+	{
+		session_counters() { reset(); }
+
+		static void add(std::atomic<uint64_t> &counter, uint64_t value)
+		{
+			counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+		}
+
+		static void set(std::atomic<uint64_t> &counter, uint64_t value)
+		{
+			counter.store(value, std::memory_order_relaxed);
+		}
+
+		void reset()
+		{
+			session_stats zero;
+			zip(zero, [](std::atomic<uint64_t> &counter, uint64_t value) { set(counter, value); });
+		}
+
+		void copy_from(session_counters &other)
+		{
+			zip(other, [](std::atomic<uint64_t> &counter, std::atomic<uint64_t> &value)
+				{ set(counter, value.load(std::memory_order_relaxed)); });
+		}
+
+		session_stats snapshot()
+		{
+			session_stats copy;
+			zip(copy, [](std::atomic<uint64_t> &counter, uint64_t &value)
+				{ value = counter.load(std::memory_order_relaxed); });
+			return copy;
+		}
+	};
+}
+
+
+#endif
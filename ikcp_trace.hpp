@@ -0,0 +1,194 @@
+//=====================================================================
+//
+// KCP - A Better ARQ Protocol Implementation
+// skywind3000 (at) gmail.com, 2010-2011
+// Modifier: cnbatch, 2023
+//
+// Binary event tracing: fixed size records in a lock-free ring,
+// decoded offline instead of formatted on the hot path
+//
+//=====================================================================
+#ifndef __IKCP_TRACE_HPP__
+#define __IKCP_TRACE_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+
+namespace KCP
+{
+	//---------------------------------------------------------------------
+	// traced events, the comment lists what sn / ts / len hold
+	//---------------------------------------------------------------------
+	enum class trace_event : uint16_t
+	{
+		send,				// send() queued a message: sn fragments, len bytes
+		push_out,			// first transmission: sn, ts, len payload
+		resend_rto,			// retransmission on timeout
+		resend_fast,		// fast retransmission on duplicate acks
+		resend_rack,		// time based loss detection
+		resend_tlp,			// tail loss probe
+		push_in,			// new data segment: sn, ts, len payload
+		push_duplicate,		// data segment below rcv_nxt or already buffered
+		push_dropped,		// data segment beyond the receive window (out_of_window)
+		ack_in,				// IKCP_CMD_ACK: sn, ts echoed, rtt = time - ts
+		sack_in,			// IKCP_CMD_SACK: sn una, ts echoed, len ranges
+		acks_out,			// acknowledgements of one flush: sn rcv_nxt, len count
+		probe_in,			// IKCP_CMD_WASK
+		wins_in,			// IKCP_CMD_WINS: len remote window
+		probe_out,
+		wins_out,
+		deliver,			// receive() returned a message: sn first fragment, len bytes
+		datagram_out,		// output callback: len bytes
+		datagram_in,		// input(): len bytes
+		dead_link,			// state became -1: sn, xmit
+		push_over_budget,	// data segment left unacknowledged by the memory caps (over_budget)
+		message_dropped,	// large message discarded, too large or no buffer: sn, ts, len of
+							// the fragment that ended it (messages_dropped)
+		count
+	};
+
+	constexpr uint32_t trace_bit(trace_event ev) { return 1u << (uint32_t)ev; }
+	constexpr uint32_t trace_all = (1u << (uint32_t)trace_event::count) - 1;
+	// everything except the per datagram and per message records
+	constexpr uint32_t trace_segments = trace_all & ~(trace_bit(trace_event::datagram_out) |
+		trace_bit(trace_event::datagram_in) | trace_bit(trace_event::send) | trace_bit(trace_event::deliver));
+	// events that record cwnd
+	constexpr uint32_t trace_cwnd_events = trace_bit(trace_event::push_out) |
+		trace_bit(trace_event::resend_rto) | trace_bit(trace_event::resend_fast) |
+		trace_bit(trace_event::resend_rack) | trace_bit(trace_event::resend_tlp) |
+		trace_bit(trace_event::ack_in) | trace_bit(trace_event::sack_in) |
+		trace_bit(trace_event::wins_in) | trace_bit(trace_event::dead_link);
+
+	//---------------------------------------------------------------------
+	// one event, 32 bytes. rto and cwnd are the session state after the
+	// event, cwnd is the window the next flush may use. cwnd is only filled
+	// in for the events of the sending side (trace_cwnd_events), 0 otherwise
+	//---------------------------------------------------------------------
+	struct trace_record
+	{
+		uint32_t time;		// kcp_core::current, millisec
+		uint32_t conv;
+		uint16_t event;		// trace_event
+		uint16_t xmit;		// transmissions of a data segment, 0 otherwise
+		uint32_t sn;
+		uint32_t ts;
+		uint32_t len;
+		uint32_t rto;
+		uint32_t cwnd;
+	};
+
+	static_assert(sizeof(trace_record) == 32, "trace_record must stay 32 bytes");
+
+	//---------------------------------------------------------------------
+	// ring of the latest 'capacity' records (rounded up to a power of two).
+	// There must be a single writer at a time: give each session its own
+	// ring, or share one ring among the sessions driven by one thread.
+	// Any thread may take a snapshot while the writer goes on
+	//---------------------------------------------------------------------
+	class trace_ring
+	{
+	public:
+		explicit trace_ring(size_t capacity)
+		{
+			size_t size = 1;
+			while (size < capacity) size <<= 1;
+			records = std::make_unique<trace_record[]>(size);
+			mask = size - 1;
+		}
+
+		void record(const trace_record &rec)
+		{
+			uint64_t pos = head.load(std::memory_order_relaxed);
+			records[pos & mask] = rec;
+			head.store(pos + 1, std::memory_order_release);
+		}
+
+		size_t capacity() const { return mask + 1; }
+
+		// records written since creation, including the overwritten ones
+		uint64_t written() const { return head.load(std::memory_order_acquire); }
+
+		// records still in the ring, oldest first. Slots the writer reached
+		// while they were copied are left out
+		std::vector<trace_record> snapshot() const
+		{
+			uint64_t end = head.load(std::memory_order_acquire);
+			uint64_t begin = end > capacity() ? end - capacity() : 0;
+			std::vector<trace_record> copy;
+			copy.reserve((size_t)(end - begin));
+			for (uint64_t pos = begin; pos < end; pos++)
+				copy.push_back(records[pos & mask]);
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+			uint64_t now = head.load(std::memory_order_relaxed);
+			uint64_t valid = now >= capacity() ? now - capacity() + 1 : 0;
+			if (valid > begin)
+				copy.erase(copy.begin(), copy.begin() + (ptrdiff_t)std::min<uint64_t>(valid - begin, copy.size()));
+			return copy;
+		}
+
+		// write the snapshot to a trace file: trace_file_header, then the
+		// records in host byte order
+		bool save(const char *path) const;
+
+	protected:
+		std::unique_ptr<trace_record[]> records;
+		size_t mask;
+		std::atomic<uint64_t> head{ 0 };
+	};
+
+	struct trace_file_header
+	{
+		char magic[8];			// "KCPTRACE"
+		uint32_t record_size;	// sizeof(trace_record)
+		uint32_t count;
+		uint64_t written;		// trace_ring::written() at the time of the snapshot
+	};
+
+	inline bool trace_ring::save(const char *path) const
+	{
+		std::vector<trace_record> copy = snapshot();
+		trace_file_header header = {};
+		memcpy(header.magic, "KCPTRACE", 8);
+		header.record_size = sizeof(trace_record);
+		header.count = (uint32_t)copy.size();
+		header.written = written();
+
+		FILE *fp = fopen(path, "wb");
+		if (fp == nullptr) return false;
+		bool done = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+			fwrite(copy.data(), sizeof(trace_record), copy.size(), fp) == copy.size();
+		return fclose(fp) == 0 && done;
+	}
+
+	inline const char* trace_event_name(uint32_t event)
+	{
+		static const char *names[] = {
+			"send", "push_out", "resend_rto", "resend_fast", "resend_rack", "resend_tlp",
+			"push_in", "push_duplicate", "push_dropped", "ack_in", "sack_in", "acks_out",
+			"probe_in", "wins_in", "probe_out", "wins_out", "deliver",
+			"datagram_out", "datagram_in", "dead_link", "push_over_budget", "message_dropped",
+		};
+		static_assert(sizeof(names) / sizeof(names[0]) == (size_t)trace_event::count, "trace_event names");
+		return event < (uint32_t)trace_event::count ? names[event] : "unknown";
+	}
+
+	// one line of text, returns the snprintf result
+	inline int format_trace(const trace_record &rec, char *buffer, size_t size)
+	{
+		return snprintf(buffer, size, "%10lu conv=%lu %-14s sn=%lu ts=%lu len=%lu xmit=%u rto=%lu cwnd=%lu",
+			(unsigned long)rec.time, (unsigned long)rec.conv, trace_event_name(rec.event),
+			(unsigned long)rec.sn, (unsigned long)rec.ts, (unsigned long)rec.len, (unsigned)rec.xmit,
+			(unsigned long)rec.rto, (unsigned long)rec.cwnd);
+	}
+}
+
+
+#endif
@@ -13,6 +13,7 @@
 
 #ifdef __unix__
 #include <unistd.h>
+#include <time.h>
 #endif //  __unix__
 
 #include "kcp.hpp"
@@ -24,9 +25,83 @@ int64_t right_now();
 
 namespace KCP
 {
+	static std::atomic<clock_source> selected_clock{ clock_source::system };
+	static std::function<int64_t()> custom_clock;
+	static std::atomic<bool> clock_cached{ false };
+	static std::atomic<int64_t> cached_milliseconds{ 0 };
+
+	static int64_t ReadClockMilliseconds()
+	{
+		switch (selected_clock.load(std::memory_order_relaxed))
+		{
+		case clock_source::steady:
+			return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+
+		case clock_source::monotonic_coarse:
+		{
+#if defined(_WIN32)
+			return (int64_t)GetTickCount64();
+#elif defined(CLOCK_MONOTONIC_COARSE)
+			timespec ts = {};
+			clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+			return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+			return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+#endif
+		}
+
+		case clock_source::custom:
+			if (custom_clock)
+				return custom_clock();
+			[[fallthrough]];
+
+		default:
+			return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+		}
+	}
+
+	static int64_t ClockMilliseconds()
+	{
+		if (clock_cached.load(std::memory_order_relaxed))
+			return cached_milliseconds.load(std::memory_order_relaxed);
+		return ReadClockMilliseconds();
+	}
+
+	void SetClockSource(clock_source source)
+	{
+		selected_clock.store(source);
+		if (clock_cached.load())
+			RefreshClock();
+	}
+
+	void SetClockSource(std::function<int64_t()> milliseconds_func)
+	{
+		custom_clock = milliseconds_func;
+		SetClockSource(clock_source::custom);
+	}
+
+	void EnableCachedClock(bool enable)
+	{
+		if (enable)
+			cached_milliseconds.store(ReadClockMilliseconds());
+		clock_cached.store(enable);
+	}
+
+	uint32_t RefreshClock()
+	{
+		int64_t now_ms = ReadClockMilliseconds();
+		cached_milliseconds.store(now_ms, std::memory_order_relaxed);
+		return static_cast<uint32_t>(now_ms & 0xFFFF'FFFFul);
+	}
+
 	uint32_t TimeNowForKCP()
 	{
-		return static_cast<uint32_t>((duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count()) & 0xFFFF'FFFFul);
+		return static_cast<uint32_t>(ClockMilliseconds() & 0xFFFF'FFFFul);
+	}
+
+	static int64_t ClockSeconds()
+	{
+		return ClockMilliseconds() / 1000;
 	}
 
 	void empty_function(void *) {}
@@ -44,6 +119,13 @@ namespace KCP
 		kcp_ptr = std::move(other.kcp_ptr);
 		last_input_time.store(other.last_input_time.load());
 		post_update = other.post_update;
+		event_handler = other.event_handler;
+	}
+
+	void KCP::DispatchEvents(uint32_t events)
+	{
+		if (events != 0 && event_handler)
+			event_handler(kcp_ptr->user, events);
 	}
 
 	//KCP::KCP(const KCP &other) noexcept
@@ -62,15 +144,17 @@ namespace KCP
 
 	void KCP::ResetWindowValues(int32_t srtt)
 	{
+		std::scoped_lock locker{ mtx };
 		if (outbound_bandwidth == 0 && inbound_bandwidth == 0)
 			return;
+		if (kcp_ptr->autotune)
+			return;
 		int32_t max_srtt = std::max(kcp_ptr->rx_srtt, srtt);
 		int32_t min_srtt = std::min(kcp_ptr->rx_srtt, srtt);
 		srtt = min_srtt <= 0 ? max_srtt : min_srtt;
 
 		if (srtt <= 0)
 			return;
-		std::scoped_lock locker{ mtx };
 		if (outbound_bandwidth > 0)
 		{
 			kcp_ptr->snd_wnd = (uint32_t)(outbound_bandwidth / kcp_ptr->mtu * srtt / 1000 * 1.2);
@@ -87,9 +171,55 @@ namespace KCP
 
 	int32_t KCP::GetRxSRTT()
 	{
+		std::shared_lock locker{ mtx };
 		return kcp_ptr->rx_srtt;
 	}
 
+	session_stats KCP::GetStats()
+	{
+		return kcp_ptr->get_stats();
+	}
+
+	void KCP::SetTrace(std::shared_ptr<trace_ring> ring, uint32_t mask)
+	{
+		std::scoped_lock locker{ mtx };
+		kcp_ptr->set_trace(std::move(ring), mask);
+	}
+
+	void KCP::SetLatencyTracking(bool enable)
+	{
+		std::scoped_lock locker{ mtx };
+		kcp_ptr->set_latency_tracking(enable);
+	}
+
+	void KCP::SetMemoryLimit(uint64_t bytes)
+	{
+		std::scoped_lock locker{ mtx };
+		kcp_ptr->set_memory_limit(bytes);
+	}
+
+	void KCP::SetMemoryBudget(uint64_t bytes)
+	{
+		kcp_core::set_memory_budget(bytes);
+	}
+
+	memory_usage KCP::GetMemoryUsage()
+	{
+		std::shared_lock locker{ mtx };
+		return kcp_ptr->get_memory();
+	}
+
+	uint64_t KCP::GetProcessMemoryUsage()
+	{
+		return kcp_core::get_memory_used();
+	}
+
+	message_latency KCP::GetLatency()
+	{
+		std::shared_lock locker{ mtx };
+		return kcp_ptr->get_latency();
+	}
+
 	void KCP::SetOutput(std::function<int(const char *, int, void *)> output_func)
 	{
 		kcp_ptr->set_output(output_func);
@@ -100,6 +230,29 @@ namespace KCP
 		post_update = post_update_func;
 	}
 
+	void KCP::SetEventHandler(std::function<void(void *, uint32_t)> event_handler_func)
+	{
+		event_handler = event_handler_func;
+	}
+
+	void KCP::SetWritableWatermark(uint32_t segments)
+	{
+		std::scoped_lock locker{ mtx };
+		kcp_ptr->set_snd_watermark((int)segments);
+	}
+
+	int KCP::SetSendWatermarks(uint64_t high, uint64_t low)
+	{
+		std::scoped_lock locker{ mtx };
+		return kcp_ptr->set_snd_bytes_watermarks(high, low);
+	}
+
+	uint64_t KCP::GetPendingSendBytes()
+	{
+		std::shared_lock locker{ mtx };
+		return kcp_ptr->get_snd_bytes();
+	}
+
 	int KCP::Receive(char *buffer, int len)
 	{
 		std::scoped_lock locker{ mtx };
@@ -122,7 +275,9 @@ namespace KCP
 	{
 		std::unique_lock locker{ mtx };
 		kcp_ptr->update(current);
+		uint32_t events = kcp_ptr->take_events();
 		locker.unlock();
+		DispatchEvents(events);
 		post_update(kcp_ptr->user);
 	}
 
@@ -130,7 +285,9 @@ namespace KCP
 	{
 		std::unique_lock locker{ mtx };
 		kcp_ptr->update(TimeNowForKCP());
+		uint32_t events = kcp_ptr->take_events();
 		locker.unlock();
+		DispatchEvents(events);
 		post_update(kcp_ptr->user);
 	}
 
@@ -148,9 +305,14 @@ namespace KCP
 
 	uint32_t KCP::Refresh()
 	{
+		uint32_t current = TimeNowForKCP();
 		std::unique_lock unique_locker{ mtx };
-		kcp_ptr->flush(TimeNowForKCP());
-		return kcp_ptr->check(TimeNowForKCP());
+		kcp_ptr->flush(current);
+		uint32_t next_time = kcp_ptr->check(current);
+		uint32_t events = kcp_ptr->take_events();
+		unique_locker.unlock();
+		DispatchEvents(events);
+		return next_time;
 	}
 
 	// when you received a low level packet (eg. UDP packet), call it
@@ -158,8 +320,10 @@ namespace KCP
 	{
 		std::unique_lock locker{ mtx };
 		auto ret = kcp_ptr->input(data, size);
+		uint32_t events = kcp_ptr->take_events();
 		locker.unlock();
 		last_input_time.store(right_now());
+		DispatchEvents(events);
 		return ret;
 	}
 
@@ -168,7 +332,9 @@ namespace KCP
 	{
 		std::unique_lock locker{ mtx };
 		kcp_ptr->flush(TimeNowForKCP());
+		uint32_t events = kcp_ptr->take_events();
 		locker.unlock();
+		DispatchEvents(events);
 		post_update(kcp_ptr->user);
 	}
 
@@ -192,26 +358,31 @@ namespace KCP
 	// set maximum window size: sndwnd=32, rcvwnd=32 by default
 	void KCP::SetWindowSize(uint32_t sndwnd, uint32_t rcvwnd)
 	{
+		std::scoped_lock locker{ mtx };
 		kcp_ptr->set_wndsize(sndwnd, rcvwnd);
 	}
 
 	void KCP::GetWindowSize(uint32_t &sndwnd, uint32_t &rcvwnd)
 	{
+		std::shared_lock locker{ mtx };
 		sndwnd = kcp_ptr->snd_wnd;
 		rcvwnd = kcp_ptr->rcv_wnd;
 	}
 	std::pair<uint32_t, uint32_t> KCP::GetWindowSizes()
 	{
+		std::shared_lock locker{ mtx };
 		return std::pair<uint32_t, uint32_t>{ kcp_ptr->snd_wnd, kcp_ptr->rcv_wnd };
 	}
 
 	uint32_t KCP::GetSendWindowSize()
 	{
+		std::shared_lock locker{ mtx };
 		return kcp_ptr->snd_wnd;
 	}
 
 	uint32_t KCP::GetReceiveWindowSize()
 	{
+		std::shared_lock locker{ mtx };
 		return kcp_ptr->rcv_wnd;
 	}
 
@@ -253,6 +424,83 @@ namespace KCP
 		kcp_ptr->stream = enable;
 	}
 
+	void KCP::SetFeatures(uint32_t features)
+	{
+		std::scoped_lock locker{ mtx };
+		kcp_ptr->set_features(features);
+	}
+
+	uint32_t KCP::GetNegotiatedFeatures()
+	{
+		std::shared_lock locker{ mtx };
+		return kcp_ptr->get_negotiated();
+	}
+
+	int KCP::SetMaxMessageSize(uint32_t bytes)
+	{
+		std::scoped_lock locker{ mtx };
+		return kcp_ptr->set_max_message_size(bytes);
+	}
+
+	int KCP::SendStream(uint32_t stream_id, const char *buffer, size_t len)
+	{
+		std::scoped_lock locker{ mtx };
+		return kcp_ptr->send_stream(stream_id, buffer, (int)len);
+	}
+
+	int KCP::ReceiveStream(uint32_t stream_id, char *buffer, int len)
+	{
+		std::scoped_lock locker{ mtx };
+		return kcp_ptr->receive_stream(stream_id, buffer, len);
+	}
+
+	int KCP::ReceiveStream(uint32_t stream_id, std::vector<char> &buffer)
+	{
+		std::scoped_lock locker{ mtx };
+		return kcp_ptr->receive_stream(stream_id, buffer.data(), (int)buffer.size());
+	}
+
+	int KCP::PeekStream()
+	{
+		std::shared_lock locker{ mtx };
+		return kcp_ptr->peek_stream();
+	}
+
+	int KCP::SetStreamPriority(uint32_t stream_id, uint32_t priority, uint32_t weight)
+	{
+		std::scoped_lock locker{ mtx };
+		return kcp_ptr->set_stream_priority(stream_id, priority, weight);
+	}
+
+	int KCP::SetAckPolicy(int every, int delay)
+	{
+		std::scoped_lock locker{ mtx };
+		return kcp_ptr->set_ack_policy(every, delay);
+	}
+
+	int KCP::SetLossDetection(int rack, int tlp)
+	{
+		std::scoped_lock locker{ mtx };
+		return kcp_ptr->set_loss_detection(rack, tlp);
+	}
+
+	int KCP::SetFEC(int data_shards, int parity_shards)
+	{
+		std::scoped_lock locker{ mtx };
+		return kcp_ptr->set_fec(data_shards, parity_shards);
+	}
+
+	int KCP::SetWindowAutotune(bool enable, uint32_t max_sndwnd, uint32_t max_rcvwnd)
+	{
+		std::scoped_lock locker{ mtx };
+		return kcp_ptr->set_autotune(enable, max_sndwnd, max_rcvwnd);
+	}
+
+	void KCP::SetAutotuneMemory(uint64_t bytes)
+	{
+		kcp_core::set_autotune_memory(bytes);
+	}
+
 	int32_t& KCP::RxMinRTO()
 	{
 		return kcp_ptr->rx_minrto;
@@ -260,8 +508,22 @@ namespace KCP
 
 	void KCP::SetBandwidth(uint64_t out_bw, uint64_t in_bw)
 	{
+		std::scoped_lock locker{ mtx };
 		outbound_bandwidth = out_bw;
 		inbound_bandwidth = in_bw;
+		kcp_ptr->set_pacing(-1, out_bw);
+	}
+
+	void KCP::SetPacing(bool enable)
+	{
+		std::scoped_lock locker{ mtx };
+		kcp_ptr->set_pacing(enable, outbound_bandwidth);
+	}
+
+	void KCP::SetCongestionController(std::unique_ptr<congestion_controller> controller)
+	{
+		std::scoped_lock locker{ mtx };
+		kcp_ptr->set_congestion_controller(std::move(controller));
 	}
 
 	int64_t KCP::LastInputTime()
@@ -281,32 +543,48 @@ namespace KCP
 	
 	bool KCP::WaitQueueIsFull()
 	{
-		return kcp_ptr->snd_queue.size() >= kcp_ptr->snd_wnd;
+		std::shared_lock locker{ mtx };
+		if (kcp_ptr->snd_high > 0)
+			return kcp_ptr->snd_bytes >= kcp_ptr->snd_high;
+		return kcp_ptr->get_snd_queued() >= kcp_ptr->snd_wnd;
 	}
 
 	bool KCP::WaitQueueIsEmpty()
 	{
-		return kcp_ptr->snd_queue.empty();
+		std::shared_lock locker{ mtx };
+		if (kcp_ptr->snd_high > 0)
+			return kcp_ptr->snd_bytes == 0;
+		return kcp_ptr->get_snd_queued() == 0;
 	}
 
 	bool KCP::WaitQueueAboveHalfCapacity()
 	{
-		return kcp_ptr->snd_queue.size() > kcp_ptr->snd_wnd / 2;
+		std::shared_lock locker{ mtx };
+		if (kcp_ptr->snd_high > 0)
+			return kcp_ptr->snd_bytes > kcp_ptr->snd_high / 2;
+		return kcp_ptr->get_snd_queued() > kcp_ptr->snd_wnd / 2;
 	}
 
 	bool KCP::WaitQueueBelowHalfCapacity()
 	{
-		return kcp_ptr->snd_queue.size() < kcp_ptr->snd_wnd / 2;
+		std::shared_lock locker{ mtx };
+		if (kcp_ptr->snd_high > 0)
+			return kcp_ptr->snd_bytes < kcp_ptr->snd_high / 2;
+		return kcp_ptr->get_snd_queued() < kcp_ptr->snd_wnd / 2;
 	}
 
+	// room left: bytes below the high watermark (negative once a message went
+	// over it), or segments below snd_wnd
 	int64_t KCP::GetWaitQueueAvailableCapacity()
 	{
-		return (int64_t)kcp_ptr->snd_wnd - (int64_t)kcp_ptr->snd_queue.size();
+		std::shared_lock locker{ mtx };
+		if (kcp_ptr->snd_high > 0)
+			return (int64_t)kcp_ptr->snd_high - (int64_t)kcp_ptr->snd_bytes;
+		return (int64_t)kcp_ptr->snd_wnd - (int64_t)kcp_ptr->get_snd_queued();
 	}
 }
 
 int64_t right_now()
 {
-	auto right_now = system_clock::now();
-	return duration_cast<seconds>(right_now.time_since_epoch()).count();
+	return KCP::ClockSeconds();
 }
@@ -21,6 +21,28 @@ namespace KCP
 	//void proxy_writelog(KCP *kcp, const char *buf);
 	constexpr uint32_t five_minutes_in_ms = 5 * 60 * 1000;
 
+	enum class clock_source
+	{
+		system,				// system_clock, follows wall time (default)
+		steady,				// steady_clock, monotonic
+		monotonic_coarse,	// CLOCK_MONOTONIC_COARSE / GetTickCount64, monotonic and cheap
+		custom				// function given to SetClockSource()
+	};
+
+	// choose the clock read by TimeNowForKCP() and by the last input time,
+	// set it before any session is created
+	void SetClockSource(clock_source source);
+	// custom clock, returns milliseconds
+	void SetClockSource(std::function<int64_t()> milliseconds_func);
+
+	// when enabled, TimeNowForKCP() and Input() use the value stored by the
+	// latest RefreshClock() instead of reading the clock on every call
+	void EnableCachedClock(bool enable);
+
+	// read the clock source once and cache it,
+	// call it once per event-loop iteration or per batch of packets
+	uint32_t RefreshClock();
+
 	uint32_t TimeNowForKCP();
 	//---------------------------------------------------------------------
 	// KCP wrapper
@@ -43,9 +65,11 @@ namespace KCP
 		//std::function<int(const char *, int, void *)> output;	// int(*output)(const char *buf, int len, void *user)
 		//std::function<void(const char *, void *)> writelog;	//void(*writelog)(const char *log, void *user)
 		std::function<void(void *)> post_update;
+		std::function<void(void *, uint32_t)> event_handler;
 
 		void Initialise(uint32_t conv);
 		void MoveKCP(KCP &other) noexcept;
+		void DispatchEvents(uint32_t events);
 
 	public:
 		KCP() { Initialise(0); }
@@ -73,11 +97,28 @@ namespace KCP
 
 		void SetPostUpdate(std::function<void(void *)> post_update_func);
 
+		// readiness notification, called outside the lock and only on transitions
+		// void(*event_handler)(void *user, uint32_t events), events: IKCP_EVENT_*
+		void SetEventHandler(std::function<void(void *, uint32_t)> event_handler_func);
+
+		// IKCP_EVENT_WRITABLE fires when the wait queue drops below this many
+		// segments, 0 means follow the send window size
+		void SetWritableWatermark(uint32_t segments);
+
+		// byte based backpressure, see kcp_core::set_snd_bytes_watermarks:
+		// Send returns -4 once 'high' payload bytes are queued or unacknowledged,
+		// IKCP_EVENT_WRITABLE fires when they drain to 'low'. Returns -1 when
+		// low > high. The WaitQueue* calls then count these bytes
+		int SetSendWatermarks(uint64_t high, uint64_t low);
+		uint64_t GetPendingSendBytes();
+
 		// user/upper level recv: returns size, returns below zero for EAGAIN
 		int Receive(char *buffer, int len);
 		int Receive(std::vector<char> &buffer);
 
-		// user/upper level send, returns below zero for error
+		// user/upper level send, returns below zero for error,
+		// -3 when the memory limit is reached (see SetMemoryLimit),
+		// -4 at the high watermark (see SetSendWatermarks)
 		int Send(const char *buffer, size_t len);
 
 		// update state (call it repeatedly, every 10ms-100ms), or you can ask 
@@ -122,6 +163,21 @@ namespace KCP
 		void ResetWindowValues(int32_t srtt);
 		int32_t GetRxSRTT();
 
+		// counters of this session, taken without the lock so a
+		// monitoring thread never waits for Update / Input
+		session_stats GetStats();
+
+		// binary event tracing, see kcp_core::set_trace. The lock keeps one
+		// writer per session; a ring shared by several sessions must only
+		// be written from one thread
+		void SetTrace(std::shared_ptr<trace_ring> ring, uint32_t mask = trace_all);
+
+		// per-message latency histograms, see kcp_core::set_latency_tracking.
+		// GetLatency() takes the shared lock, SetLatencyTracking(false) frees
+		// the histograms
+		void SetLatencyTracking(bool enable);
+		message_latency GetLatency();
+
 		// get how many packet is waiting to be sent
 		int WaitingForSend();
 
@@ -138,12 +194,62 @@ namespace KCP
 
 		void SetStreamMode(bool enable);
 
+		// optional protocol extensions, IKCP_FEATURE_*, both ends must enable
+		// them, they are used once the remote side has confirmed
+		void SetFeatures(uint32_t features);
+		uint32_t GetNegotiatedFeatures();
+		// largest incoming message, see kcp_core::set_max_message_size
+		int SetMaxMessageSize(uint32_t bytes);
+
+		// independent message streams, IKCP_FEATURE_STREAMS, see
+		// kcp_core::send_stream. Send / Receive use stream 0, other stream ids
+		// return -5 until the feature is negotiated
+		int SendStream(uint32_t stream_id, const char *buffer, size_t len);
+		int ReceiveStream(uint32_t stream_id, char *buffer, int len);
+		int ReceiveStream(uint32_t stream_id, std::vector<char> &buffer);
+		// lowest stream id with a complete message, -1 when there is none
+		int PeekStream();
+		// lower priority values are sent first, equal ones share by weight
+		int SetStreamPriority(uint32_t stream_id, uint32_t priority, uint32_t weight);
+
+		// delayed ack, see kcp_core::set_ack_policy
+		int SetAckPolicy(int every, int delay);
+
+		// rack / tail loss probe, see kcp_core::set_loss_detection
+		int SetLossDetection(int rack, int tlp);
+
+		// forward error correction, see kcp_core::set_fec
+		int SetFEC(int data_shards, int parity_shards);
+
+		// window autotuning, see kcp_core::set_autotune, call it after
+		// SetWindowSize(). ResetWindowValues() leaves tuned windows alone
+		int SetWindowAutotune(bool enable, uint32_t max_sndwnd, uint32_t max_rcvwnd);
+		// budget shared by all sessions, see kcp_core::set_autotune_memory
+		static void SetAutotuneMemory(uint64_t bytes);
+
+		// hard memory caps, see kcp_core::set_memory_limit, 0: no limit
+		void SetMemoryLimit(uint64_t bytes);
+		static void SetMemoryBudget(uint64_t bytes);
+		memory_usage GetMemoryUsage();
+		static uint64_t GetProcessMemoryUsage();
+
 		int32_t& RxMinRTO();
+		// bytes per second, out_bw is also used as the pacing rate
 		void SetBandwidth(uint64_t out_bw, uint64_t in_bw);
+
+		// spread sending over the update interval, the rate comes from
+		// SetBandwidth() or from cwnd / srtt when no bandwidth is given
+		void SetPacing(bool enable);
+
+		// replace the congestion controller, nullptr restores the default one
+		void SetCongestionController(std::unique_ptr<congestion_controller> controller);
+		// seconds, measured by the selected clock source
 		int64_t LastInputTime();
 
 		void* GetUserData();
 		void SetUserData(void *user_data);
+		// against the send watermarks in bytes when SetSendWatermarks is on,
+		// against snd_wnd in segments of the send queues otherwise
 		bool WaitQueueIsFull();
 		bool WaitQueueIsEmpty();
 		bool WaitQueueAboveHalfCapacity();
@@ -0,0 +1,882 @@
+//=====================================================================
+//
+// benchmark.cpp - kcp benchmarks on a virtual-time bottleneck link,
+// driven by the simulator in simulator.h
+//
+// build:
+// g++ -std=c++17 -O2 benchmark.cpp ../ikcp.cpp ../ikcp_congestion.cpp ../ikcp_fec.cpp -o benchmark
+//
+// usage:
+// ./benchmark pacing
+// ./benchmark cc
+// ./benchmark sack
+// ./benchmark ack
+// ./benchmark compact
+// ./benchmark fec
+// ./benchmark rack
+// ./benchmark autotune
+// ./benchmark wscale
+// ./benchmark large
+// ./benchmark stats
+// ./benchmark memory
+// ./benchmark backpressure
+// ./benchmark streams
+//
+//=====================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "simulator.h"
+
+
+// one direction of the link: random loss, a bottleneck with a drop-tail
+// queue, then a fixed delay
+struct LinkConfig
+{
+	uint64_t rate = 0;		// bytes per second, 0: unlimited
+	uint32_t delay = 0;		// one way delay in millisec
+	uint32_t queue = 0;		// drop-tail queue in bytes, 0: unlimited
+	double loss = 0;		// random loss, 0.0 - 1.0
+};
+
+
+struct BulkOptions
+{
+	LinkConfig forward;
+	LinkConfig backward;
+	int wnd = 256;
+	int nodelay = 1, interval = 20, resend = 2, nc = 1;
+	int pacing = 0;
+	uint64_t pacing_bandwidth = 0;
+	bool bbr = false;
+	uint32_t features = 0;
+	int ack_every = 1, ack_delay = 0;
+	int message_size = 1024;
+	int messages_per_tick = 0;	// 0: keep the send queue full
+	uint32_t tick = 1;			// millisec between batches of messages_per_tick
+	int fec_data = 0, fec_parity = 0;
+	int rack = 0, tlp = 0;
+	int autotune = 0;
+	uint32_t max_wnd = 0xffff;	// autotune cap for both windows
+	uint32_t duration = 10000;
+};
+
+struct BulkResult
+{
+	double goodput;			// bytes per second delivered to the receiver
+	uint64_t messages;		// messages delivered to the receiver
+	uint64_t bytes;			// bytes on the forward path
+	uint64_t datagrams;		// datagrams offered to the bottleneck
+	uint64_t dropped;		// dropped by the bottleneck queue
+	uint64_t retransmits;		// rto + fast + rack + tlp resends
+	uint64_t ack_datagrams;	// datagrams on the reverse path
+	uint64_t ack_bytes;		// bytes on the reverse path
+	double input_ms;		// cpu time the sender spent in input()
+	uint32_t snd_wnd, rcv_wnd;	// sender / receiver window at the end
+	std::vector<uint32_t> latency;	// per message, only when messages_per_tick > 0
+	KCP::session_stats sender_stats, receiver_stats;
+};
+
+// builds both paths of 'vnet', returns the forward bottleneck or nullptr
+static sim::RateLimit* setup_link(sim::Simulator &vnet, const BulkOptions &opt)
+{
+	sim::RateLimit *bottleneck = nullptr;
+	const LinkConfig *links[2] = { &opt.forward, &opt.backward };
+	for (int side = 0; side < 2; side++) {
+		const LinkConfig &link = *links[side];
+		sim::Path &path = vnet.path(side);
+		if (link.loss > 0)
+			path.add<sim::RandomLoss>(link.loss);
+		if (link.rate > 0) {
+			sim::RateLimit &limit = path.add<sim::RateLimit>(link.rate, link.queue);
+			if (side == 0) bottleneck = &limit;
+		}
+		path.add<sim::Delay>(link.delay, link.delay);
+	}
+	return bottleneck;
+}
+
+// call vnet.attach() once both endpoints are set up
+static void setup_endpoint(KCP::kcp_core &kcp, const BulkOptions &opt)
+{
+	kcp.initialise(0x11223344, nullptr);
+	kcp.set_wndsize(opt.wnd, opt.wnd);
+	kcp.set_nodelay(opt.nodelay, opt.interval, opt.resend, opt.nc);
+}
+
+// sender keeps its queue full for 'duration' millisec of virtual time
+static BulkResult run_bulk(const BulkOptions &opt)
+{
+	sim::Simulator vnet(1);
+	sim::RateLimit *bottleneck = setup_link(vnet, opt);
+	vnet.time_input(true);
+	KCP::kcp_core sender, receiver;
+	setup_endpoint(sender, opt);
+	setup_endpoint(receiver, opt);
+	vnet.attach(sender, receiver);
+	sender.set_pacing(opt.pacing, opt.pacing_bandwidth);
+	if (opt.bbr)
+		sender.set_congestion_controller(std::make_unique<KCP::bbr_controller>());
+	sender.set_features(opt.features);
+	receiver.set_features(opt.features);
+	sender.set_ack_policy(opt.ack_every, opt.ack_delay);
+	receiver.set_ack_policy(opt.ack_every, opt.ack_delay);
+	sender.set_fec(opt.fec_data, opt.fec_parity);
+	sender.set_loss_detection(opt.rack, opt.tlp);
+	receiver.set_fec(opt.fec_data, opt.fec_parity);
+	sender.set_autotune(opt.autotune, opt.max_wnd, opt.max_wnd);
+	receiver.set_autotune(opt.autotune, opt.max_wnd, opt.max_wnd);
+
+	std::vector<char> message(std::max(opt.message_size, 4), 'k');
+	std::vector<char> buffer(1 << 16);
+	uint64_t received = 0, messages = 0;
+	BulkResult result;
+
+	vnet.run(opt.duration, [&](uint32_t now) -> uint32_t {
+		if (opt.messages_per_tick == 0) {
+			while (sender.get_waitsnd() < (int)sender.snd_wnd * 2)
+				sender.send(message.data(), (int)message.size());
+		}
+		else if (now % opt.tick == 0) {
+			memcpy(message.data(), &now, 4);	// send time, for latency
+			for (int i = 0; i < opt.messages_per_tick; i++)
+				sender.send(message.data(), (int)message.size());
+		}
+
+		for (int hr; (hr = receiver.receive(buffer.data(), (int)buffer.size())) > 0; messages++) {
+			received += hr;
+			if (opt.messages_per_tick > 0) {
+				uint32_t sent;
+				memcpy(&sent, buffer.data(), 4);
+				result.latency.push_back(now - sent);
+			}
+		}
+		return 1;
+	});
+
+	result.goodput = received * 1000.0 / opt.duration;
+	result.messages = messages;
+	result.bytes = vnet.stats(0).bytes;
+	result.datagrams = vnet.stats(0).sent;
+	result.dropped = bottleneck != nullptr ? bottleneck->dropped : 0;
+	result.ack_datagrams = vnet.stats(1).sent;
+	result.ack_bytes = vnet.stats(1).bytes;
+	result.input_ms = vnet.stats(1).input_ms;
+	result.snd_wnd = sender.snd_wnd;
+	result.rcv_wnd = receiver.rcv_wnd;
+	result.sender_stats = sender.get_stats();
+	result.retransmits = result.sender_stats.retransmits();
+	result.receiver_stats = receiver.get_stats();
+	return result;
+}
+
+static void print_result(const char *name, const BulkResult &r)
+{
+	printf("%-28s goodput=%8.1f KB/s  datagrams=%7llu  queue-drops=%6llu (%5.2f%%)  retransmits=%6llu\n",
+		name, r.goodput / 1024, (unsigned long long)r.datagrams, (unsigned long long)r.dropped,
+		r.datagrams ? 100.0 * r.dropped / r.datagrams : 0.0, (unsigned long long)r.retransmits);
+}
+
+// 20 Mbit/s bottleneck, 50ms rtt, 16 KB router queue
+static void bench_pacing()
+{
+	BulkOptions opt;
+	opt.forward.rate = 20'000'000 / 8;
+	opt.forward.delay = 25;
+	opt.forward.queue = 16 * 1024;
+	opt.backward.delay = 25;
+
+	const struct { const char *name; int nc; } modes[] = {
+		{ "fast, nocwnd", 1 },
+		{ "fast, cwnd", 0 },
+	};
+
+	for (auto &mode : modes) {
+		printf("[%s]\n", mode.name);
+		opt.nc = mode.nc;
+
+		opt.pacing = 0;
+		print_result("  no pacing", run_bulk(opt));
+
+		opt.pacing = 1;
+		opt.pacing_bandwidth = 0;
+		print_result("  pacing, cwnd / srtt", run_bulk(opt));
+
+		opt.pacing_bandwidth = opt.forward.rate;
+		print_result("  pacing, bandwidth", run_bulk(opt));
+	}
+}
+
+// 20 Mbit/s bottleneck, 50ms rtt, 64 KB router queue, random loss
+static void bench_cc()
+{
+	BulkOptions opt;
+	opt.forward.rate = 20'000'000 / 8;
+	opt.forward.delay = 25;
+	opt.forward.queue = 64 * 1024;
+	opt.backward.delay = 25;
+	opt.wnd = 1024;
+
+	for (double loss : { 0.0, 0.01, 0.05, 0.10 }) {
+		printf("[random loss %.0f%%]\n", loss * 100);
+		opt.forward.loss = loss;
+		opt.backward.loss = loss;
+
+		opt.nc = 0; opt.pacing = 0; opt.bbr = false;
+		print_result("  default (reno)", run_bulk(opt));
+
+		opt.nc = 1; opt.pacing = 0; opt.bbr = false;
+		print_result("  nocwnd", run_bulk(opt));
+
+		opt.nc = 0; opt.pacing = 1; opt.bbr = true;
+		print_result("  bbr + pacing", run_bulk(opt));
+	}
+}
+
+// reverse path cost of one ack per segment versus sack ranges
+static void bench_sack()
+{
+	BulkOptions opt;
+	opt.forward.rate = 100'000'000 / 8;
+	opt.forward.delay = 25;
+	opt.backward.delay = 25;
+	opt.wnd = 1024;
+	opt.nc = 1;
+	opt.pacing = 1;
+	opt.pacing_bandwidth = opt.forward.rate;
+
+	for (double loss : { 0.0, 0.01, 0.05 }) {
+		printf("[100 Mbit/s, random loss %.0f%%]\n", loss * 100);
+		opt.forward.loss = loss;
+		for (uint32_t features : { 0u, (uint32_t)IKCP_FEATURE_SACK }) {
+			opt.features = features;
+			BulkResult r = run_bulk(opt);
+			double mb = r.goodput * opt.duration / 1000 / (1024 * 1024);
+			printf("  %-6s goodput=%8.1f KB/s  ack bytes/MB=%8.0f  sender input()=%7.2f ms\n",
+				features ? "sack" : "ack", r.goodput / 1024, r.ack_bytes / mb, r.input_ms);
+		}
+	}
+}
+
+// receiver packet rate with delayed / coalesced acks, 1ms update interval
+static void bench_ack()
+{
+	BulkOptions opt;
+	opt.forward.rate = 100'000'000 / 8;
+	opt.forward.delay = 25;
+	opt.backward.delay = 25;
+	opt.wnd = 1024;
+	opt.interval = 1;
+	opt.nc = 1;
+	opt.pacing = 1;
+	opt.pacing_bandwidth = opt.forward.rate;
+
+	const struct { int every, delay; } policies[] = { { 1, 0 }, { 16, 5 }, { 64, 10 }, { 128, 20 } };
+	for (double loss : { 0.0, 0.01 }) {
+		printf("[100 Mbit/s, random loss %.0f%%]\n", loss * 100);
+		opt.forward.loss = loss;
+		for (uint32_t features : { 0u, (uint32_t)IKCP_FEATURE_SACK }) {
+			opt.features = features;
+			for (auto policy : policies) {
+				opt.ack_every = policy.every;
+				opt.ack_delay = policy.delay;
+				BulkResult r = run_bulk(opt);
+				printf("  %-4s every=%-3d delay=%-2dms  goodput=%8.1f KB/s  ack datagrams/s=%6.0f  ack bytes/s=%8.0f  retransmits=%5llu\n",
+					features ? "sack" : "ack", policy.every, policy.delay, r.goodput / 1024,
+					r.ack_datagrams * 1000.0 / opt.duration, r.ack_bytes * 1000.0 / opt.duration,
+					(unsigned long long)r.retransmits);
+			}
+		}
+	}
+}
+
+// bytes on the wire per delivered message, fixed header versus compact header
+static void bench_compact()
+{
+	BulkOptions opt;
+	opt.forward.rate = 10'000'000 / 8;
+	opt.forward.delay = 25;
+	opt.backward.delay = 25;
+	opt.interval = 10;
+
+	const struct { const char *name; int size, per_tick; uint32_t tick; } mixes[] = {
+		{ "input, 16 B x 1 / 16ms", 16, 1, 16 },
+		{ "state, 48 B x 20 / 16ms", 48, 20, 16 },
+		{ "chat, 200 B x 1 / 100ms", 200, 1, 100 },
+		{ "bulk, 1024 B", 1024, 0, 1 },
+	};
+
+	for (double loss : { 0.0, 0.02 }) {
+		printf("[random loss %.0f%%]\n", loss * 100);
+		opt.forward.loss = loss;
+		opt.backward.loss = loss;
+		for (auto &mix : mixes) {
+			opt.message_size = mix.size;
+			opt.messages_per_tick = mix.per_tick;
+			opt.tick = mix.tick;
+			double per_message[2];
+			for (int i = 0; i < 2; i++) {
+				opt.features = i ? IKCP_FEATURE_COMPACT | IKCP_FEATURE_SACK : IKCP_FEATURE_SACK;
+				BulkResult r = run_bulk(opt);
+				per_message[i] = r.messages ? (double)(r.bytes + r.ack_bytes) / r.messages : 0;
+			}
+			printf("  %-26s bytes/message: fixed=%8.1f  compact=%8.1f  (-%4.1f%%)\n", mix.name,
+				per_message[0], per_message[1], 100.0 * (1 - per_message[1] / per_message[0]));
+		}
+	}
+}
+
+static uint32_t percentile(std::vector<uint32_t> &values, double p)
+{
+	if (values.empty()) return 0;
+	size_t index = (size_t)(p * (values.size() - 1));
+	std::nth_element(values.begin(), values.begin() + index, values.end());
+	return values[index];
+}
+
+// reed-solomon kernel throughput, then message latency versus loss
+static void bench_fec()
+{
+	const int data_shards = 10, parity_shards = 3;
+	const size_t shard_size = 1400;
+	std::vector<std::vector<uint8_t>> data(data_shards, std::vector<uint8_t>(shard_size));
+	std::vector<std::vector<uint8_t>> parity(parity_shards, std::vector<uint8_t>(shard_size));
+	std::vector<const uint8_t*> data_ptr;
+	std::vector<uint8_t*> parity_ptr;
+	std::mt19937 rng(7);
+	for (auto &shard : data) {
+		for (auto &byte : shard) byte = (uint8_t)rng();
+		data_ptr.push_back(shard.data());
+	}
+	for (auto &shard : parity) parity_ptr.push_back(shard.data());
+
+	const struct { const char *name; KCP::gf_kernel kernel; } kernels[] = {
+		{ "scalar", KCP::gf_kernel::scalar },
+		{ "ssse3", KCP::gf_kernel::ssse3 },
+		{ "avx2", KCP::gf_kernel::avx2 },
+	};
+	KCP::gf_kernel best = KCP::reed_solomon::get_kernel();
+	std::vector<uint8_t> reference;
+	printf("[reed-solomon %d+%d, %zu byte shards]\n", data_shards, parity_shards, shard_size);
+	for (auto &k : kernels) {
+		if (!KCP::reed_solomon::set_kernel(k.kernel)) {
+			printf("  %-6s not supported\n", k.name);
+			continue;
+		}
+		const int rounds = 20000;
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < rounds; i++)
+			KCP::reed_solomon::encode(data_ptr.data(), data_shards, parity_ptr.data(), parity_shards, shard_size);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (reference.empty()) reference = parity.back();
+		printf("  %-6s encode %8.1f MB/s %s\n", k.name, rounds * data_shards * shard_size / seconds / 1e6,
+			parity.back() == reference ? "" : "(MISMATCH)");
+	}
+	KCP::reed_solomon::set_kernel(best);
+
+	BulkOptions opt;
+	opt.forward.rate = 20'000'000 / 8;
+	opt.forward.delay = 30;
+	opt.backward.delay = 30;
+	opt.interval = 10;
+	opt.message_size = 1000;
+	opt.messages_per_tick = 10;
+	opt.tick = 10;
+
+	const struct { const char *name; int data, parity; } codes[] = {
+		{ "no fec", 0, 0 },
+		{ "fec 10+3", 10, 3 },
+		{ "fec 4+2", 4, 2 },
+	};
+	printf("[1000 B x 10 / 10ms, 60ms rtt, latency in millisec]\n");
+	for (double loss : { 0.0, 0.01, 0.05, 0.10, 0.20 }) {
+		opt.forward.loss = loss;
+		opt.backward.loss = loss;
+		for (auto &code : codes) {
+			opt.fec_data = code.data;
+			opt.fec_parity = code.parity;
+			BulkResult r = run_bulk(opt);
+			double wire = r.messages ? (double)r.bytes / r.messages / opt.message_size : 0;
+			printf("  loss %2.0f%%  %-9s p50=%4u  p99=%4u  p99.9=%4u  max=%4u  wire bytes / payload=%5.2f\n",
+				loss * 100, code.name, percentile(r.latency, 0.5), percentile(r.latency, 0.99),
+				percentile(r.latency, 0.999), percentile(r.latency, 1.0), wire);
+		}
+	}
+}
+
+// interactive traffic, a few segments in flight, fastack rarely reaches resend
+static void bench_rack()
+{
+	BulkOptions opt;
+	opt.forward.rate = 10'000'000 / 8;
+	opt.forward.delay = 10;
+	opt.backward.delay = 10;
+	opt.nodelay = 0;
+	opt.interval = 10;
+	opt.nc = 1;
+	opt.message_size = 3000;
+	opt.messages_per_tick = 1;
+	opt.tick = 200;
+	opt.duration = 120000;
+
+	const struct { const char *name; int rack, tlp; } modes[] = {
+		{ "fastack + rto", 0, 0 },
+		{ "rack", 1, 0 },
+		{ "rack + tlp", 1, 1 },
+	};
+	printf("[3000 B (3 segments) every 200ms, 20ms rtt, normal mode, latency in millisec]\n");
+	for (double loss : { 0.01, 0.05, 0.10 }) {
+		opt.forward.loss = loss;
+		opt.backward.loss = loss;
+		for (auto &mode : modes) {
+			opt.rack = mode.rack;
+			opt.tlp = mode.tlp;
+			BulkResult r = run_bulk(opt);
+			printf("  loss %2.0f%%  %-14s p50=%4u  p90=%4u  p99=%4u  p99.9=%4u  retransmits=%5llu\n",
+				loss * 100, mode.name, percentile(r.latency, 0.5), percentile(r.latency, 0.9),
+				percentile(r.latency, 0.99), percentile(r.latency, 0.999), (unsigned long long)r.retransmits);
+		}
+	}
+}
+
+// fixed windows versus autotuning on paths of different bdp
+static void bench_autotune()
+{
+	const struct { const char *name; uint64_t rate; uint32_t rtt; } paths[] = {
+		{ "10 Mbit/s, 20ms rtt", 10'000'000 / 8, 20 },
+		{ "100 Mbit/s, 100ms rtt", 100'000'000 / 8, 100 },
+		{ "400 Mbit/s, 200ms rtt", 400'000'000 / 8, 200 },
+	};
+	const struct { const char *name; int wnd, autotune; uint64_t budget; } modes[] = {
+		{ "fixed 32", 32, 0, 0 },
+		{ "fixed 8192", 8192, 0, 0 },
+		{ "autotune from 32", 32, 1, 0 },
+		{ "autotune, 4 MB budget", 32, 1, 4 << 20 },
+	};
+
+	for (auto &path : paths) {
+		uint64_t bdp = path.rate * path.rtt / 1000;
+		printf("[%s, bdp %llu KB = %llu segments]\n", path.name,
+			(unsigned long long)bdp / 1024, (unsigned long long)bdp / 1376);
+		BulkOptions opt;
+		opt.forward.rate = path.rate;
+		opt.forward.delay = path.rtt / 2;
+		opt.forward.queue = (uint32_t)bdp;
+		opt.backward.delay = path.rtt / 2;
+		opt.message_size = 1376;	// one full segment
+		opt.duration = 20000;
+
+		for (auto &mode : modes) {
+			opt.wnd = mode.wnd;
+			opt.autotune = mode.autotune;
+			KCP::kcp_core::set_autotune_memory(mode.budget);
+			BulkResult r = run_bulk(opt);
+			printf("  %-24s goodput=%9.1f KB/s  snd_wnd=%5u  rcv_wnd=%5u  window memory=%6llu KB  retransmits=%6llu\n",
+				mode.name, r.goodput / 1024, r.snd_wnd, r.rcv_wnd,
+				(unsigned long long)(r.snd_wnd + r.rcv_wnd) * 1376 / 1024, (unsigned long long)r.retransmits);
+		}
+	}
+	KCP::kcp_core::set_autotune_memory(0);
+}
+
+// 10 Gbit/s, 200ms rtt: the bdp is about 180k segments, beyond the 16 bit wnd field
+static void bench_wscale()
+{
+	BulkOptions opt;
+	opt.forward.rate = 10'000'000'000 / 8;
+	opt.forward.delay = 100;
+	opt.backward.delay = 100;
+	opt.interval = 1;
+	opt.message_size = 1376;	// one full segment
+	opt.pacing = 1;
+	opt.pacing_bandwidth = opt.forward.rate;
+	opt.duration = 4000;
+	uint64_t bdp = opt.forward.rate * 200 / 1000 / 1376;
+	opt.wnd = (int)(bdp * 5 / 4);
+
+	printf("[10 Gbit/s, 200ms rtt, bdp %llu segments, windows %d]\n", (unsigned long long)bdp, opt.wnd);
+	for (uint32_t features : { (uint32_t)IKCP_FEATURE_SACK, (uint32_t)(IKCP_FEATURE_SACK | IKCP_FEATURE_WSCALE) }) {
+		opt.features = features;
+		auto start = std::chrono::steady_clock::now();
+		BulkResult r = run_bulk(opt);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		// nothing can arrive during the first rtt
+		double steady = r.goodput * opt.duration / (opt.duration - 200);
+		printf("  %-16s goodput=%7.0f MB/s (%5.2f Gbit/s after the first rtt)  retransmits=%llu  wall=%.1fs\n",
+			(features & IKCP_FEATURE_WSCALE) ? "sack + wscale" : "sack", r.goodput / 1e6, steady * 8 / 1e9,
+			(unsigned long long)r.retransmits, seconds);
+	}
+}
+
+// 4 MB messages: one send() each with IKCP_FEATURE_LARGE_MSG, versus
+// 127 fragment chunks reassembled above kcp with an extra copy
+static void bench_large()
+{
+	BulkOptions opt;
+	opt.forward.rate = 1'000'000'000 / 8;
+	opt.forward.delay = 5;
+	opt.backward.delay = 5;
+	opt.wnd = 4096;
+	opt.interval = 1;
+	const int message_size = 4 << 20, message_count = 32;
+
+	printf("[%d messages of %d KB, 1 Gbit/s, 10ms rtt]\n", message_count, message_size >> 10);
+	for (bool large : { false, true }) {
+		sim::Simulator vnet(1);
+		setup_link(vnet, opt);
+		KCP::kcp_core sender, receiver;
+		setup_endpoint(sender, opt);
+		setup_endpoint(receiver, opt);
+		vnet.attach(sender, receiver);
+		uint32_t features = IKCP_FEATURE_SACK | (large ? IKCP_FEATURE_LARGE_MSG : 0);
+		sender.set_features(features);
+		receiver.set_features(features);
+
+		std::vector<char> message(message_size, 'k'), assembled(message_size);
+		std::vector<char> buffer(large ? message_size : 1 << 18);
+		int chunk = 127 * (int)sender.mss;
+		int sent = 0, received = 0, send_calls = 0, receive_calls = 0;
+		size_t assembled_size = 0;
+		std::chrono::steady_clock::duration api_time{};
+
+		vnet.run(60000, [&](uint32_t) -> uint32_t {
+			auto start = std::chrono::steady_clock::now();
+			bool ready = !large || (sender.get_negotiated() & IKCP_FEATURE_LARGE_MSG);
+			while (ready && sent < message_count && sender.get_waitsnd() < opt.wnd * 2) {
+				if (large) {
+					if (sender.send(message.data(), message_size) < 0) break;
+					send_calls++;
+				}
+				else {
+					for (int offset = 0; offset < message_size; offset += chunk, send_calls++)
+						sender.send(message.data() + offset, std::min(chunk, message_size - offset));
+				}
+				sent++;
+			}
+			api_time += std::chrono::steady_clock::now() - start;
+
+			start = std::chrono::steady_clock::now();
+			for (int hr; (hr = receiver.receive(buffer.data(), (int)buffer.size())) > 0; receive_calls++) {
+				if (large) {
+					received++;
+					continue;
+				}
+				memcpy(assembled.data() + assembled_size, buffer.data(), hr);
+				assembled_size += hr;
+				if (assembled_size == (size_t)message_size) {
+					assembled_size = 0;
+					received++;
+				}
+			}
+			api_time += std::chrono::steady_clock::now() - start;
+			return received < message_count ? 1 : sim::Simulator::stop;
+		});
+
+		uint32_t now = vnet.now();
+		double mb = (double)message_size * received / (1 << 20);
+		printf("  %-22s %3d messages in %5u ms  %6.1f MB/s  send()=%5d  receive()=%5d  send/receive cpu=%6.2f ms\n",
+			large ? "large messages" : "127 fragment chunks", received, now, mb * 1000 / now,
+			send_calls, receive_calls, std::chrono::duration<double, std::milli>(api_time).count());
+	}
+
+	KCP::kcp_core legacy;
+	legacy.initialise(1, nullptr);
+	std::vector<char> message(message_size);
+	printf("  send() of %d KB without the feature returns %d\n", message_size >> 10, legacy.send(message.data(), message_size));
+}
+
+// session counters under loss, and the cost of taking a snapshot
+static void bench_stats()
+{
+	BulkOptions opt;
+	opt.forward.rate = 10'000'000 / 8;
+	opt.forward.delay = 25;
+	opt.backward.delay = 25;
+	opt.rack = 1;
+	opt.tlp = 1;
+
+	printf("[10 Mbit/s, 50ms rtt, sender / receiver counters]\n");
+	for (double loss : { 0.0, 0.02, 0.10 }) {
+		opt.forward.loss = loss;
+		opt.backward.loss = loss;
+		BulkResult r = run_bulk(opt);
+		const KCP::session_stats &s = r.sender_stats, &v = r.receiver_stats;
+		printf("  loss %2.0f%%  sent=%6llu  rto=%5llu fast=%5llu rack=%5llu tlp=%4llu  acks in=%6llu  "
+			"rtt min/avg/max=%llu/%llu/%llu\n",
+			loss * 100, (unsigned long long)s.segments_sent, (unsigned long long)s.retransmits_rto,
+			(unsigned long long)s.retransmits_fast, (unsigned long long)s.retransmits_rack,
+			(unsigned long long)s.retransmits_tlp, (unsigned long long)s.acks_received,
+			(unsigned long long)s.rtt_min, (unsigned long long)s.rtt_avg(), (unsigned long long)s.rtt_max);
+		printf("             received=%6llu  duplicates=%5llu  out-of-window=%5llu  acks out=%6llu  wire in=%llu KB\n",
+			(unsigned long long)v.segments_received, (unsigned long long)v.duplicates,
+			(unsigned long long)v.out_of_window, (unsigned long long)v.acks_sent,
+			(unsigned long long)(v.wire_bytes_received >> 10));
+	}
+
+	KCP::kcp_core kcp;
+	kcp.initialise(1, nullptr);
+	const int rounds = 1'000'000;
+	uint64_t sum = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < rounds; i++)
+		sum += kcp.get_stats().segments_sent;
+	double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+	printf("  get_stats(): %.1f ns per snapshot (%llu)\n", ns / rounds, (unsigned long long)sum);
+}
+
+// stalled receivers with and without memory caps, and a duplicate flood
+static void bench_memory()
+{
+	const int clients = 8, stalled = 2;
+	const uint32_t stall_until = 10000, duration = 20000;
+	auto mb = [](uint64_t bytes) { return bytes / 1048576.0; };
+
+	printf("[%d clients send 16 KB every 10ms over 10 Mbit/s links, %d receivers stall for %us]\n",
+		clients, stalled, stall_until / 1000);
+	for (bool capped : { false, true }) {
+		KCP::kcp_core::set_memory_budget(capped ? 24 << 20 : 0);
+		std::vector<std::unique_ptr<sim::Simulator>> nets;
+		std::vector<std::unique_ptr<KCP::kcp_core>> senders, receivers;
+		BulkOptions opt;
+		opt.forward.rate = 10'000'000 / 8;
+		opt.forward.delay = 25;
+		opt.backward.delay = 25;
+		for (int i = 0; i < clients; i++) {
+			nets.push_back(std::make_unique<sim::Simulator>(i + 1));
+			senders.push_back(std::make_unique<KCP::kcp_core>());
+			receivers.push_back(std::make_unique<KCP::kcp_core>());
+			setup_link(*nets[i], opt);
+			setup_endpoint(*senders[i], opt);
+			setup_endpoint(*receivers[i], opt);
+			nets[i]->attach(*senders[i], *receivers[i]);
+			if (capped) {
+				senders[i]->set_memory_limit(2 << 20);
+				receivers[i]->set_memory_limit(256 << 10);
+			}
+		}
+
+		// the clients share the budget, so their simulators advance in lockstep
+		std::vector<char> message(16 << 10, 'k'), buffer(1 << 17);
+		uint64_t peak = 0, refused = 0, delivered = 0;
+		for (uint32_t tick = 1; tick <= duration; tick++) {
+			for (int i = 0; i < clients; i++) {
+				KCP::kcp_core &sender = *senders[i], &receiver = *receivers[i];
+				nets[i]->run(tick, [&](uint32_t now) -> uint32_t {
+					if (now % 10 == 0 && sender.send(message.data(), (int)message.size()) < 0)
+						refused++;
+					if (i >= stalled || now >= stall_until)
+						for (int hr; (hr = receiver.receive(buffer.data(), (int)buffer.size())) > 0; )
+							delivered += hr;
+					return 1;
+				});
+			}
+			peak = std::max(peak, KCP::kcp_core::get_memory_used());
+		}
+
+		KCP::memory_usage tx = senders[0]->get_memory(), rx = receivers[0]->get_memory();
+		printf("  %-8s peak=%7.1f MB  end=%7.1f MB  delivered=%7.1f MB  send() refused=%7llu  data dropped=%6llu\n",
+			capped ? "capped" : "no caps", mb(peak), mb(KCP::kcp_core::get_memory_used()), mb(delivered),
+			(unsigned long long)refused, (unsigned long long)receivers[0]->get_stats().over_budget);
+		printf("           client 0 at the end: snd_queue=%.1f snd_buf=%.1f  rcv_buf=%.1f rcv_queue=%.1f MB\n",
+			mb(tx.snd_queue), mb(tx.snd_buf), mb(rx.rcv_buf), mb(rx.rcv_queue));
+	}
+	KCP::kcp_core::set_memory_budget(0);
+
+	// the same datagram input 100000 times between two flushes
+	KCP::kcp_core sender, receiver;
+	sender.initialise(1, nullptr);
+	receiver.initialise(1, nullptr);
+	std::vector<std::vector<char>> datagrams;
+	sender.set_output([&](const char *buf, int len, void *) { datagrams.emplace_back(buf, buf + len); return 0; });
+	receiver.set_output([](const char *, int, void *) { return 0; });
+	sender.update(1);
+	receiver.update(1);
+	std::vector<char> message(1000, 'k');
+	sender.send(message.data(), (int)message.size());
+	sender.flush(2);
+	for (int i = 0; i < 100000; i++)
+		receiver.input(datagrams[0].data(), (long)datagrams[0].size());
+	printf("[duplicate flood] 100000 copies of one push: acklist holds %zu entries, %llu bytes\n",
+		receiver.acklist.size(), (unsigned long long)receiver.get_memory().acklist);
+}
+
+// a producer that writes whenever it may: gated by snd_queue segments
+// against snd_wnd (the old WaitQueueIsFull) or by the byte watermarks and
+// IKCP_EVENT_WRITABLE. 10 Mbit/s, 50ms rtt, 64 KB router queue
+static void bench_backpressure()
+{
+	const uint32_t duration = 20000;
+	const uint64_t high = 128 << 10, low = 64 << 10;	// about two and one bdp
+	struct Case { const char *name; int message_size; int stream; };
+	const Case cases[] = { { "100 B messages", 100, 0 }, { "16 KB messages", 16 << 10, 0 }, { "stream, 100 B writes", 100, 1 } };
+
+	printf("[10 Mbit/s, 50ms rtt, wnd 256, watermarks high=%llu KB low=%llu KB]\n",
+		(unsigned long long)(high >> 10), (unsigned long long)(low >> 10));
+	for (const Case &c : cases) {
+		for (bool bytes : { false, true }) {
+			BulkOptions opt;
+			opt.forward.rate = 10'000'000 / 8;
+			opt.forward.delay = 25;
+			opt.forward.queue = 64 << 10;
+			opt.backward.delay = 25;
+			opt.nc = 0;
+			sim::Simulator vnet(1);
+			setup_link(vnet, opt);
+			KCP::kcp_core sender, receiver;
+			setup_endpoint(sender, opt);
+			setup_endpoint(receiver, opt);
+			vnet.attach(sender, receiver);
+			sender.stream = c.stream;
+			receiver.stream = c.stream;
+			sender.set_latency_tracking(true);
+			if (bytes)
+				sender.set_snd_bytes_watermarks(high, low);
+
+			std::vector<char> message(c.message_size, 'k'), buffer(1 << 17);
+			uint64_t received = 0, peak = 0, writes = 0;
+			bool writable = true;
+			vnet.run(duration, [&](uint32_t) -> uint32_t {
+				if (bytes) {
+					if (sender.take_events() & IKCP_EVENT_WRITABLE)
+						writable = true;
+					while (writable) {
+						int hr = sender.send(message.data(), (int)message.size());
+						if (hr == -4 || (hr >= 0 && hr < c.message_size))
+							writable = false;
+						writes++;
+					}
+				}
+				else {
+					while (sender.snd_queue.size() < sender.snd_wnd) {
+						sender.send(message.data(), (int)message.size());
+						writes++;
+					}
+				}
+				peak = std::max(peak, sender.get_snd_bytes());
+
+				for (int hr; (hr = receiver.receive(buffer.data(), (int)buffer.size())) > 0; )
+					received += hr;
+				return 1;
+			});
+
+			// a stream has no message boundaries to time
+			char acked[64] = "";
+			if (!c.stream) {
+				KCP::message_latency latency = sender.get_latency();
+				snprintf(acked, sizeof(acked), "  send-to-ack p50=%5u p99=%5u ms",
+					latency.ack_latency.percentile(50), latency.ack_latency.percentile(99));
+			}
+			printf("  %-22s %-9s goodput=%7.1f KB/s  peak queued=%7.1f KB  writes=%7llu%s\n",
+				c.name, bytes ? "bytes" : "segments", received * 1000.0 / duration / 1024, peak / 1024.0,
+				(unsigned long long)writes, acked);
+		}
+	}
+}
+
+// 100 byte control messages every 20ms next to a bulk transfer of 64 KB
+// messages: all on stream 0, on two streams of equal priority, and with
+// the control stream first. 10 Mbit/s, 50ms rtt, 2% loss
+static void bench_streams()
+{
+	const uint32_t duration = 20000;
+	const int bulk_size = 64 << 10, control_size = 100;
+	struct Case { const char *name; bool streams; uint32_t control_priority; };
+	const Case cases[] = { { "one stream", false, 0 }, { "streams, equal", true, 1 }, { "streams, control first", true, 0 } };
+
+	printf("[control: %d B every 20ms, bulk: %d KB messages, 10 Mbit/s, 50ms rtt, 2%% loss]\n", control_size, bulk_size >> 10);
+	for (const Case &c : cases) {
+		BulkOptions opt;
+		opt.forward.rate = 10'000'000 / 8;
+		opt.forward.delay = 25;
+		opt.forward.queue = 64 << 10;
+		opt.forward.loss = 0.02;
+		opt.backward.delay = 25;
+		opt.backward.loss = 0.02;
+		opt.wnd = 128;
+		sim::Simulator vnet(1);
+		setup_link(vnet, opt);
+		KCP::kcp_core sender, receiver;
+		setup_endpoint(sender, opt);
+		setup_endpoint(receiver, opt);
+		vnet.attach(sender, receiver);
+		uint32_t features = IKCP_FEATURE_SACK | (c.streams ? IKCP_FEATURE_STREAMS : 0);
+		sender.set_features(features);
+		receiver.set_features(features);
+		const uint32_t control = 0, bulk = c.streams ? 1 : 0;
+		sender.set_stream_priority(control, c.control_priority, 1);
+		sender.set_stream_priority(bulk, 1, 1);
+
+		// control: sequence number and send time, bulk: its index in every byte
+		std::vector<char> message(bulk_size), buffer(bulk_size);
+		std::vector<uint32_t> latency;
+		uint32_t control_sent = 0, control_next = 0, bulk_sent = 0, bulk_next = 0, errors = 0;
+		uint64_t bulk_bytes = 0;
+		vnet.run(duration, [&](uint32_t now) -> uint32_t {
+			bool ready = !c.streams || (sender.get_negotiated() & IKCP_FEATURE_STREAMS);
+			if (ready && now % 20 == 0) {
+				uint32_t header[2] = { control_sent++, now };
+				memcpy(message.data(), header, sizeof(header));
+				sender.send_stream(control, message.data(), control_size);
+			}
+			while (ready && sender.get_waitsnd() < opt.wnd * 2) {
+				memset(message.data(), (char)bulk_sent++, bulk_size);
+				sender.send_stream(bulk, message.data(), bulk_size);
+			}
+
+			for (int id; (id = receiver.peek_stream()) >= 0; ) {
+				int hr = receiver.receive_stream((uint32_t)id, buffer.data(), (int)buffer.size());
+				if (hr == control_size) {
+					uint32_t header[2];
+					memcpy(header, buffer.data(), sizeof(header));
+					errors += header[0] != control_next++;
+					latency.push_back(now - header[1]);
+				}
+				else {
+					errors += hr != bulk_size || buffer[0] != (char)bulk_next || buffer[hr - 1] != (char)bulk_next;
+					bulk_next++;
+					bulk_bytes += hr;
+				}
+			}
+			return 1;
+		});
+
+		printf("  %-24s control latency p50=%4u p99=%4u max=%4u ms  bulk=%6.1f KB/s  order errors=%u\n",
+			c.name, percentile(latency, 0.5), percentile(latency, 0.99), percentile(latency, 1.0),
+			bulk_bytes * 1000.0 / duration / 1024, errors);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	std::string name = argc > 1 ? argv[1] : "pacing";
+
+	if (name == "pacing") bench_pacing();
+	else if (name == "cc") bench_cc();
+	else if (name == "sack") bench_sack();
+	else if (name == "ack") bench_ack();
+	else if (name == "compact") bench_compact();
+	else if (name == "fec") bench_fec();
+	else if (name == "rack") bench_rack();
+	else if (name == "autotune") bench_autotune();
+	else if (name == "wscale") bench_wscale();
+	else if (name == "large") bench_large();
+	else if (name == "stats") bench_stats();
+	else if (name == "memory") bench_memory();
+	else if (name == "backpressure") bench_backpressure();
+	else if (name == "streams") bench_streams();
+	else {
+		printf("usage: %s pacing|cc|sack|ack|compact|fec|rack|autotune|wscale|large|stats|memory|backpressure|streams\n", argv[0]);
+		return 1;
+	}
+
+	return 0;
+}
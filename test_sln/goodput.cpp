@@ -0,0 +1,132 @@
+//=====================================================================
+//
+// goodput.cpp - bulk transfer grid on the virtual-time simulator
+//
+// build:
+// g++ -std=c++17 -O2 goodput.cpp ../ikcp.cpp ../ikcp_congestion.cpp ../ikcp_fec.cpp -o goodput
+//
+// usage:
+// ./goodput [megabytes=100] [bottleneck mbit/s=100, 0: none] [seed=1] > goodput.csv
+//
+// Transfers a fixed volume from one kcp_core to another for every
+// combination of nodelay profile, window, rtt and random loss, and
+// prints one csv row per run:
+//
+//   goodput_mbit    payload delivered per virtual second
+//   retrans_ratio   retransmitted / first transmissions of data segments
+//   wire_overhead   datagram bytes of both directions / payload bytes
+//   cpu_ms_per_mb   process cpu time of the run per MB of payload
+//
+// A run that has not finished after an hour of virtual time reports
+// complete=0 and the goodput reached so far.
+//
+//=====================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "simulator.h"
+
+
+struct Profile
+{
+	const char *name;
+	int nodelay, interval, resend, nc;
+	int minrto;		// 0: keep the default
+};
+
+static const Profile profiles[] = {
+	{ "default", 0, 10, 0, 0, 0 },
+	{ "normal", 0, 10, 0, 1, 0 },
+	{ "fast", 1, 10, 2, 1, 0 },
+	{ "fast2", 2, 10, 2, 1, 10 },
+};
+
+static const int windows[] = { 32, 128, 512, 2048 };
+static const uint32_t rtts[] = { 20, 100, 300 };
+static const double losses[] = { 0.0, 0.01, 0.05, 0.10 };
+
+static const uint32_t deadline = 3600 * 1000;	// virtual millisec
+
+struct Grid
+{
+	uint64_t volume;		// bytes
+	uint64_t rate;			// bytes per second, 0: no bottleneck
+	uint64_t seed;
+};
+
+static void run(const Grid &grid, const Profile &profile, int wnd, uint32_t rtt, double loss)
+{
+	sim::Simulator vnet(grid.seed);
+	for (int side = 0; side < 2; side++) {
+		if (grid.rate > 0) {
+			// queue of one bdp, at least 64 KB
+			uint64_t queue = std::max<uint64_t>(grid.rate * rtt / 1000, 64 * 1024);
+			vnet.path(side).add<sim::RateLimit>(grid.rate, queue);
+		}
+		if (loss > 0)
+			vnet.path(side).add<sim::RandomLoss>(loss);
+		vnet.path(side).add<sim::Delay>(rtt / 2, rtt / 2);
+	}
+
+	KCP::kcp_core sender, receiver;
+	sender.initialise(0x11223344, nullptr);
+	receiver.initialise(0x11223344, nullptr);
+	vnet.attach(sender, receiver);
+	for (KCP::kcp_core *kcp : { &sender, &receiver }) {
+		kcp->set_nodelay(profile.nodelay, profile.interval, profile.resend, profile.nc);
+		kcp->set_wndsize(wnd, wnd);
+		if (profile.minrto > 0)
+			kcp->rx_minrto = profile.minrto;
+	}
+
+	std::vector<char> message(sender.mss, 'k');
+	std::vector<char> buffer(sender.mss);
+	uint64_t queued = 0, received = 0;
+
+	clock_t start = clock();
+	bool complete = vnet.run(deadline, [&](uint32_t) -> uint32_t {
+		while (queued < grid.volume && sender.get_waitsnd() < wnd * 2) {
+			int size = (int)std::min<uint64_t>(message.size(), grid.volume - queued);
+			sender.send(message.data(), size);
+			queued += size;
+		}
+		for (int hr; (hr = receiver.receive(buffer.data(), (int)buffer.size())) > 0; )
+			received += hr;
+		return received >= grid.volume ? sim::Simulator::stop : (uint32_t)profile.interval;
+	});
+	double cpu_ms = (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+
+	KCP::session_stats tx = sender.get_stats(), rx = receiver.get_stats();
+	double seconds = (vnet.now() - 1) / 1000.0;
+	double megabytes = received / 1048576.0;
+	printf("%s,%d,%u,%.2f,%.0f,%.0f,%d,%.3f,%.3f,%.4f,%.4f,%.2f\n",
+		profile.name, wnd, rtt, loss, grid.rate * 8 / 1e6, grid.volume / 1048576.0,
+		complete ? 1 : 0, seconds,
+		seconds > 0 ? received * 8 / seconds / 1e6 : 0.0,
+		tx.segments_sent > 0 ? (double)tx.retransmits() / tx.segments_sent : 0.0,
+		received > 0 ? (double)(tx.wire_bytes_sent + rx.wire_bytes_sent) / received : 0.0,
+		megabytes > 0 ? cpu_ms / megabytes : 0.0);
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	Grid grid;
+	grid.volume = (uint64_t)((argc > 1 ? atof(argv[1]) : 100) * 1048576);
+	grid.rate = (uint64_t)((argc > 2 ? atof(argv[2]) : 100) * 1e6 / 8);
+	grid.seed = argc > 3 ? strtoull(argv[3], NULL, 10) : 1;
+
+	printf("profile,wnd,rtt_ms,loss,rate_mbit,megabytes,complete,seconds,goodput_mbit,retrans_ratio,wire_overhead,cpu_ms_per_mb\n");
+	for (const Profile &profile : profiles)
+		for (int wnd : windows)
+			for (uint32_t rtt : rtts)
+				for (double loss : losses)
+					run(grid, profile, wnd, rtt, loss);
+
+	return 0;
+}
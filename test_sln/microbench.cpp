@@ -0,0 +1,468 @@
+//=====================================================================
+//
+// microbench.cpp - microbenchmarks of the kcp_core hot paths
+//
+// build (linux):
+// g++ -std=c++17 -O2 microbench.cpp ../ikcp.cpp ../ikcp_congestion.cpp ../ikcp_fec.cpp -o microbench
+//
+// usage:
+// ./microbench            run every case
+// ./microbench flush      only the cases whose name contains "flush"
+//
+// Log branches follow IKCP_ENABLE_LOG (on unless NDEBUG), compare
+// builds with -DIKCP_ENABLE_LOG=0 and =1 to see what they cost; the
+// "logged" cases run with every IKCP_LOG_* bit set when compiled in.
+//
+// Each case reports the time per call, the segments handled per second
+// and the operator new calls per call, all measured around the timed
+// region only. Sessions run in nodelay mode without congestion control
+// on a fixed clock, datagrams are captured into preallocated storage.
+//
+//=====================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../ikcp.hpp"
+
+
+//---------------------------------------------------------------------
+// allocation counter
+//---------------------------------------------------------------------
+static uint64_t allocations = 0;
+
+void* operator new(size_t size)
+{
+	allocations++;
+	if (void *ptr = malloc(size > 0 ? size : 1))
+		return ptr;
+	throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void *ptr) noexcept { free(ptr); }
+void operator delete[](void *ptr) noexcept { free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { free(ptr); }
+
+
+//---------------------------------------------------------------------
+// output of every session, appended to reserved storage so the
+// callback does not allocate inside a timed region
+//---------------------------------------------------------------------
+using Datagrams = std::vector<std::vector<char>>;
+
+struct PacketSink
+{
+	std::vector<char> data;
+	std::vector<std::pair<size_t, int>> packets;	// offset, size
+
+	PacketSink()
+	{
+		data.reserve(32 << 20);
+		packets.reserve(1 << 16);
+	}
+
+	void clear()
+	{
+		data.clear();
+		packets.clear();
+	}
+
+	void push(const char *buf, int len)
+	{
+		packets.push_back({ data.size(), len });
+		data.insert(data.end(), buf, buf + len);
+	}
+
+	Datagrams take()
+	{
+		Datagrams result;
+		for (auto [offset, size] : packets)
+			result.emplace_back(data.begin() + offset, data.begin() + offset + size);
+		clear();
+		return result;
+	}
+};
+
+static PacketSink sink;
+static volatile uint64_t keep_alive;	// results the optimiser must not drop
+
+static std::unique_ptr<KCP::kcp_core> make_session(uint32_t wnd)
+{
+	auto kcp = std::make_unique<KCP::kcp_core>();
+	kcp->initialise(0x11223344, nullptr);
+	kcp->set_output([](const char *buf, int len, void *) { sink.push(buf, len); return 0; });
+	kcp->set_nodelay(1, 10, 1, 1);
+	kcp->set_wndsize(wnd, wnd);
+	kcp->rmt_wnd = wnd;		// as if the remote side had advertised it
+	kcp->update(1);
+	sink.clear();
+	return kcp;
+}
+
+// queue 'count' messages and send them at t=2
+static void send_messages(KCP::kcp_core &kcp, uint32_t count, int size)
+{
+	std::vector<char> message(size, 'k');
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (kcp.send(message.data(), size) < 0)
+		{
+			printf("send() of %d bytes failed\n", size);
+			exit(1);
+		}
+	}
+	kcp.flush(2);
+}
+
+// datagrams of a sender with 'count' messages in flight
+static Datagrams push_datagrams(uint32_t count, int size, uint32_t wnd)
+{
+	auto sender = make_session(wnd);
+	send_messages(*sender, count, size);
+	return sink.take();
+}
+
+// acknowledgements for the datagrams marked in 'keep'
+static Datagrams ack_datagrams(const Datagrams &pushes, const std::vector<bool> &keep, uint32_t wnd)
+{
+	auto receiver = make_session(wnd);
+	for (size_t i = 0; i < pushes.size(); i++)
+		if (keep[i])
+			receiver->input(pushes[i].data(), (long)pushes[i].size());
+	sink.clear();
+	receiver->flush(3);
+	return sink.take();
+}
+
+static uint32_t input_all(KCP::kcp_core &kcp, const Datagrams &datagrams)
+{
+	for (auto &datagram : datagrams)
+		kcp.input(datagram.data(), (long)datagram.size());
+	return (uint32_t)datagrams.size();
+}
+
+
+//---------------------------------------------------------------------
+// case runner: setup() is not timed, run() reports what it did. A case
+// runs for 200ms of timed calls or 1s including setup, at least 5 rounds
+//---------------------------------------------------------------------
+struct Done
+{
+	uint64_t ops;
+	uint64_t packets;	// segments sent, parsed or reassembled
+};
+
+static std::string filter;
+
+static void run_case(const std::string &name, const std::function<void()> &setup, const std::function<Done()> &run)
+{
+	if (!filter.empty() && name.find(filter) == std::string::npos)
+		return;
+
+	std::chrono::steady_clock::duration total{};
+	uint64_t ops = 0, packets = 0, allocs = 0;
+	auto wall = std::chrono::steady_clock::now();
+	for (int round = 0; round < 5 || (total < std::chrono::milliseconds(200) &&
+		std::chrono::steady_clock::now() - wall < std::chrono::seconds(1)); round++)
+	{
+		setup();
+		uint64_t before = allocations;
+		auto start = std::chrono::steady_clock::now();
+		Done done = run();
+		total += std::chrono::steady_clock::now() - start;
+		allocs += allocations - before;
+		ops += done.ops;
+		packets += done.packets;
+	}
+
+	double ns = std::chrono::duration<double, std::nano>(total).count();
+	printf("%-34s %10.1f ns/op  %12.0f pkts/s  %8.2f allocs/op\n", name.c_str(),
+		ns / ops, packets > 0 ? packets * 1e9 / ns : 0.0, (double)allocs / ops);
+}
+
+
+//---------------------------------------------------------------------
+// cases
+//---------------------------------------------------------------------
+static const uint32_t windows[] = { 32, 256, 1024 };
+
+// fragmentation into snd_queue
+static void bench_send()
+{
+	std::unique_ptr<KCP::kcp_core> kcp;
+	for (int size : { 64, 1024, 16 << 10, 128 << 10 })
+	{
+		const int calls = 256;
+		std::vector<char> message(size, 'k');
+		kcp = make_session(1024);
+		uint64_t fragments = (size + kcp->mss - 1) / kcp->mss;
+		run_case("send " + std::to_string(size) + "B",
+			[&] { kcp->snd_queue.clear(); },
+			[&] {
+				for (int i = 0; i < calls; i++)
+					kcp->send(message.data(), size);
+				return Done{ calls, calls * fragments };
+			});
+	}
+}
+
+// PUSH parsing in order, in reverse order and packed, then ACK parsing
+static void bench_input()
+{
+	std::unique_ptr<KCP::kcp_core> kcp;
+	for (uint32_t wnd : windows)
+	{
+		std::string suffix = " wnd " + std::to_string(wnd);
+		Datagrams pushes = push_datagrams(wnd, 1024, wnd);
+		Datagrams reversed(pushes.rbegin(), pushes.rend());
+		Datagrams packed = push_datagrams(wnd, 64, wnd);
+		Datagrams acks = ack_datagrams(pushes, std::vector<bool>(pushes.size(), true), wnd);
+
+		run_case("input push 1024B" + suffix,
+			[&] { kcp = make_session(wnd); },
+			[&] { return Done{ input_all(*kcp, pushes), wnd }; });
+
+		run_case("input push reversed" + suffix,
+			[&] { kcp = make_session(wnd); },
+			[&] { return Done{ input_all(*kcp, reversed), wnd }; });
+
+		run_case("input push 64B" + suffix,
+			[&] { kcp = make_session(wnd); },
+			[&] { return Done{ input_all(*kcp, packed), wnd }; });
+
+		run_case("input ack" + suffix,
+			[&] { kcp = make_session(wnd); send_messages(*kcp, wnd, 1024); sink.clear(); },
+			[&] { return Done{ input_all(*kcp, acks), wnd }; });
+	}
+}
+
+// new data, nothing due, fast retransmit after loss, retransmit on timeout
+static void bench_flush()
+{
+	std::unique_ptr<KCP::kcp_core> kcp;
+	std::mt19937 rng(1);
+	for (uint32_t wnd : windows)
+	{
+		std::string suffix = " wnd " + std::to_string(wnd);
+		Datagrams pushes = push_datagrams(wnd, 1024, wnd);
+
+		run_case("flush new" + suffix,
+			[&] {
+				kcp = make_session(wnd);
+				std::vector<char> message(1024, 'k');
+				for (uint32_t i = 0; i < wnd; i++)
+					kcp->send(message.data(), (int)message.size());
+				sink.clear();
+			},
+			[&] { kcp->flush(2); return Done{ 1, wnd }; });
+
+		run_case("flush idle" + suffix,
+			[&] { kcp = make_session(wnd); send_messages(*kcp, wnd, 1024); sink.clear(); },
+			[&] {
+				for (uint32_t i = 0; i < 100; i++)
+					kcp->flush(3 + i);
+				return Done{ 100, 0 };
+			});
+
+		const struct { const char *name; double loss; bool burst; } patterns[] = {
+			{ "random 1%", 0.01, false },
+			{ "random 10%", 0.10, false },
+			{ "burst 10%", 0.10, true },
+		};
+		for (auto &pattern : patterns)
+		{
+			std::vector<bool> keep(pushes.size(), true);
+			std::bernoulli_distribution lost(pattern.loss);
+			for (size_t i = 0; i < keep.size(); i++)
+			{
+				if (pattern.burst)
+					keep[i] = i < keep.size() / 4 || i >= keep.size() / 4 + (size_t)(keep.size() * pattern.loss);
+				else
+					keep[i] = !lost(rng);
+			}
+			if (std::find(keep.begin(), keep.end(), false) == keep.end())
+				keep[keep.size() / 2] = false;
+			keep.back() = true;	// the newest ack exposes every hole to fast retransmit
+			Datagrams acks = ack_datagrams(pushes, keep, wnd);
+
+			run_case(std::string("flush loss ") + pattern.name + suffix,
+				[&] {
+					kcp = make_session(wnd);
+					send_messages(*kcp, wnd, 1024);
+					input_all(*kcp, acks);
+					sink.clear();
+				},
+				[&] { kcp->flush(4); return Done{ 1, sink.packets.size() }; });
+		}
+
+		run_case("flush timeout" + suffix,
+			[&] { kcp = make_session(wnd); send_messages(*kcp, wnd, 1024); sink.clear(); },
+			[&] { kcp->flush(1000); return Done{ 1, sink.packets.size() }; });
+	}
+}
+
+// merging fragments out of rcv_queue
+static void bench_receive()
+{
+	std::unique_ptr<KCP::kcp_core> kcp = make_session(32);
+	const uint32_t mss = kcp->mss;
+	std::vector<char> buffer(mss * 128);
+	for (uint32_t fragments : { 1, 16, 127 })
+	{
+		uint32_t messages = std::max(1u, 1024 / fragments);
+		uint32_t wnd = messages * fragments;
+		Datagrams pushes = push_datagrams(messages, fragments * mss, wnd);
+
+		run_case("receive " + std::to_string(fragments) + " fragments",
+			[&] { kcp = make_session(wnd); input_all(*kcp, pushes); },
+			[&] {
+				uint64_t count = 0;
+				while (kcp->receive(buffer.data(), (int)buffer.size()) > 0)
+					count++;
+				return Done{ count, count * fragments };
+			});
+	}
+}
+
+// per-message latency tracking on: histogram record, and the send / ack
+// paths that feed it
+static void bench_latency()
+{
+	KCP::latency_recorder recorder;
+	run_case("latency record",
+		[] {},
+		[&] {
+			for (uint32_t i = 0; i < 1000; i++)
+				recorder.record(i * 37);
+			return Done{ 1000, 0 };
+		});
+
+	std::unique_ptr<KCP::kcp_core> kcp;
+	const uint32_t wnd = 256;
+	Datagrams pushes = push_datagrams(wnd, 1024, wnd);
+	Datagrams acks = ack_datagrams(pushes, std::vector<bool>(pushes.size(), true), wnd);
+
+	run_case("flush new wnd 256 latency",
+		[&] {
+			kcp = make_session(wnd);
+			kcp->set_latency_tracking(true);
+			std::vector<char> message(1024, 'k');
+			for (uint32_t i = 0; i < wnd; i++)
+				kcp->send(message.data(), (int)message.size());
+			sink.clear();
+		},
+		[&] { kcp->flush(2); return Done{ 1, wnd }; });
+
+	run_case("input ack wnd 256 latency",
+		[&] {
+			kcp = make_session(wnd);
+			kcp->set_latency_tracking(true);
+			send_messages(*kcp, wnd, 1024);
+			sink.clear();
+		},
+		[&] { return Done{ input_all(*kcp, acks), wnd }; });
+}
+
+// the same work with ikcp_log writing every event to a no-op sink
+static void bench_log()
+{
+	if (!KCP::kcp_core::log_enabled)
+		return;
+
+	std::unique_ptr<KCP::kcp_core> kcp;
+	const uint32_t wnd = 256;
+	Datagrams pushes = push_datagrams(wnd, 1024, wnd);
+	auto enable_log = [](KCP::kcp_core &kcp) {
+		kcp.logmask = 0xffff;
+		kcp.writelog = [](const char *log, void *) { keep_alive = keep_alive + (uint8_t)log[0]; };
+	};
+
+	run_case("input push 1024B wnd 256 logged",
+		[&] { kcp = make_session(wnd); enable_log(*kcp); },
+		[&] { return Done{ input_all(*kcp, pushes), wnd }; });
+}
+
+// binary tracing: one record, and flush / input with every event traced
+static void bench_trace()
+{
+	auto ring = std::make_shared<KCP::trace_ring>(1 << 16);
+	KCP::trace_record rec = {};
+	run_case("trace record",
+		[] {},
+		[&] {
+			for (uint32_t i = 0; i < 1000; i++)
+			{
+				rec.sn = i;
+				ring->record(rec);
+			}
+			return Done{ 1000, 0 };
+		});
+
+	std::unique_ptr<KCP::kcp_core> kcp;
+	const uint32_t wnd = 256;
+	Datagrams pushes = push_datagrams(wnd, 1024, wnd);
+
+	run_case("flush new wnd 256 traced",
+		[&] {
+			kcp = make_session(wnd);
+			kcp->set_trace(ring);
+			std::vector<char> message(1024, 'k');
+			for (uint32_t i = 0; i < wnd; i++)
+				kcp->send(message.data(), (int)message.size());
+			sink.clear();
+		},
+		[&] { kcp->flush(2); return Done{ 1, wnd }; });
+
+	run_case("input push 1024B wnd 256 traced",
+		[&] { kcp = make_session(wnd); kcp->set_trace(ring); },
+		[&] { return Done{ input_all(*kcp, pushes), wnd }; });
+}
+
+static void bench_check()
+{
+	std::unique_ptr<KCP::kcp_core> kcp;
+	for (uint32_t wnd : windows)
+	{
+		run_case("check wnd " + std::to_string(wnd),
+			[&] { kcp = make_session(wnd); send_messages(*kcp, wnd, 1024); sink.clear(); },
+			[&] {
+				uint64_t sum = 0;
+				for (uint32_t i = 0; i < 1000; i++)
+					sum += kcp->check(3 + (i & 7));
+				keep_alive = sum;
+				return Done{ 1000, 0 };
+			});
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1)
+		filter = argv[1];
+
+	printf("log branches %s (IKCP_ENABLE_LOG=%d)\n",
+		KCP::kcp_core::log_enabled ? "compiled in" : "removed", IKCP_ENABLE_LOG);
+
+	bench_send();
+	bench_input();
+	bench_flush();
+	bench_receive();
+	bench_check();
+	bench_latency();
+	bench_log();
+	bench_trace();
+
+	return 0;
+}
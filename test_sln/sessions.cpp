@@ -0,0 +1,295 @@
+//=====================================================================
+//
+// sessions.cpp - cost of many KCP::KCP sessions in one process
+//
+// build (linux):
+// g++ -std=c++17 -O2 sessions.cpp ../kcp.cpp ../ikcp.cpp ../ikcp_congestion.cpp ../ikcp_fec.cpp -o sessions -pthread
+//
+// usage:
+// ./sessions [sessions...]      default: 1000 10000 100000
+//
+// N sessions in nodelay mode (interval 10ms) on a virtual clock, 1% of
+// them send a 200 byte message every tick to a peer that acknowledges,
+// the rest stay idle. Per N it reports:
+//
+//   memory     live heap bytes and resident bytes per session
+//   update     Update() on every session each tick
+//   check      Check() on every session each tick
+//   scheduled  Update() only for sessions whose Check() time is due or
+//              that received a datagram, kept in a min-heap
+//
+// with the time per tick and per session and operator new calls per
+// tick. Peers and datagram delivery are outside the timed sweeps.
+//
+//=====================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <new>
+#include <queue>
+#include <vector>
+
+#include "../kcp.hpp"
+
+
+//---------------------------------------------------------------------
+// allocation counter and live heap bytes
+//---------------------------------------------------------------------
+static uint64_t allocations = 0;
+static int64_t heap_bytes = 0;
+
+void* operator new(size_t size)
+{
+	void *ptr = malloc(size > 0 ? size : 1);
+	if (ptr == nullptr)
+		throw std::bad_alloc();
+	allocations++;
+	heap_bytes += malloc_usable_size(ptr);
+	return ptr;
+}
+
+void* operator new[](size_t size) { return operator new(size); }
+
+void operator delete(void *ptr) noexcept
+{
+	if (ptr == nullptr)
+		return;
+	heap_bytes -= malloc_usable_size(ptr);
+	free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept { operator delete(ptr); }
+void operator delete(void *ptr, size_t) noexcept { operator delete(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { operator delete(ptr); }
+
+static int64_t resident_bytes()
+{
+	long pages = 0, resident = 0;
+	if (FILE *statm = fopen("/proc/self/statm", "r")) {
+		if (fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+			resident = 0;
+		fclose(statm);
+	}
+	return (int64_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+
+//---------------------------------------------------------------------
+// datagrams written during a tick, delivered after the timed sweep
+//---------------------------------------------------------------------
+struct Outbox
+{
+	struct Datagram
+	{
+		uint32_t session;
+		bool from_peer;
+		size_t offset;
+		int size;
+	};
+
+	std::vector<char> data;
+	std::vector<Datagram> datagrams;
+
+	Outbox()
+	{
+		data.reserve(16 << 20);
+		datagrams.reserve(1 << 16);
+	}
+
+	void push(uint32_t session, bool from_peer, const char *buf, int len)
+	{
+		datagrams.push_back({ session, from_peer, data.size(), len });
+		data.insert(data.end(), buf, buf + len);
+	}
+
+	void clear()
+	{
+		data.clear();
+		datagrams.clear();
+	}
+};
+
+static Outbox outbox;
+static volatile uint32_t keep_alive;	// results the optimiser must not drop
+
+static const uint32_t interval = 10;
+static const uint32_t ticks = 100;
+static const int active_every = 100;		// 1% of the sessions send
+static const int message_size = 200;
+
+struct Farm
+{
+	std::vector<std::unique_ptr<KCP::KCP>> sessions;
+	std::vector<std::unique_ptr<KCP::KCP>> peers;	// one per active session
+	uint32_t now = 1;
+
+	void create(size_t count)
+	{
+		sessions.reserve(count);
+		for (size_t i = 0; i < count; i++) {
+			auto kcp = std::make_unique<KCP::KCP>((uint32_t)i);
+			kcp->NoDelay(1, interval, 2, true);
+			kcp->SetOutput([i](const char *buf, int len, void *) { outbox.push((uint32_t)i, false, buf, len); return 0; });
+			kcp->Update(now);
+			sessions.push_back(std::move(kcp));
+		}
+	}
+
+	void create_peers()
+	{
+		peers.resize((sessions.size() + active_every - 1) / active_every);
+		for (size_t i = 0; i < sessions.size(); i += active_every) {
+			auto kcp = std::make_unique<KCP::KCP>((uint32_t)i);
+			kcp->NoDelay(1, interval, 2, true);
+			kcp->SetOutput([i](const char *buf, int len, void *) { outbox.push((uint32_t)i, true, buf, len); return 0; });
+			kcp->Update(now);
+			peers[i / active_every] = std::move(kcp);
+		}
+	}
+
+	// application traffic and the peers, not timed
+	void send_messages()
+	{
+		static char message[message_size] = {};
+		for (size_t i = 0; i < sessions.size(); i += active_every)
+			sessions[i]->Send(message, sizeof(message));
+	}
+
+	template<typename OnInput>
+	void deliver(OnInput on_input)
+	{
+		static std::vector<char> buffer(1 << 16);
+		for (auto &peer : peers)
+			peer->Update(now);
+		for (auto &datagram : outbox.datagrams) {
+			const char *data = outbox.data.data() + datagram.offset;
+			if (datagram.from_peer) {
+				sessions[datagram.session]->Input(data, datagram.size);
+				on_input(datagram.session);
+			}
+			else {
+				KCP::KCP &peer = *peers[datagram.session / active_every];
+				peer.Input(data, datagram.size);
+				while (peer.Receive(buffer.data(), (int)buffer.size()) > 0) {}
+			}
+		}
+		outbox.clear();
+	}
+};
+
+struct Sweep
+{
+	std::chrono::steady_clock::duration time{};
+	uint64_t allocs = 0;
+	uint64_t calls = 0;
+
+	template<typename Func>
+	void measure(Func func)
+	{
+		uint64_t before = allocations;
+		auto start = std::chrono::steady_clock::now();
+		calls += func();
+		time += std::chrono::steady_clock::now() - start;
+		allocs += allocations - before;
+	}
+
+	void print(const char *name, size_t sessions) const
+	{
+		double us = std::chrono::duration<double, std::micro>(time).count();
+		printf("  %-10s %10.1f us/tick  %7.1f ns/session  %9.0f calls/tick  %8.1f allocs/tick\n", name,
+			us / ticks, us * 1000 / ticks / sessions, (double)calls / ticks, (double)allocs / ticks);
+	}
+};
+
+static void run(size_t count)
+{
+	Farm farm;
+	int64_t heap_before = heap_bytes, rss_before = resident_bytes();
+	farm.create(count);
+	int64_t heap_after = heap_bytes, rss_after = resident_bytes();
+	farm.create_peers();
+
+	printf("[%zu sessions, %zu active]\n", count, farm.peers.size());
+	printf("  memory     %10.0f heap bytes/session  %7.0f resident bytes/session"
+		"  (sizeof KCP %zu, kcp_core %zu, buffer %u)\n",
+		(double)(heap_after - heap_before) / count, (double)(rss_after - rss_before) / count,
+		sizeof(KCP::KCP), sizeof(KCP::kcp_core), (unsigned)((farm.sessions[0]->GetMTU() + 24) * 3));
+
+	Sweep update, check, scheduled;
+
+	for (uint32_t tick = 0; tick < ticks; tick++) {
+		farm.now += interval;
+		farm.send_messages();
+		update.measure([&] {
+			for (auto &kcp : farm.sessions)
+				kcp->Update(farm.now);
+			return farm.sessions.size();
+		});
+		check.measure([&] {
+			uint32_t earliest = farm.now + 0x7fffffff;
+			for (auto &kcp : farm.sessions)
+				earliest = std::min(earliest, kcp->Check(farm.now));
+			keep_alive = earliest;
+			return farm.sessions.size();
+		});
+		farm.deliver([](uint32_t) {});
+	}
+
+	// due time per session, sessions with input are due at once. The heap
+	// may hold stale entries, only the one matching due[i] counts
+	using Due = std::pair<uint32_t, uint32_t>;
+	std::vector<Due> storage;
+	storage.reserve(count * 2);
+	std::priority_queue<Due, std::vector<Due>, std::greater<Due>> heap(std::greater<Due>(), std::move(storage));
+	std::vector<uint32_t> due(count);
+	auto schedule = [&](uint32_t i, uint32_t time) {
+		due[i] = time;
+		heap.push({ time, i });
+	};
+	for (uint32_t i = 0; i < count; i++)
+		schedule(i, farm.sessions[i]->Check(farm.now));
+
+	for (uint32_t tick = 0; tick < ticks; tick++) {
+		farm.now += interval;
+		farm.send_messages();
+		scheduled.measure([&] {
+			uint64_t calls = 0;
+			while (!heap.empty() && (int32_t)(heap.top().first - farm.now) <= 0) {
+				auto [time, i] = heap.top();
+				heap.pop();
+				if (time != due[i])
+					continue;
+				farm.sessions[i]->Update(farm.now);
+				schedule(i, farm.sessions[i]->Check(farm.now));
+				calls++;
+			}
+			return calls;
+		});
+		farm.deliver([&](uint32_t i) { if (due[i] != farm.now) schedule(i, farm.now); });
+	}
+
+	update.print("update", count);
+	check.print("check", count);
+	scheduled.print("scheduled", count);
+}
+
+int main(int argc, char *argv[])
+{
+	std::vector<size_t> counts;
+	for (int i = 1; i < argc; i++)
+		counts.push_back((size_t)strtoull(argv[i], NULL, 10));
+	if (counts.empty())
+		counts = { 1000, 10000, 100000 };
+
+	for (size_t count : counts)
+		run(count);
+
+	return 0;
+}
@@ -0,0 +1,388 @@
+//=====================================================================
+//
+// simulator.h - deterministic discrete-event network simulator
+//
+// Two kcp_core endpoints exchange datagrams over simulated paths on a
+// virtual clock. Time jumps straight to the next event: a datagram
+// arrival, the time check() asks for or an application wakeup, so a
+// run takes only the cpu time of kcp itself and the same seed always
+// gives the same result. update() is the only thing that moves kcp's
+// clock, so every visited instant first calls it on endpoints that have
+// nothing due, which only sets the clock: input() with a stale clock
+// takes short rtt samples.
+//
+// Each direction is a chain of link models, applied in the order they
+// were added:
+//
+//   vnet.path(0).add<sim::RateLimit>(250000, 32 * 1024);
+//   vnet.path(0).add<sim::Delay>(20, 30);
+//   vnet.path(0).add<sim::GilbertElliott>(0.01, 0.3, 0.0, 0.5);
+//
+//=====================================================================
+#ifndef __SIMULATOR_H__
+#define __SIMULATOR_H__
+
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "../ikcp.hpp"
+
+
+namespace sim
+{
+	// datagram buffers, slots are recycled together with their capacity
+	class PacketPool
+	{
+	public:
+		uint32_t acquire(const char *data, int size) {
+			uint32_t id;
+			if (free_slots.empty()) {
+				id = (uint32_t)slots.size();
+				slots.emplace_back();
+			}
+			else {
+				id = free_slots.back();
+				free_slots.pop_back();
+			}
+			slots[id].assign(data, data + size);
+			return id;
+		}
+
+		const std::vector<char>& get(uint32_t id) const { return slots[id]; }
+		void release(uint32_t id) { free_slots.push_back(id); }
+		size_t capacity() const { return slots.size(); }
+
+	protected:
+		std::vector<std::vector<char>> slots;
+		std::vector<uint32_t> free_slots;
+	};
+
+	// one stage of a path. 'copies' holds the time in microsec each copy
+	// of a datagram reaches this stage, a model may drop, delay or
+	// duplicate entries. Models count what they dropped
+	class LinkModel
+	{
+	public:
+		virtual ~LinkModel() = default;
+		virtual void apply(std::vector<uint64_t> &copies, int size, std::mt19937_64 &rng) = 0;
+
+		uint64_t dropped = 0;
+
+	protected:
+		static bool chance(std::mt19937_64 &rng, double probability) {
+			return probability > 0 && std::uniform_real_distribution<double>(0, 1)(rng) < probability;
+		}
+
+		template<typename Pred>
+		void drop_if(std::vector<uint64_t> &copies, Pred pred) {
+			size_t before = copies.size();
+			copies.erase(std::remove_if(copies.begin(), copies.end(), pred), copies.end());
+			dropped += before - copies.size();
+		}
+	};
+
+	// independent random loss
+	class RandomLoss : public LinkModel
+	{
+	public:
+		explicit RandomLoss(double probability) : probability(probability) {}
+
+		void apply(std::vector<uint64_t> &copies, int, std::mt19937_64 &rng) override {
+			drop_if(copies, [&](uint64_t) { return chance(rng, probability); });
+		}
+
+	protected:
+		double probability;
+	};
+
+	// two state Markov chain for burst loss, the state moves once per datagram
+	class GilbertElliott : public LinkModel
+	{
+	public:
+		GilbertElliott(double good_to_bad, double bad_to_good, double loss_good, double loss_bad) :
+			good_to_bad(good_to_bad), bad_to_good(bad_to_good), loss_good(loss_good), loss_bad(loss_bad) {}
+
+		void apply(std::vector<uint64_t> &copies, int, std::mt19937_64 &rng) override {
+			bad = bad ? !chance(rng, bad_to_good) : chance(rng, good_to_bad);
+			drop_if(copies, [&](uint64_t) { return chance(rng, bad ? loss_bad : loss_good); });
+		}
+
+		// long run loss rate
+		double average_loss() const {
+			double share_bad = good_to_bad / (good_to_bad + bad_to_good);
+			return share_bad * loss_bad + (1 - share_bad) * loss_good;
+		}
+
+	protected:
+		double good_to_bad, bad_to_good, loss_good, loss_bad;
+		bool bad = false;
+	};
+
+	// propagation delay with uniform jitter in [min, max] millisec, by
+	// default a datagram never overtakes an earlier one, so Reorder
+	// belongs after it
+	class Delay : public LinkModel
+	{
+	public:
+		Delay(uint32_t min, uint32_t max, bool keep_order = true) :
+			min(min), max(std::max(min, max)), keep_order(keep_order) {}
+
+		void apply(std::vector<uint64_t> &copies, int, std::mt19937_64 &rng) override {
+			for (uint64_t &time : copies) {
+				uint64_t delay = min;
+				if (max > min) delay += rng() % (max - min + 1);
+				time += delay * 1000;
+				if (keep_order) {
+					time = std::max(time, last);
+					last = time;
+				}
+			}
+		}
+
+	protected:
+		uint32_t min, max;
+		bool keep_order;
+		uint64_t last = 0;
+	};
+
+	// bottleneck of 'rate' bytes per second with a drop-tail queue of
+	// 'queue' bytes, 0: unlimited
+	class RateLimit : public LinkModel
+	{
+	public:
+		RateLimit(uint64_t rate, uint64_t queue) : rate(rate), queue(queue) {}
+
+		void apply(std::vector<uint64_t> &copies, int size, std::mt19937_64 &) override {
+			if (rate == 0) return;
+			drop_if(copies, [&](uint64_t &time) {
+				if (busy_until < time) busy_until = time;
+				uint64_t backlog = (busy_until - time) * rate / 1000000;
+				if (queue > 0 && backlog + size > queue)
+					return true;
+				busy_until += (uint64_t)size * 1000000 / rate;
+				time = busy_until;
+				return false;
+			});
+		}
+
+	protected:
+		uint64_t rate, queue;
+		uint64_t busy_until = 0;
+	};
+
+	// holds a datagram back by 'extra' millisec with 'probability', later
+	// datagrams overtake it
+	class Reorder : public LinkModel
+	{
+	public:
+		Reorder(double probability, uint32_t extra) : probability(probability), extra(extra) {}
+
+		void apply(std::vector<uint64_t> &copies, int, std::mt19937_64 &rng) override {
+			for (uint64_t &time : copies)
+				if (chance(rng, probability))
+					time += (uint64_t)extra * 1000;
+		}
+
+	protected:
+		double probability;
+		uint32_t extra;
+	};
+
+	// delivers a second copy with 'probability', 'gap' millisec later
+	class Duplicate : public LinkModel
+	{
+	public:
+		Duplicate(double probability, uint32_t gap = 0) : probability(probability), gap(gap) {}
+
+		void apply(std::vector<uint64_t> &copies, int, std::mt19937_64 &rng) override {
+			for (size_t i = 0, count = copies.size(); i < count; i++)
+				if (chance(rng, probability))
+					copies.push_back(copies[i] + (uint64_t)gap * 1000);
+		}
+
+	protected:
+		double probability;
+		uint32_t gap;
+	};
+
+	// one direction between the endpoints, no models: lossless and instant
+	class Path
+	{
+	public:
+		template<typename Model, typename... Args>
+		Model& add(Args&&... args) {
+			models.push_back(std::make_unique<Model>(std::forward<Args>(args)...));
+			return static_cast<Model&>(*models.back());
+		}
+
+		void clear() { models.clear(); }
+
+		// arrival times of the copies of a datagram sent at 'time'
+		void apply(std::vector<uint64_t> &copies, uint64_t time, int size, std::mt19937_64 &rng) {
+			copies.assign(1, time);
+			for (auto &model : models) {
+				if (copies.empty()) break;
+				model->apply(copies, size, rng);
+			}
+		}
+
+		uint64_t dropped() const {
+			uint64_t sum = 0;
+			for (auto &model : models) sum += model->dropped;
+			return sum;
+		}
+
+	protected:
+		std::vector<std::unique_ptr<LinkModel>> models;
+	};
+
+	struct PathStats
+	{
+		uint64_t sent = 0;			// datagrams handed to the path
+		uint64_t bytes = 0;
+		uint64_t lost = 0;			// dropped by any model
+		uint64_t duplicated = 0;
+		uint64_t delivered = 0;		// copies input to the other endpoint
+		double input_ms = 0;		// cpu time of their input() calls, see time_input()
+	};
+
+	class Simulator
+	{
+	public:
+		static constexpr uint32_t stop = 0xffffffff;
+
+		// called at every visited instant after the due datagrams were input,
+		// returns the millisec until it must run again even without events,
+		// or 'stop' to end run()
+		using App = std::function<uint32_t(uint32_t now)>;
+
+		explicit Simulator(uint64_t seed) : rng(seed) {
+			events.reserve(1024);
+			copies.reserve(4);
+		}
+
+		// datagrams of endpoint 0 go to endpoint 1 and back
+		void attach(KCP::kcp_core &first, KCP::kcp_core &second) {
+			endpoints[0] = &first;
+			endpoints[1] = &second;
+			for (int side = 0; side < 2; side++) {
+				endpoints[side]->set_output([this, side](const char *buf, int len, void *) {
+					transmit(side, buf, len);
+					return 0;
+				});
+			}
+		}
+
+		Path& path(int from) { return paths[from]; }
+		// measure the cpu time spent in input(), off by default
+		void time_input(bool enable) { timed = enable; }
+		const PathStats& stats(int from) const { return path_stats[from]; }
+		std::mt19937_64& random() { return rng; }
+		uint32_t now() const { return current; }
+		const PacketPool& pool() const { return packets; }
+
+		// returns true when the app stopped, false once 'deadline' is reached
+		bool run(uint32_t deadline, const App &app) {
+			uint32_t wakeup = current;
+			while (timediff(current, deadline) <= 0) {
+				for (KCP::kcp_core *kcp : endpoints)
+					if (timediff(kcp->check(current), current) > 0)
+						kcp->update(current);
+				deliver();
+
+				if (app) {
+					uint32_t wait = app(current);
+					if (wait == stop)
+						return true;
+					wakeup = current + wait;
+				}
+
+				uint32_t next = wakeup;
+				for (KCP::kcp_core *kcp : endpoints) {
+					if (timediff(kcp->check(current), current) <= 0)
+						kcp->update(current);
+					uint32_t due = kcp->check(current);
+					if (timediff(due, next) < 0) next = due;
+				}
+				if (!events.empty()) {
+					uint32_t arrival = (uint32_t)((events.front().time + 999) / 1000);
+					if (timediff(arrival, next) < 0) next = arrival;
+				}
+				if (timediff(next, current) <= 0) next = current + 1;
+				current = next;
+			}
+			return false;
+		}
+
+	protected:
+		struct Event {
+			uint64_t time;		// arrival in microsec
+			uint64_t seq;
+			uint32_t slot;
+			int to;
+		};
+
+		static bool arrives_after(const Event &a, const Event &b) {
+			return a.time != b.time ? a.time > b.time : a.seq > b.seq;
+		}
+
+		static int32_t timediff(uint32_t later, uint32_t earlier) {
+			return (int32_t)(later - earlier);
+		}
+
+		void transmit(int from, const char *data, int size) {
+			PathStats &stat = path_stats[from];
+			stat.sent++;
+			stat.bytes += size;
+			paths[from].apply(copies, (uint64_t)current * 1000, size, rng);
+			if (copies.empty())
+				stat.lost++;
+			else
+				stat.duplicated += copies.size() - 1;
+			for (uint64_t arrival : copies) {
+				events.push_back({ arrival, sequence++, packets.acquire(data, size), 1 - from });
+				std::push_heap(events.begin(), events.end(), arrives_after);
+			}
+		}
+
+		void deliver() {
+			while (!events.empty() && events.front().time <= (uint64_t)current * 1000) {
+				std::pop_heap(events.begin(), events.end(), arrives_after);
+				Event ev = events.back();
+				events.pop_back();
+				const std::vector<char> &data = packets.get(ev.slot);
+				PathStats &stat = path_stats[1 - ev.to];
+				stat.delivered++;
+				if (timed) {
+					auto start = std::chrono::steady_clock::now();
+					endpoints[ev.to]->input(data.data(), (long)data.size());
+					stat.input_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+				}
+				else {
+					endpoints[ev.to]->input(data.data(), (long)data.size());
+				}
+				packets.release(ev.slot);
+			}
+		}
+
+		KCP::kcp_core *endpoints[2] = {};
+		Path paths[2];
+		PathStats path_stats[2];
+		std::vector<uint64_t> copies;
+		std::vector<Event> events;		// min-heap on (time, seq)
+		uint64_t sequence = 0;
+		PacketPool packets;
+		std::mt19937_64 rng;
+		uint32_t current = 1;
+		bool timed = false;
+	};
+}
+
+
+#endif
@@ -3,7 +3,11 @@
 // test.cpp - kcp 测试用例
 //
 // 说明：
-// gcc test.cpp -o test -lstdc++
+// g++ -std=c++17 -O2 test.cpp ../ikcp.cpp ../ikcp_congestion.cpp ../ikcp_fec.cpp -o test
+//
+// 网络由 simulator.h 以虚拟时钟模拟，每个模式只需几毫秒 cpu 时间，
+// 相同的种子得到相同的结果：./test [模式] [种子] [trace文件前缀]
+// 给出前缀时两个端点的事件记录到 <前缀>-<模式>.bin，用 tracedump 查看
 //
 //=====================================================================
 
@@ -11,26 +15,34 @@
 #include <stdlib.h>
 
 #include "test.h"
+#include "simulator.h"
 #include "../ikcp.hpp"
 
 
-// 模拟网络
-LatencySimulator *vnet;
-
-// 模拟网络：模拟发送一个 udp包
-int udp_output(const char *buf, int len, void *user)
-{
-	union { int id; void *ptr; } parameter;
-	parameter.ptr = user;
-	vnet->send(parameter.id, buf, len);
-	return 0;
-}
-
-// 测试用例
-void test(int mode)
+// 测试用例，数据错乱时返回 false
+bool test(int mode, uint64_t seed, const char *trace_prefix)
 {
 	// 创建模拟网络：丢包率10%，Rtt 60ms~125ms
-	vnet = new LatencySimulator(10, 60, 125);
+	// 单程丢包率 5%，单程延迟 30ms~62ms
+	// 模式 4 为恶劣网络：2Mbps 瓶颈带宽和 16KB 队列，突发丢包，
+	// 5% 的包晚到 40ms 造成乱序，2% 的包重复
+	sim::Simulator vnet(seed);
+	for (int side = 0; side < 2; side++)
+	{
+		if (mode == 4)
+		{
+			vnet.path(side).add<sim::RateLimit>(2'000'000 / 8, 16 * 1024);
+			vnet.path(side).add<sim::GilbertElliott>(0.02, 0.25, 0.01, 0.5);
+			vnet.path(side).add<sim::Delay>(30, 62);
+			vnet.path(side).add<sim::Reorder>(0.05, 40);
+			vnet.path(side).add<sim::Duplicate>(0.02, 1);
+		}
+		else
+		{
+			vnet.path(side).add<sim::RandomLoss>(0.05);
+			vnet.path(side).add<sim::Delay>(30, 62);
+		}
+	}
 
 	// 创建两个端点的 kcp对象，第一个参数 conv是会话编号，同一个会话需要相同
 	// 最后一个是 user参数，用来传递标识
@@ -39,19 +51,30 @@ void test(int mode)
 	kcp1.initialise(0x11223344, (void*)0);
 	kcp2.initialise(0x11223344, (void*)1);
 
-	// 设置kcp的下层输出，这里为 udp_output，模拟udp网络输出函数
-	kcp1.set_output(udp_output);
-	kcp2.set_output(udp_output);
+	// 设置kcp的下层输出为模拟网络
+	vnet.attach(kcp1, kcp2);
+
+	// 两个端点在同一线程，可以共用一个 trace 环
+	auto trace = std::make_shared<KCP::trace_ring>(1 << 16);
+	if (trace_prefix != nullptr)
+	{
+		kcp1.set_trace(trace);
+		kcp2.set_trace(trace);
+	}
+
+	// 每条消息的延迟直方图：kcp1 发送到确认，kcp2 首个分片到达到被读走
+	kcp1.set_latency_tracking(true);
+	kcp2.set_latency_tracking(true);
 	//kcp1.SetStreamMode(true);
 	//kcp2.SetStreamMode(true);
 
-	uint32_t current = iclock();
-	uint32_t slap = current + 20;
+	uint32_t slap = vnet.now() + 20;
 	uint32_t index = 0;
 	uint32_t next = 0;
 	int64_t sumrtt = 0;
 	int count = 0;
 	int maxrtt = 0;
+	bool ok = true;
 
 	// 配置窗口大小：平均延迟200ms，每20ms发送一个包，
 	// 而考虑到丢包重发，设置最大收发窗口为128
@@ -82,7 +105,7 @@ void test(int mode)
 		kcp1.rx_minrto = 10;
 		//kcp1.fastresend = 1;
 		break;
-	default:
+	case 3:
 		// 启动快速模式
 		// 第1个参数 nodelay-启用以后若干常规加速将启动
 		// 第2个参数 interval为内部处理时钟，默认设置为 10ms
@@ -92,26 +115,23 @@ void test(int mode)
 		kcp2.set_nodelay(2, 10, 2, 1);
 		kcp1.rx_minrto = 10;
 		//kcp1.fastresend = 1;
+		break;
+	default:
+		// 快速模式，恶劣网络
+		kcp1.set_nodelay(1, 10, 2, 1);
+		kcp2.set_nodelay(1, 10, 2, 1);
+		kcp1.rx_minrto = 10;
 	}
 
 	char buffer[2000] = {};
+	std::vector<char> std_buffer(2000);
 	int hr;
 
 	uint32_t ts1 = iclock();
 
-	while (1)
+	// 模拟器在每个事件时刻调用，返回距下次必须调用的毫秒数
+	vnet.run(vnet.now() + 600000, [&](uint32_t current) -> uint32_t
 	{
-		isleep(1);
-		current = iclock();
-		if (kcp1.nocwnd == 0)
-			kcp1.update(iclock());
-		else
-			kcp1.update_quick(iclock());
-		if (kcp2.nocwnd == 0)
-			kcp2.update(iclock());
-		else
-			kcp2.update_quick(iclock());
-
 		// 每隔 20ms，kcp1发送数据
 		for (; current >= slap; slap += 20)
 		{
@@ -123,30 +143,10 @@ void test(int mode)
 			assert(ret > 0);
 		}
 
-		// 处理虚拟网络：检测是否有udp包从p1->p2
-		while (1)
-		{
-			hr = vnet->recv(1, buffer, 2000);
-			if (hr < 0) break;
-			// 如果 p2收到udp，则作为下层协议输入到kcp2
-			kcp2.input(buffer, hr);
-		}
-
-		// 处理虚拟网络：检测是否有udp包从p2->p1
-		while (1)
-		{
-			hr = vnet->recv(0, buffer, 2000);
-			if (hr < 0) break;
-			//printf("User conv: %u\n", kcp::kcp::get_conv(buffer));
-			// 如果 p1收到udp，则作为下层协议输入到kcp1
-			kcp1.input(buffer, hr);
-		}
-
 		// kcp2接收到任何包都返回回去
 		while (1)
 		{
-			std::vector<char> std_buffer(2000);
-			hr = kcp2.receive(std_buffer.data(), std_buffer.size());
+			hr = kcp2.receive(std_buffer.data(), (int)std_buffer.size());
 			// 没有收到包就退出
 			if (hr < 0) break;
 			// 如果收到包就回射
@@ -156,8 +156,7 @@ void test(int mode)
 		// kcp1收到kcp2的回射数据
 		while (1)
 		{
-			std::vector<char> std_buffer(2000);
-			hr = kcp1.receive(std_buffer.data(), std_buffer.size());
+			hr = kcp1.receive(std_buffer.data(), (int)std_buffer.size());
 			// 没有收到包就退出
 			if (hr < 0) break;
 			uint32_t sn = *(uint32_t*)(std_buffer.data() + 0);
@@ -168,45 +167,118 @@ void test(int mode)
 			{
 				// 如果收到的包不连续
 				printf("ERROR sn %d<->%d\n", (int)count, (int)next);
-				return;
+				ok = false;
+				return sim::Simulator::stop;
 			}
 
 			next++;
 			sumrtt += rtt;
 			count++;
 			if (rtt > (uint32_t)maxrtt) maxrtt = rtt;
-
-			printf("[RECV] mode=%d sn=%d rtt=%d\n", mode, (int)sn, (int)rtt);
 		}
-		if (next > 1000) break;
-	}
+		if (next > 1000) return sim::Simulator::stop;
+		return slap - current;
+	});
 
 	ts1 = iclock() - ts1;
+	if (!ok) return false;
+
+	const char *names[5] = { "default", "normal", "fast", "fast2", "lossy link" };
+	printf("%s mode result (%dms virtual, %dms cpu):\n", names[mode], (int)(vnet.now() - 1), (int)ts1);
+	printf("avgrtt=%d maxrtt=%d tx=%d lost=%d duplicated=%d\n", (int)(sumrtt / (count ? count : 1)), (int)maxrtt,
+		(int)vnet.stats(0).sent, (int)vnet.stats(0).lost, (int)vnet.stats(0).duplicated);
+	KCP::message_latency latency1 = kcp1.get_latency(), latency2 = kcp2.get_latency();
+	printf("ack p50=%u p99=%u p999=%u, receive wait p50=%u p99=%u p999=%u\n",
+		latency1.ack_latency.percentile(50), latency1.ack_latency.percentile(99), latency1.ack_latency.percentile(99.9),
+		latency2.receive_wait.percentile(50), latency2.receive_wait.percentile(99), latency2.receive_wait.percentile(99.9));
 
-	const char *names[4] = { "default", "normal", "fast", "fast2" };
-	printf("%s mode result (%dms):\n", names[mode], (int)ts1);
-	printf("avgrtt=%d maxrtt=%d tx=%d\n", (int)(sumrtt / count), (int)maxrtt, (int)vnet->tx1);
-	printf("press enter to next ...\n");
-	char ch; scanf("%c", &ch);
+	if (trace_prefix != nullptr)
+	{
+		char path[1024];
+		snprintf(path, sizeof(path), "%s-%d.bin", trace_prefix, mode);
+		if (!trace->save(path))
+			printf("cannot write %s\n", path);
+	}
+	return next > 1000;
 }
 
-int main()
+// 只有接收端开启 fec 时，未经 fec 封装的数据包照常解析。大消息在流 0 上的分片
+// 同时带 IKCP_CMD_FRGEXT 和 IKCP_CMD_STREAM，紧凑格式下首个 cmd 字节为 0xf9，
+// 不能被当作 fec 包。kcp2 的回包经 fec 封装，kcp1 无法解析，只看 kcp2 能否收全
+bool test_fec_cmd(uint64_t seed)
 {
-	test_k(0);	// 默认模式，类似 TCP：正常模式，无快速重传，常规流控
-	test_k(1);	// 普通模式，关闭流控等
-	test_k(2);	// 快速模式，所有开关都打开，且关闭流控
-	test_k(3);	// 快速模式，所有开关都打开，且关闭流控
-	return 0;
+	sim::Simulator vnet(seed);
+	for (int side = 0; side < 2; side++)
+		vnet.path(side).add<sim::Delay>(20, 20);
+
+	KCP::kcp_core kcp1;
+	KCP::kcp_core kcp2;
+	kcp1.initialise(0x11223344, (void*)0);
+	kcp2.initialise(0x11223344, (void*)1);
+	vnet.attach(kcp1, kcp2);
+
+	uint32_t features = IKCP_FEATURE_COMPACT | IKCP_FEATURE_LARGE_MSG | IKCP_FEATURE_STREAMS;
+	for (KCP::kcp_core *kcp : { &kcp1, &kcp2 })
+	{
+		kcp->set_nodelay(1, 10, 2, 1);
+		kcp->set_wndsize(512, 512);
+		kcp->set_features(features);
+	}
+
+	// 约 290 个分片，前 30 多个的 frg 超过 255
+	std::vector<char> message(400 * 1000), received(message.size());
+	for (size_t i = 0; i < message.size(); i++)
+		message[i] = (char)(i * 7 + i / 251);
+
+	bool sent = false;
+	int hr = -1;
+	vnet.run(vnet.now() + 10000, [&](uint32_t) -> uint32_t
+	{
+		if (!sent && (kcp1.get_negotiated() & features) == features && (kcp2.get_negotiated() & features) == features)
+		{
+			kcp2.set_fec(4, 2);
+			kcp1.send(message.data(), (int)message.size());
+			sent = true;
+		}
+		hr = kcp2.receive(received.data(), (int)received.size());
+		return hr < 0 ? 10 : sim::Simulator::stop;
+	});
+
+	bool ok = sent && hr == (int)message.size() && received == message;
+	printf("fec receiver, compact frgext + stream segments: %s\n", ok ? "ok" : "ERROR");
+	return ok;
+}
+
+// 不带参数时依次运行全部模式，也可以指定一个模式和种子：./test 2 7
+int main(int argc, char *argv[])
+{
+	int first = 0, last = 5;
+	uint64_t seed = 1;
+	const char *trace_prefix = argc > 3 ? argv[3] : nullptr;
+	if (argc > 1)
+		first = last = atoi(argv[1]);
+	if (argc > 2)
+		seed = strtoull(argv[2], NULL, 10);
+
+	bool ok = true;
+	for (int mode = first; mode <= last; mode++)
+		ok = (mode == 5 ? test_fec_cmd(seed) : test(mode, seed, trace_prefix)) && ok;	// 0 默认模式，类似 TCP：正常模式，无快速重传，常规流控
+								// 1 普通模式，关闭流控等
+								// 2 快速模式，所有开关都打开，且关闭流控
+								// 3 快速模式，nodelay=2
+								// 4 快速模式，瓶颈带宽、突发丢包、乱序和重复
+								// 5 只有接收端开启 fec
+	return ok ? 0 : 1;
 }
 
 /*
-default mode result (20917ms):
-avgrtt=740 maxrtt=1507
+seed 1:
+default mode result (30282ms virtual, 3ms cpu):
+avgrtt=5917 maxrtt=10339 tx=1487
 
-normal mode result (20131ms):
-avgrtt=156 maxrtt=571
+normal mode result (20282ms virtual, 2ms cpu):
+avgrtt=175 maxrtt=650 tx=1366
 
-fast mode result (20207ms):
-avgrtt=138 maxrtt=392
+fast mode result (20106ms virtual, 3ms cpu):
+avgrtt=144 maxrtt=345 tx=1574
 */
-
@@ -0,0 +1,141 @@
+//=====================================================================
+//
+// tracedump.cpp - decoder for trace files written by trace_ring::save
+//
+// build:
+// g++ -std=c++17 -O2 tracedump.cpp -o tracedump
+//
+// usage:
+// ./tracedump trace.bin [text|csv|summary] [conv]
+//
+//   text      one line per record (default)
+//   csv       timeline for plotting: time relative to the first record,
+//             rtt filled in for ack_in and sack_in
+//   summary   records per event and conv, the time span covered and
+//             how many records the ring had overwritten
+//
+// Only records of 'conv' are shown when it is given.
+//
+//=====================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <map>
+#include <vector>
+
+#include "../ikcp_trace.hpp"
+
+
+static bool load(const char *path, KCP::trace_file_header &header, std::vector<KCP::trace_record> &records)
+{
+	FILE *fp = fopen(path, "rb");
+	if (fp == nullptr)
+	{
+		printf("cannot open %s\n", path);
+		return false;
+	}
+
+	bool ok = fread(&header, sizeof(header), 1, fp) == 1 &&
+		memcmp(header.magic, "KCPTRACE", 8) == 0 &&
+		header.record_size == sizeof(KCP::trace_record);
+	if (ok)
+	{
+		records.resize(header.count);
+		ok = fread(records.data(), sizeof(KCP::trace_record), records.size(), fp) == records.size();
+	}
+	fclose(fp);
+
+	if (!ok)
+		printf("%s is not a trace file of this version\n", path);
+	return ok;
+}
+
+static void print_text(const std::vector<KCP::trace_record> &records)
+{
+	char line[256];
+	for (auto &rec : records)
+	{
+		KCP::format_trace(rec, line, sizeof(line));
+		printf("%s\n", line);
+	}
+}
+
+static void print_csv(const std::vector<KCP::trace_record> &records)
+{
+	printf("time_ms,conv,event,sn,ts,len,xmit,rto,cwnd,rtt\n");
+	uint32_t start = records.empty() ? 0 : records.front().time;
+	for (auto &rec : records)
+	{
+		bool ack = rec.event == (uint16_t)KCP::trace_event::ack_in || rec.event == (uint16_t)KCP::trace_event::sack_in;
+		printf("%ld,%lu,%s,%lu,%lu,%lu,%u,%lu,%lu,", (long)(int32_t)(rec.time - start),
+			(unsigned long)rec.conv, KCP::trace_event_name(rec.event), (unsigned long)rec.sn,
+			(unsigned long)rec.ts, (unsigned long)rec.len, (unsigned)rec.xmit,
+			(unsigned long)rec.rto, (unsigned long)rec.cwnd);
+		if (ack)
+			printf("%ld\n", (long)(int32_t)(rec.time - rec.ts));
+		else
+			printf("\n");
+	}
+}
+
+static void print_summary(const KCP::trace_file_header &header, const std::vector<KCP::trace_record> &records)
+{
+	printf("%lu records, %llu written, %llu overwritten\n", (unsigned long)records.size(),
+		(unsigned long long)header.written, (unsigned long long)(header.written - header.count));
+	if (records.empty())
+		return;
+	printf("time %lu .. %lu ms\n", (unsigned long)records.front().time, (unsigned long)records.back().time);
+
+	std::map<uint32_t, std::vector<uint64_t>> counts;	// conv -> per event
+	for (auto &rec : records)
+	{
+		auto &count = counts[rec.conv];
+		count.resize((size_t)KCP::trace_event::count);
+		if (rec.event < count.size())
+			count[rec.event]++;
+	}
+
+	for (auto &[conv, count] : counts)
+	{
+		printf("conv %lu\n", (unsigned long)conv);
+		for (size_t event = 0; event < count.size(); event++)
+			if (count[event] > 0)
+				printf("  %-16s %llu\n", KCP::trace_event_name((uint32_t)event), (unsigned long long)count[event]);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2)
+	{
+		printf("usage: %s trace.bin [text|csv|summary] [conv]\n", argv[0]);
+		return 1;
+	}
+
+	KCP::trace_file_header header;
+	std::vector<KCP::trace_record> records;
+	if (!load(argv[1], header, records))
+		return 1;
+
+	if (argc > 3)
+	{
+		uint32_t conv = (uint32_t)strtoul(argv[3], NULL, 0);
+		std::vector<KCP::trace_record> selected;
+		for (auto &rec : records)
+			if (rec.conv == conv)
+				selected.push_back(rec);
+		records.swap(selected);
+	}
+
+	const char *format = argc > 2 ? argv[2] : "text";
+	if (strcmp(format, "csv") == 0)
+		print_csv(records);
+	else if (strcmp(format, "summary") == 0)
+		print_summary(header, records);
+	else
+		print_text(records);
+
+	return 0;
+}